@@ -0,0 +1,433 @@
+#include <vector>
+#include <string>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "util.h"
+#include "async_reader.h"
+
+static AsyncReadEngine configuredEngine = ARE_AUTO;
+static int configuredQueueDepth = ASYNC_READ_DEFAULT_QUEUE_DEPTH;
+static StreamingIoMode configuredStreamingMode = SIO_OFF;
+
+AsyncReadEngine parseAsyncReadEngine(const std::string& _name)
+{
+	if (_name == "auto") return ARE_AUTO;
+	if (_name == "io_uring") return ARE_IO_URING;
+	if (_name == "pread") return ARE_PREAD;
+	exitWithError("Unknown io engine: " + _name + " (expected auto, io_uring or pread)");
+	return ARE_AUTO;
+}
+
+StreamingIoMode parseStreamingIoMode(const std::string& _name)
+{
+	if (_name == "off") return SIO_OFF;
+	if (_name == "fadvise") return SIO_FADVISE;
+	if (_name == "direct") return SIO_DIRECT;
+	exitWithError("Unknown streaming io mode: " + _name + " (expected off, fadvise or direct)");
+	return SIO_OFF;
+}
+
+void configureAsyncReads(AsyncReadEngine _engine, int _queueDepth, StreamingIoMode _streamingMode)
+{
+	configuredEngine = _engine;
+	configuredQueueDepth = _queueDepth;
+	configuredStreamingMode = _streamingMode;
+}
+
+void releasePageCache(const std::string& _path)
+{
+	if (configuredStreamingMode == SIO_OFF) return;
+	
+	int fd = open(_path.c_str(), O_RDONLY);
+	if (fd == -1) return;
+	
+	// Dirty pages can't be dropped, so they are written back first
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+// Reads until _bytes bytes are read, the file ends, or a read fails. Returns the amount of bytes read, or -1 on failure.
+static long preadFully(int _fd, char* _dest, long _bytes, long _offset)
+{
+	long done = 0;
+	while (done < _bytes)
+	{
+		ssize_t result = pread(_fd, _dest + done, _bytes - done, _offset + done);
+		if (result < 0 && errno == EINTR) continue;
+		if (result < 0) return -1;
+		if (result == 0) break;
+		done += result;
+	}
+	return done;
+}
+
+// A minimal io_uring submission and completion queue, driven with the raw system calls.
+// One ring per thread, shared by all readers on that thread; the user_data of a request is the AsyncFileReader slot.
+class IoUring
+{
+private:
+	int ringFd = -1;
+	void* sqRing = MAP_FAILED;
+	void* cqRing = MAP_FAILED;
+	size_t sqRingBytes = 0;
+	size_t cqRingBytes = 0;
+	struct io_uring_sqe* sqes = (struct io_uring_sqe*)MAP_FAILED;
+	size_t sqesBytes = 0;
+	
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned sqMask;
+	unsigned sqEntries;
+	unsigned* sqArray;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned cqMask;
+	struct io_uring_cqe* cqes;
+	
+	unsigned amountQueued = 0;
+public:
+	IoUring(unsigned _entries)
+	{
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		this->ringFd = syscall(__NR_io_uring_setup, _entries, &params);
+		if (this->ringFd < 0) return;
+		
+		this->sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		this->cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+		bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (singleMmap) this->sqRingBytes = this->cqRingBytes = std::max(this->sqRingBytes, this->cqRingBytes);
+		
+		this->sqRing = mmap(nullptr, this->sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_SQ_RING);
+		if (this->sqRing == MAP_FAILED) return;
+		this->cqRing = singleMmap ? this->sqRing : mmap(nullptr, this->cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_CQ_RING);
+		if (this->cqRing == MAP_FAILED) return;
+		this->sqesBytes = params.sq_entries * sizeof(struct io_uring_sqe);
+		this->sqes = (struct io_uring_sqe*)mmap(nullptr, this->sqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_SQES);
+		if (this->sqes == MAP_FAILED) return;
+		
+		char* sq = (char*)this->sqRing;
+		this->sqHead = (unsigned*)(sq + params.sq_off.head);
+		this->sqTail = (unsigned*)(sq + params.sq_off.tail);
+		this->sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+		this->sqEntries = *(unsigned*)(sq + params.sq_off.ring_entries);
+		this->sqArray = (unsigned*)(sq + params.sq_off.array);
+		
+		char* cq = (char*)this->cqRing;
+		this->cqHead = (unsigned*)(cq + params.cq_off.head);
+		this->cqTail = (unsigned*)(cq + params.cq_off.tail);
+		this->cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+		this->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	}
+	
+	~IoUring()
+	{
+		if (this->sqes != MAP_FAILED) munmap(this->sqes, this->sqesBytes);
+		if (this->cqRing != MAP_FAILED && this->cqRing != this->sqRing) munmap(this->cqRing, this->cqRingBytes);
+		if (this->sqRing != MAP_FAILED) munmap(this->sqRing, this->sqRingBytes);
+		if (this->ringFd >= 0) close(this->ringFd);
+	}
+	
+	bool isUsable() const
+	{
+		return this->ringFd >= 0 && this->sqRing != MAP_FAILED && this->cqRing != MAP_FAILED && this->sqes != MAP_FAILED;
+	}
+	
+	// Queues a readv of _iov, which must stay valid until it completes. Submits first if the queue is full.
+	void queueRead(int _fd, const struct iovec* _iov, long _offset, uint64_t _userData)
+	{
+		unsigned tail = *this->sqTail;
+		while (tail - __atomic_load_n(this->sqHead, __ATOMIC_ACQUIRE) >= this->sqEntries) this->enter(0);
+		
+		unsigned index = tail & this->sqMask;
+		struct io_uring_sqe* sqe = &this->sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_READV;
+		sqe->fd = _fd;
+		sqe->addr = (uint64_t)_iov;
+		sqe->len = 1;
+		sqe->off = _offset;
+		sqe->user_data = _userData;
+		this->sqArray[index] = index;
+		
+		__atomic_store_n(this->sqTail, tail + 1, __ATOMIC_RELEASE);
+		this->amountQueued++;
+	}
+	
+	// Submits everything that was queued, and waits until at least _minComplete requests have completed
+	void enter(unsigned _minComplete)
+	{
+		while (true)
+		{
+			long submitted = syscall(__NR_io_uring_enter, this->ringFd, this->amountQueued, _minComplete, _minComplete != 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+			if (submitted < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) continue;
+			if (submitted < 0) exitWithError("io_uring_enter failed: " + std::string(strerror(errno)));
+			this->amountQueued -= submitted;
+			return;
+		}
+	}
+	
+	// Calls _onComplete(userData, result) for every completed request
+	template <typename F>
+	void reap(F _onComplete)
+	{
+		unsigned head = *this->cqHead;
+		unsigned tail = __atomic_load_n(this->cqTail, __ATOMIC_ACQUIRE);
+		while (head != tail)
+		{
+			struct io_uring_cqe* cqe = &this->cqes[head & this->cqMask];
+			_onComplete(cqe->user_data, cqe->res);
+			head++;
+		}
+		__atomic_store_n(this->cqHead, head, __ATOMIC_RELEASE);
+	}
+};
+
+// The ring of the calling thread, set up on first use. nullptr if io_uring is not available.
+static IoUring* ringForThisThread()
+{
+	thread_local std::unique_ptr<IoUring> ring;
+	thread_local bool triedSetup = false;
+	if (!triedSetup)
+	{
+		triedSetup = true;
+		ring = std::make_unique<IoUring>(std::min(4096, std::max(8, configuredQueueDepth * 2)));
+		if (!ring->isUsable()) ring.reset();
+	}
+	return ring.get();
+}
+
+// Threads that run blocking reads for the pread engine. Created on first use and never stopped.
+class PreadPool
+{
+private:
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<std::function<void()>> tasks;
+	
+	PreadPool()
+	{
+		for (int i=0; i<ASYNC_READ_POOL_THREADS; i++)
+		{
+			std::thread([this](){
+				while (true)
+				{
+					std::function<void()> task;
+					{
+						std::unique_lock<std::mutex> lock(this->mutex);
+						this->cv.wait(lock, [this]{ return !this->tasks.empty(); });
+						task = std::move(this->tasks.front());
+						this->tasks.pop_front();
+					}
+					task();
+				}
+			}).detach();
+		}
+	}
+public:
+	// Never destroyed, so the detached threads never see it go away
+	static PreadPool& get()
+	{
+		static PreadPool* pool = new PreadPool();
+		return *pool;
+	}
+	
+	void run(std::function<void()> _task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->tasks.push_back(std::move(_task));
+		}
+		this->cv.notify_one();
+	}
+};
+
+AsyncFileReader::AsyncFileReader(int _fd, long _fileBytes, long _chunkBytes) :
+	fd(_fd),
+	fileBytes(_fileBytes),
+	chunkBytes(_chunkBytes),
+	queueDepth(configuredQueueDepth)
+{
+	this->amountChunks = (_fileBytes + _chunkBytes - 1) / _chunkBytes;
+	
+	if (configuredStreamingMode == SIO_DIRECT && _chunkBytes % DIRECT_IO_ALIGNMENT == 0)
+	{
+		// Opening the file again keeps _fd cached for the short reads at the end of the file, and leaves its flags alone
+		this->directFd = open(("/proc/self/fd/" + std::to_string(_fd)).c_str(), O_RDONLY | O_DIRECT);
+	}
+	if (configuredStreamingMode != SIO_OFF && this->directFd == -1)
+	{
+		posix_fadvise(_fd, 0, _fileBytes, POSIX_FADV_SEQUENTIAL);
+		this->dropConsumedChunks = true;
+	}
+	
+	if (configuredEngine != ARE_PREAD)
+	{
+		this->ring = ringForThisThread();
+		if (this->ring == nullptr && configuredEngine == ARE_IO_URING) exitWithError("io_uring is not available on this system");
+	}
+	
+	for (int i=0; i<this->queueDepth; i++)
+	{
+		this->slots.push_back(std::make_unique<Slot>());
+		Slot& slot = *this->slots.back();
+		slot.owner = this;
+		slot.done = true;
+		if (this->directFd != -1)
+		{
+			void* aligned = nullptr;
+			if (posix_memalign(&aligned, DIRECT_IO_ALIGNMENT, _chunkBytes) != 0) exitWithError("Failed to allocate an aligned read buffer");
+			slot.alignedBuffer.reset((char*)aligned);
+		}
+	}
+}
+
+AsyncFileReader::~AsyncFileReader()
+{
+	for (auto& slot : this->slots) this->waitFor(*slot);
+	if (this->directFd != -1) close(this->directFd);
+	this->dropHandedOutChunk();
+}
+
+void AsyncFileReader::dropHandedOutChunk()
+{
+	if (!this->dropConsumedChunks || this->handedOutBytes == 0) return;
+	posix_fadvise(this->fd, this->handedOutOffset, this->handedOutBytes, POSIX_FADV_DONTNEED);
+	this->handedOutBytes = 0;
+}
+
+// A short read from io_uring is finished with pread; it only happens when the file shrinks or the read is interrupted
+void AsyncFileReader::complete(Slot* _slot, long _result)
+{
+	// An O_DIRECT read of the last chunk may return bytes the file got since the reader was created
+	_result = std::min(_result, _slot->bytes);
+	if (_result >= 0 && _result < _slot->bytes)
+	{
+		long rest = preadFully(_slot->owner->fd, _slot->readBuffer + _result, _slot->bytes - _result, _slot->offset + _result);
+		_result = rest < 0 ? -1 : _result + rest;
+	}
+	_slot->result = _result;
+	_slot->done = true;
+	_slot->owner->amountInFlight--;
+}
+
+void AsyncFileReader::issue(Slot& _slot)
+{
+	_slot.offset = this->nextChunkToIssue * this->chunkBytes;
+	_slot.bytes = std::min(this->chunkBytes, this->fileBytes - _slot.offset);
+	_slot.done = false;
+	this->nextChunkToIssue++;
+	
+	// O_DIRECT reads whole aligned blocks, so the last chunk is read as far as the next alignment boundary
+	int readFd = this->fd;
+	long readBytes = _slot.bytes;
+	if (this->directFd != -1)
+	{
+		readFd = this->directFd;
+		readBytes = (_slot.bytes + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+		_slot.readBuffer = _slot.alignedBuffer.get();
+	}
+	else
+	{
+		_slot.buffer.resize(_slot.bytes);
+		_slot.readBuffer = _slot.buffer.data();
+	}
+	
+	if (this->ring != nullptr)
+	{
+		this->amountInFlight++;
+		_slot.iov.iov_base = _slot.readBuffer;
+		_slot.iov.iov_len = readBytes;
+		this->ring->queueRead(readFd, &_slot.iov, _slot.offset, (uint64_t)&_slot);
+	}
+	else
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->amountInFlight++;
+		}
+		Slot* slot = &_slot;
+		PreadPool::get().run([slot, readFd, readBytes](){
+			long result = preadFully(readFd, slot->readBuffer, readBytes, slot->offset);
+			AsyncFileReader* owner = slot->owner;
+			std::lock_guard<std::mutex> lock(owner->mutex);
+			complete(slot, result);
+			owner->cv.notify_all();
+		});
+	}
+}
+
+void AsyncFileReader::waitFor(Slot& _slot)
+{
+	if (this->ring != nullptr)
+	{
+		while (!_slot.done)
+		{
+			this->ring->enter(1);
+			this->ring->reap([](uint64_t _userData, int _result){
+				complete((Slot*)_userData, _result);
+			});
+		}
+	}
+	else
+	{
+		std::unique_lock<std::mutex> lock(this->mutex);
+		this->cv.wait(lock, [&_slot]{ return _slot.done; });
+	}
+}
+
+ReadChunkResult AsyncFileReader::next(std::vector<char>& _chunk)
+{
+	if (!this->started)
+	{
+		this->started = true;
+		for (int i=0; i<this->queueDepth && this->nextChunkToIssue < this->amountChunks; i++) this->issue(*this->slots[i]);
+		if (this->ring != nullptr) this->ring->enter(0);
+	}
+	
+	if (this->nextChunkToReturn == this->amountChunks) return RCR_END_OF_FILE;
+	
+	Slot& slot = *this->slots[this->nextChunkToReturn % this->queueDepth];
+	this->waitFor(slot);
+	if (slot.result != slot.bytes) return RCR_ERROR;
+	
+	this->dropHandedOutChunk();
+	this->handedOutOffset = slot.offset;
+	this->handedOutBytes = slot.bytes;
+	
+	if (this->directFd != -1)
+	{
+		_chunk.resize(slot.bytes);
+		memcpy(_chunk.data(), slot.readBuffer, slot.bytes);
+	}
+	else
+	{
+		std::swap(_chunk, slot.buffer);
+	}
+	this->nextChunkToReturn++;
+	
+	// The slot is free again, so start reading the chunk queueDepth chunks ahead into it
+	if (this->nextChunkToIssue < this->amountChunks)
+	{
+		this->issue(slot);
+		if (this->ring != nullptr) this->ring->enter(0);
+	}
+	
+	return RCR_CHUNK;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+#include <sys/uio.h>
+
+// How AsyncFileReader reads, set with --io-engine=
+//   auto     - io_uring if the kernel allows it, otherwise pread
+//   io_uring - io_uring only, exits with an error if it is not available
+//   pread    - blocking pread calls on a shared pool of ASYNC_READ_POOL_THREADS threads
+enum AsyncReadEngine
+{
+	ARE_AUTO,
+	ARE_IO_URING,
+	ARE_PREAD
+};
+
+// How reads treat the page cache, set with --streaming-io= for commands that read a lot of data once
+//   off     - normal cached reads
+//   fadvise - tells the kernel reads are sequential, and drops every chunk from the page cache once it's consumed
+//   direct  - reads with O_DIRECT into aligned buffers, bypassing the page cache. Falls back to fadvise on
+//             filesystems that don't support O_DIRECT.
+enum StreamingIoMode
+{
+	SIO_OFF,
+	SIO_FADVISE,
+	SIO_DIRECT
+};
+
+#define ASYNC_READ_DEFAULT_QUEUE_DEPTH 4
+
+// O_DIRECT buffers, offsets and lengths are aligned to this
+#define DIRECT_IO_ALIGNMENT 4096
+#define ASYNC_READ_POOL_THREADS 32
+
+// Exits with an error if _name is not a known engine
+AsyncReadEngine parseAsyncReadEngine(const std::string& _name);
+
+// Exits with an error if _name is not a known mode
+StreamingIoMode parseStreamingIoMode(const std::string& _name);
+
+// Sets the engine, how many chunk reads every AsyncFileReader keeps in flight (--io-depth=), and the streaming mode.
+// Must be called before the first AsyncFileReader is created.
+void configureAsyncReads(AsyncReadEngine _engine, int _queueDepth, StreamingIoMode _streamingMode);
+
+// With a streaming mode, writes back the dirty pages of _path and drops all of its pages from the page cache.
+// For data that was read or written outside of AsyncFileReader. Does nothing with --streaming-io=off.
+void releasePageCache(const std::string& _path);
+
+enum ReadChunkResult
+{
+	RCR_CHUNK,
+	RCR_END_OF_FILE,
+	RCR_ERROR
+};
+
+class IoUring;
+
+// Reads the first _fileBytes bytes of the open file _fd front to back, in chunks of _chunkBytes (only the last one may
+// be shorter). The reads of the next few chunks are already in flight while the caller hashes the current one, so on
+// high-latency storage the device sees a queue of reads instead of one read at a time.
+// Nothing is read before the first call to next(..). A reader must stay on the thread that created it.
+class AsyncFileReader
+{
+private:
+	struct Slot
+	{
+		AsyncFileReader* owner;
+		std::vector<char> buffer;
+		
+		// With O_DIRECT the read goes to an aligned buffer, and is copied into buffer when it's handed out
+		std::unique_ptr<char, void(*)(void*)> alignedBuffer = {nullptr, free};
+		char* readBuffer;
+		
+		struct iovec iov;
+		long offset;
+		long bytes;
+		long result;
+		bool done;
+	};
+	
+	int fd;
+	
+	// A second descriptor of the same file, opened with O_DIRECT, or -1
+	int directFd = -1;
+	bool dropConsumedChunks = false;
+	
+	// The chunk that was handed out last, which is consumed once next(..) is called again
+	long handedOutOffset = 0;
+	long handedOutBytes = 0;
+	void dropHandedOutChunk();
+	
+	long fileBytes;
+	long chunkBytes;
+	int queueDepth;
+	IoUring* ring = nullptr;
+	
+	std::vector<std::unique_ptr<Slot>> slots;
+	long amountChunks;
+	long nextChunkToIssue = 0;
+	long nextChunkToReturn = 0;
+	int amountInFlight = 0;
+	bool started = false;
+	
+	// Only used with the pread engine, whose completions come from the pool threads
+	std::mutex mutex;
+	std::condition_variable cv;
+	
+	void issue(Slot& _slot);
+	void waitFor(Slot& _slot);
+	static void complete(Slot* _slot, long _result);
+public:
+	AsyncFileReader(int _fd, long _fileBytes, long _chunkBytes);
+	
+	// Waits for the reads that are still in flight, since they write into this reader's buffers
+	~AsyncFileReader();
+	AsyncFileReader(const AsyncFileReader&) = delete;
+	AsyncFileReader& operator=(const AsyncFileReader&) = delete;
+	
+	// Swaps the next chunk into _chunk, waiting for its read if needed. The buffer that was in _chunk is reused for a
+	// later read, so the data is never copied. Returns RCR_ERROR if a read failed or the file ended early.
+	ReadChunkResult next(std::vector<char>& _chunk);
+};
@@ -0,0 +1,545 @@
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+#include "blake3.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BLAKE3_X86 1
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+static const uint32_t blake3_iv[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+// Order in which every round takes the message words: each row is the one above it, permuted once more
+static const uint8_t blake3_schedule[7][16] = {
+	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+	{2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+	{3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+	{10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+	{12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+	{9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+	{11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+static inline uint32_t loadWord(const unsigned char* _bytes)
+{
+	return (uint32_t)_bytes[0] | ((uint32_t)_bytes[1] << 8) | ((uint32_t)_bytes[2] << 16) | ((uint32_t)_bytes[3] << 24);
+}
+
+static inline void storeWords(const uint32_t* _words, int _amount, unsigned char* _bytes)
+{
+	for (int i=0; i<_amount; i++)
+	{
+		_bytes[i * 4 + 0] = (unsigned char)(_words[i]);
+		_bytes[i * 4 + 1] = (unsigned char)(_words[i] >> 8);
+		_bytes[i * 4 + 2] = (unsigned char)(_words[i] >> 16);
+		_bytes[i * 4 + 3] = (unsigned char)(_words[i] >> 24);
+	}
+}
+
+////////////////////////////////////////////
+//// Portable compression function
+
+static inline uint32_t rotr32(uint32_t _x, int _n)
+{
+	return (_x >> _n) | (_x << (32 - _n));
+}
+
+static inline void g(uint32_t* _v, int _a, int _b, int _c, int _d, uint32_t _mx, uint32_t _my)
+{
+	_v[_a] = _v[_a] + _v[_b] + _mx;
+	_v[_d] = rotr32(_v[_d] ^ _v[_a], 16);
+	_v[_c] = _v[_c] + _v[_d];
+	_v[_b] = rotr32(_v[_b] ^ _v[_c], 12);
+	_v[_a] = _v[_a] + _v[_b] + _my;
+	_v[_d] = rotr32(_v[_d] ^ _v[_a], 8);
+	_v[_c] = _v[_c] + _v[_d];
+	_v[_b] = rotr32(_v[_b] ^ _v[_c], 7);
+}
+
+// Writes all 16 output words. The first 8 are the chaining value.
+static void compress(const uint32_t* _cv, const uint32_t* _blockWords, uint64_t _counter, unsigned int _blockBytes, uint8_t _flags, uint32_t* _out)
+{
+	uint32_t v[16] = {
+		_cv[0], _cv[1], _cv[2], _cv[3], _cv[4], _cv[5], _cv[6], _cv[7],
+		blake3_iv[0], blake3_iv[1], blake3_iv[2], blake3_iv[3],
+		(uint32_t)_counter, (uint32_t)(_counter >> 32), _blockBytes, _flags,
+	};
+	
+	for (int r=0; r<7; r++)
+	{
+		const uint8_t* s = blake3_schedule[r];
+		g(v, 0, 4, 8, 12, _blockWords[s[0]], _blockWords[s[1]]);
+		g(v, 1, 5, 9, 13, _blockWords[s[2]], _blockWords[s[3]]);
+		g(v, 2, 6, 10, 14, _blockWords[s[4]], _blockWords[s[5]]);
+		g(v, 3, 7, 11, 15, _blockWords[s[6]], _blockWords[s[7]]);
+		g(v, 0, 5, 10, 15, _blockWords[s[8]], _blockWords[s[9]]);
+		g(v, 1, 6, 11, 12, _blockWords[s[10]], _blockWords[s[11]]);
+		g(v, 2, 7, 8, 13, _blockWords[s[12]], _blockWords[s[13]]);
+		g(v, 3, 4, 9, 14, _blockWords[s[14]], _blockWords[s[15]]);
+	}
+	
+	for (int i=0; i<8; i++)
+	{
+		_out[i] = v[i] ^ v[i + 8];
+		_out[i + 8] = v[i + 8] ^ _cv[i];
+	}
+}
+
+static void loadBlock(const unsigned char* _block, uint32_t* _words)
+{
+	for (int i=0; i<16; i++) _words[i] = loadWord(&_block[i * 4]);
+}
+
+// Same as Blake3MultiBackend::hashMany, for a single input
+static void hashOne(const unsigned char* _data, unsigned int _blocks, uint64_t _counter, uint8_t _flags, uint8_t _flagsStart, uint8_t _flagsEnd, unsigned char* _out)
+{
+	uint32_t cv[8];
+	memcpy(cv, blake3_iv, sizeof(cv));
+	
+	for (unsigned int b=0; b<_blocks; b++)
+	{
+		uint32_t blockWords[16];
+		uint32_t out[16];
+		loadBlock(&_data[b * BLAKE3_BLOCK_BYTES], blockWords);
+		uint8_t flags = _flags | (b == 0 ? _flagsStart : 0) | (b == _blocks - 1 ? _flagsEnd : 0);
+		compress(cv, blockWords, _counter, BLAKE3_BLOCK_BYTES, flags, out);
+		memcpy(cv, out, sizeof(cv));
+	}
+	
+	storeWords(cv, 8, _out);
+}
+
+#ifdef BLAKE3_X86
+
+////////////////////////////////////////////
+//// x86 multi-buffer kernel
+//// Hashes 8 inputs at once (AVX2), one input per 32-bit SIMD lane.
+
+__attribute__((target("avx2")))
+static inline __m256i rotr16_x8(__m256i _x)
+{
+	const __m256i mask = _mm256_set_epi8(
+		13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+		13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2
+	);
+	return _mm256_shuffle_epi8(_x, mask);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i rotr8_x8(__m256i _x)
+{
+	const __m256i mask = _mm256_set_epi8(
+		12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1,
+		12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1
+	);
+	return _mm256_shuffle_epi8(_x, mask);
+}
+
+#define BLAKE3_X8_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+__attribute__((target("avx2")))
+static inline void g_x8(__m256i* _v, int _a, int _b, int _c, int _d, __m256i _mx, __m256i _my)
+{
+	_v[_a] = _mm256_add_epi32(_mm256_add_epi32(_v[_a], _v[_b]), _mx);
+	_v[_d] = rotr16_x8(_mm256_xor_si256(_v[_d], _v[_a]));
+	_v[_c] = _mm256_add_epi32(_v[_c], _v[_d]);
+	_v[_b] = BLAKE3_X8_ROTR(_mm256_xor_si256(_v[_b], _v[_c]), 12);
+	_v[_a] = _mm256_add_epi32(_mm256_add_epi32(_v[_a], _v[_b]), _my);
+	_v[_d] = rotr8_x8(_mm256_xor_si256(_v[_d], _v[_a]));
+	_v[_c] = _mm256_add_epi32(_v[_c], _v[_d]);
+	_v[_b] = BLAKE3_X8_ROTR(_mm256_xor_si256(_v[_b], _v[_c]), 7);
+}
+
+// Turns 8 vectors of 8 words into the 8 vectors of their columns
+__attribute__((target("avx2")))
+static inline void transpose8x8(__m256i r[8])
+{
+	__m256i t[8], u[8];
+	for (int i = 0; i < 4; i++)
+	{
+		t[2 * i] = _mm256_unpacklo_epi32(r[2 * i], r[2 * i + 1]);
+		t[2 * i + 1] = _mm256_unpackhi_epi32(r[2 * i], r[2 * i + 1]);
+	}
+	for (int j = 0; j < 2; j++)
+	{
+		u[4 * j + 0] = _mm256_unpacklo_epi64(t[4 * j], t[4 * j + 2]);
+		u[4 * j + 1] = _mm256_unpackhi_epi64(t[4 * j], t[4 * j + 2]);
+		u[4 * j + 2] = _mm256_unpacklo_epi64(t[4 * j + 1], t[4 * j + 3]);
+		u[4 * j + 3] = _mm256_unpackhi_epi64(t[4 * j + 1], t[4 * j + 3]);
+	}
+	for (int m = 0; m < 4; m++)
+	{
+		r[m] = _mm256_permute2x128_si256(u[m], u[4 + m], 0x20);
+		r[4 + m] = _mm256_permute2x128_si256(u[m], u[4 + m], 0x31);
+	}
+}
+
+__attribute__((target("avx2")))
+static void hashMany_x8(const unsigned char* _data, unsigned int _stride, unsigned int _blocks, uint64_t _counter, bool _incrementCounter, uint8_t _flags, uint8_t _flagsStart, uint8_t _flagsEnd, unsigned char* _out)
+{
+	__m256i h[8];
+	for (int i = 0; i < 8; i++) h[i] = _mm256_set1_epi32(blake3_iv[i]);
+	
+	alignas(32) uint32_t counterLow[8];
+	alignas(32) uint32_t counterHigh[8];
+	for (int lane = 0; lane < 8; lane++)
+	{
+		uint64_t counter = _counter + (_incrementCounter ? lane : 0);
+		counterLow[lane] = (uint32_t)counter;
+		counterHigh[lane] = (uint32_t)(counter >> 32);
+	}
+	const __m256i counterLowVec = _mm256_load_si256((const __m256i*)counterLow);
+	const __m256i counterHighVec = _mm256_load_si256((const __m256i*)counterHigh);
+	
+	for (unsigned int b = 0; b < _blocks; b++)
+	{
+		// m[w] holds message word w of every lane
+		__m256i m[16];
+		for (int lane = 0; lane < 8; lane++)
+		{
+			const unsigned char* block = _data + lane * (size_t)_stride + b * BLAKE3_BLOCK_BYTES;
+			m[lane] = _mm256_loadu_si256((const __m256i*)block);
+			m[8 + lane] = _mm256_loadu_si256((const __m256i*)(block + 32));
+		}
+		transpose8x8(&m[0]);
+		transpose8x8(&m[8]);
+		
+		uint8_t flags = _flags | (b == 0 ? _flagsStart : 0) | (b == _blocks - 1 ? _flagsEnd : 0);
+		__m256i v[16] = {
+			h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+			_mm256_set1_epi32(blake3_iv[0]), _mm256_set1_epi32(blake3_iv[1]), _mm256_set1_epi32(blake3_iv[2]), _mm256_set1_epi32(blake3_iv[3]),
+			counterLowVec, counterHighVec, _mm256_set1_epi32(BLAKE3_BLOCK_BYTES), _mm256_set1_epi32(flags),
+		};
+		
+		for (int r = 0; r < 7; r++)
+		{
+			const uint8_t* s = blake3_schedule[r];
+			g_x8(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+			g_x8(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+			g_x8(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+			g_x8(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+			g_x8(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+			g_x8(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+			g_x8(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+			g_x8(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+		}
+		
+		for (int i = 0; i < 8; i++) h[i] = _mm256_xor_si256(v[i], v[i + 8]);
+	}
+	
+	// h[w] holds word w of every lane's chaining value, so after transposing h[lane] is that lane's chaining value
+	transpose8x8(h);
+	for (int lane = 0; lane < 8; lane++) _mm256_storeu_si256((__m256i*)&_out[lane * BLAKE3_OUT_BYTES], h[lane]);
+}
+
+static bool cpuHasAvx2()
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+	if (!(ecx & bit_OSXSAVE)) return false;
+	unsigned int xcr0Low, xcr0High;
+	__asm__("xgetbv" : "=a"(xcr0Low), "=d"(xcr0High) : "c"(0));
+	if ((xcr0Low & 0x6) != 0x6) return false; // OS saves XMM and YMM registers
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+	return ebx & bit_AVX2;
+}
+
+#endif // BLAKE3_X86
+
+////////////////////////////////////////////
+//// Backend selection
+
+std::vector<Blake3MultiBackend> blake3_supportedMultiBackends()
+{
+	std::vector<Blake3MultiBackend> ret;
+#ifdef BLAKE3_X86
+	if (cpuHasAvx2()) ret.push_back({"avx2-x8", 8, hashMany_x8});
+#endif
+	return ret;
+}
+
+bool blake3_selfTest()
+{
+	// BLAKE3 of "", "abc", and of 1024, 1025 and 31744 bytes counting up modulo 251
+	const unsigned char expected[5][BLAKE3_OUT_BYTES] = {
+		{
+			0xaf, 0x13, 0x49, 0xb9, 0xf5, 0xf9, 0xa1, 0xa6, 0xa0, 0x40, 0x4d, 0xea, 0x36, 0xdc, 0xc9, 0x49,
+			0x9b, 0xcb, 0x25, 0xc9, 0xad, 0xc1, 0x12, 0xb7, 0xcc, 0x9a, 0x93, 0xca, 0xe4, 0x1f, 0x32, 0x62,
+		},
+		{
+			0x64, 0x37, 0xb3, 0xac, 0x38, 0x46, 0x51, 0x33, 0xff, 0xb6, 0x3b, 0x75, 0x27, 0x3a, 0x8d, 0xb5,
+			0x48, 0xc5, 0x58, 0x46, 0x5d, 0x79, 0xdb, 0x03, 0xfd, 0x35, 0x9c, 0x6c, 0xd5, 0xbd, 0x9d, 0x85,
+		},
+		{
+			0x42, 0x21, 0x47, 0x39, 0xf0, 0x95, 0xa4, 0x06, 0xf3, 0xfc, 0x83, 0xde, 0xb8, 0x89, 0x74, 0x4a,
+			0xc0, 0x0d, 0xf8, 0x31, 0xc1, 0x0d, 0xaa, 0x55, 0x18, 0x9b, 0x5d, 0x12, 0x1c, 0x85, 0x5a, 0xf7,
+		},
+		{
+			0xd0, 0x02, 0x78, 0xae, 0x47, 0xeb, 0x27, 0xb3, 0x4f, 0xae, 0xcf, 0x67, 0xb4, 0xfe, 0x26, 0x3f,
+			0x82, 0xd5, 0x41, 0x29, 0x16, 0xc1, 0xff, 0xd9, 0x7c, 0x8c, 0xb7, 0xfb, 0x81, 0x4b, 0x84, 0x44,
+		},
+		{
+			0x62, 0xb6, 0x96, 0x0e, 0x1a, 0x44, 0xbc, 0xc1, 0xeb, 0x1a, 0x61, 0x1a, 0x8d, 0x62, 0x35, 0xb6,
+			0xb4, 0xb7, 0x8f, 0x32, 0xe7, 0xab, 0xc4, 0xfb, 0x4c, 0x6c, 0xdc, 0xce, 0x94, 0x89, 0x5c, 0x47,
+		},
+	};
+	
+	std::vector<unsigned char> counting(31744);
+	for (size_t i=0; i<counting.size(); i++) counting[i] = (unsigned char)(i % 251);
+	
+	const unsigned char* inputs[5] = {counting.data(), (const unsigned char*)"abc", counting.data(), counting.data(), counting.data()};
+	unsigned long lengths[5] = {0, 3, 1024, 1025, 31744};
+	for (int i=0; i<5; i++)
+	{
+		unsigned char hash[BLAKE3_OUT_BYTES];
+		Blake3 blake3;
+		blake3.update(inputs[i], lengths[i]);
+		blake3.final(hash);
+		if (memcmp(hash, expected[i], BLAKE3_OUT_BYTES) != 0) return false;
+		
+		// The same input fed in odd pieces
+		Blake3 pieces;
+		for (unsigned long at=0; at<lengths[i]; at+=std::min(lengths[i] - at, 100UL)) pieces.update(&inputs[i][at], std::min(lengths[i] - at, 100UL));
+		pieces.final(hash);
+		if (memcmp(hash, expected[i], BLAKE3_OUT_BYTES) != 0) return false;
+	}
+	return true;
+}
+
+bool blake3_selfTest(const Blake3MultiBackend& _backend)
+{
+	std::vector<unsigned char> data(_backend.lanes * BLAKE3_CHUNK_BYTES);
+	for (size_t i=0; i<data.size(); i++) data[i] = (unsigned char)(i * 167 + (i >> 5) * 13 + 1);
+	
+	std::vector<unsigned char> outBackend(_backend.lanes * BLAKE3_OUT_BYTES);
+	std::vector<unsigned char> outPortable(_backend.lanes * BLAKE3_OUT_BYTES);
+	
+	// Chunks, with counters that carry into the high word, and parents
+	for (uint64_t counter : {0UL, 0xfffffffcUL})
+	{
+		_backend.hashMany(data.data(), BLAKE3_CHUNK_BYTES, BLAKE3_CHUNK_BYTES / BLAKE3_BLOCK_BYTES, counter, true, 0, BLAKE3_CHUNK_START, BLAKE3_CHUNK_END, outBackend.data());
+		for (unsigned int lane=0; lane<_backend.lanes; lane++)
+		{
+			hashOne(&data[lane * BLAKE3_CHUNK_BYTES], BLAKE3_CHUNK_BYTES / BLAKE3_BLOCK_BYTES, counter + lane, 0, BLAKE3_CHUNK_START, BLAKE3_CHUNK_END, &outPortable[lane * BLAKE3_OUT_BYTES]);
+		}
+		if (outBackend != outPortable) return false;
+	}
+	
+	_backend.hashMany(data.data(), BLAKE3_BLOCK_BYTES, 1, 0, false, BLAKE3_PARENT, 0, 0, outBackend.data());
+	for (unsigned int lane=0; lane<_backend.lanes; lane++)
+	{
+		hashOne(&data[lane * BLAKE3_BLOCK_BYTES], 1, 0, BLAKE3_PARENT, 0, 0, &outPortable[lane * BLAKE3_OUT_BYTES]);
+	}
+	return outBackend == outPortable;
+}
+
+static const Blake3MultiBackend* selectMultiBackend()
+{
+	// Unlike SHA256 there are no dedicated instructions to compete with, so the widest working backend wins
+	static std::vector<Blake3MultiBackend> backends = blake3_supportedMultiBackends();
+	for (size_t i=backends.size(); i>0; i--)
+	{
+		if (blake3_selfTest(backends[i-1])) return &backends[i-1];
+	}
+	return nullptr;
+}
+
+const Blake3MultiBackend* blake3_activeMultiBackend()
+{
+	static const Blake3MultiBackend* backend = selectMultiBackend();
+	return backend;
+}
+
+void blake3_hashChunks(const unsigned char* _data, unsigned long _amount, uint64_t _firstChunk, unsigned char* _cvs)
+{
+	const unsigned int blocksPerChunk = BLAKE3_CHUNK_BYTES / BLAKE3_BLOCK_BYTES;
+	unsigned long i = 0;
+	
+	const Blake3MultiBackend* multi = blake3_activeMultiBackend();
+	if (multi != nullptr)
+	{
+		for (; i + multi->lanes <= _amount; i += multi->lanes)
+		{
+			multi->hashMany(&_data[i * BLAKE3_CHUNK_BYTES], BLAKE3_CHUNK_BYTES, blocksPerChunk, _firstChunk + i, true, 0, BLAKE3_CHUNK_START, BLAKE3_CHUNK_END, &_cvs[i * BLAKE3_OUT_BYTES]);
+		}
+	}
+	
+	for (; i < _amount; i++)
+	{
+		hashOne(&_data[i * BLAKE3_CHUNK_BYTES], blocksPerChunk, _firstChunk + i, 0, BLAKE3_CHUNK_START, BLAKE3_CHUNK_END, &_cvs[i * BLAKE3_OUT_BYTES]);
+	}
+}
+
+void blake3_hashParents(const unsigned char* _children, unsigned long _amount, unsigned char* _cvs)
+{
+	unsigned long i = 0;
+	
+	const Blake3MultiBackend* multi = blake3_activeMultiBackend();
+	if (multi != nullptr)
+	{
+		for (; i + multi->lanes <= _amount; i += multi->lanes)
+		{
+			multi->hashMany(&_children[i * BLAKE3_BLOCK_BYTES], BLAKE3_BLOCK_BYTES, 1, 0, false, BLAKE3_PARENT, 0, 0, &_cvs[i * BLAKE3_OUT_BYTES]);
+		}
+	}
+	
+	for (; i < _amount; i++)
+	{
+		hashOne(&_children[i * BLAKE3_BLOCK_BYTES], 1, 0, BLAKE3_PARENT, 0, 0, &_cvs[i * BLAKE3_OUT_BYTES]);
+	}
+}
+
+void blake3_hashRootParent(const unsigned char* _children, unsigned char* _hash)
+{
+	hashOne(_children, 1, 0, BLAKE3_PARENT | BLAKE3_ROOT, 0, 0, _hash);
+}
+
+////////////////////////////////////////////
+//// Blake3
+
+Blake3::Blake3(uint64_t _firstChunk):
+	firstChunk(_firstChunk),
+	chunkCounter(_firstChunk),
+	blockBytes(0),
+	blocksCompressed(0),
+	amountStacked(0)
+{
+	memcpy(this->chunkCv, blake3_iv, sizeof(this->chunkCv));
+	memset(this->block, 0, sizeof(this->block));
+}
+
+// Pushes the chaining value of a finished chunk, merging it with every completed subtree to its left.
+// _amountChunks is the amount of chunks finished so far: its trailing zero bits tell how many subtrees it completes.
+void Blake3::pushChunkCv(const uint32_t* _cv, uint64_t _amountChunks)
+{
+	uint32_t cv[8];
+	memcpy(cv, _cv, sizeof(cv));
+	while ((_amountChunks & 1) == 0)
+	{
+		uint32_t blockWords[16];
+		uint32_t out[16];
+		this->amountStacked--;
+		memcpy(&blockWords[0], this->cvStack[this->amountStacked], 32);
+		memcpy(&blockWords[8], cv, 32);
+		compress(blake3_iv, blockWords, 0, BLAKE3_BLOCK_BYTES, BLAKE3_PARENT, out);
+		memcpy(cv, out, sizeof(cv));
+		_amountChunks >>= 1;
+	}
+	memcpy(this->cvStack[this->amountStacked], cv, sizeof(cv));
+	this->amountStacked++;
+}
+
+void Blake3::update(const unsigned char* _data, unsigned long _length)
+{
+	while (_length > 0)
+	{
+		// A full chunk is only finished once more input arrives, because the last chunk is hashed differently
+		if (this->blocksCompressed * BLAKE3_BLOCK_BYTES + this->blockBytes == BLAKE3_CHUNK_BYTES)
+		{
+			uint32_t blockWords[16];
+			uint32_t out[16];
+			loadBlock(this->block, blockWords);
+			compress(this->chunkCv, blockWords, this->chunkCounter, BLAKE3_BLOCK_BYTES, BLAKE3_CHUNK_END | (this->blocksCompressed == 0 ? BLAKE3_CHUNK_START : 0), out);
+			this->chunkCounter++;
+			this->pushChunkCv(out, this->chunkCounter - this->firstChunk);
+			
+			memcpy(this->chunkCv, blake3_iv, sizeof(this->chunkCv));
+			memset(this->block, 0, sizeof(this->block));
+			this->blockBytes = 0;
+			this->blocksCompressed = 0;
+		}
+		
+		// Whole chunks that are not the last one are hashed many at a time
+		if (this->blocksCompressed == 0 && this->blockBytes == 0 && _length > BLAKE3_CHUNK_BYTES)
+		{
+			unsigned long amountChunks = std::min((_length - 1) / BLAKE3_CHUNK_BYTES, 64UL);
+			unsigned char cvs[64 * BLAKE3_OUT_BYTES];
+			blake3_hashChunks(_data, amountChunks, this->chunkCounter, cvs);
+			for (unsigned long c=0; c<amountChunks; c++)
+			{
+				uint32_t cv[8];
+				for (int w=0; w<8; w++) cv[w] = loadWord(&cvs[c * BLAKE3_OUT_BYTES + w * 4]);
+				this->chunkCounter++;
+				this->pushChunkCv(cv, this->chunkCounter - this->firstChunk);
+			}
+			_data += amountChunks * BLAKE3_CHUNK_BYTES;
+			_length -= amountChunks * BLAKE3_CHUNK_BYTES;
+			continue;
+		}
+		
+		// A full block is only compressed once more input arrives, because the last block of a chunk is flagged
+		if (this->blockBytes == BLAKE3_BLOCK_BYTES)
+		{
+			uint32_t blockWords[16];
+			uint32_t out[16];
+			loadBlock(this->block, blockWords);
+			compress(this->chunkCv, blockWords, this->chunkCounter, BLAKE3_BLOCK_BYTES, this->blocksCompressed == 0 ? BLAKE3_CHUNK_START : 0, out);
+			memcpy(this->chunkCv, out, sizeof(this->chunkCv));
+			memset(this->block, 0, sizeof(this->block));
+			this->blockBytes = 0;
+			this->blocksCompressed++;
+		}
+		
+		unsigned int take = std::min((unsigned long)(BLAKE3_BLOCK_BYTES - this->blockBytes), _length);
+		memcpy(&this->block[this->blockBytes], _data, take);
+		this->blockBytes += take;
+		_data += take;
+		_length -= take;
+	}
+}
+
+// Inputs of the last compression: the last block of the last chunk, folded into every stacked subtree from right to left.
+// Its counter is 0, unless it is the last chunk itself.
+void Blake3::finalOutput(uint32_t* _inputCv, uint32_t* _blockWords, uint64_t& _counter, unsigned int& _blockBytes, uint8_t& _flags) const
+{
+	memcpy(_inputCv, this->chunkCv, 32);
+	loadBlock(this->block, _blockWords);
+	_counter = this->chunkCounter;
+	_blockBytes = this->blockBytes;
+	_flags = BLAKE3_CHUNK_END | (this->blocksCompressed == 0 ? BLAKE3_CHUNK_START : 0);
+	
+	for (unsigned int i=this->amountStacked; i>0; i--)
+	{
+		uint32_t out[16];
+		compress(_inputCv, _blockWords, _counter, _blockBytes, _flags, out);
+		memcpy(&_blockWords[0], this->cvStack[i-1], 32);
+		memcpy(&_blockWords[8], out, 32);
+		memcpy(_inputCv, blake3_iv, 32);
+		_counter = 0;
+		_blockBytes = BLAKE3_BLOCK_BYTES;
+		_flags = BLAKE3_PARENT;
+	}
+}
+
+void Blake3::final(unsigned char* _hash) const
+{
+	uint32_t inputCv[8];
+	uint32_t blockWords[16];
+	uint64_t counter;
+	unsigned int blockBytes;
+	uint8_t flags;
+	this->finalOutput(inputCv, blockWords, counter, blockBytes, flags);
+	
+	// The root is output block 0, whatever the counter of its chunk
+	uint32_t out[16];
+	compress(inputCv, blockWords, 0, blockBytes, flags | BLAKE3_ROOT, out);
+	storeWords(out, 8, _hash);
+}
+
+void Blake3::finalChainingValue(unsigned char* _cv) const
+{
+	uint32_t inputCv[8];
+	uint32_t blockWords[16];
+	uint64_t counter;
+	unsigned int blockBytes;
+	uint8_t flags;
+	this->finalOutput(inputCv, blockWords, counter, blockBytes, flags);
+	
+	uint32_t out[16];
+	compress(inputCv, blockWords, counter, blockBytes, flags, out);
+	storeWords(out, 8, _cv);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+// BLAKE3 splits its input into chunks of 1024 bytes, hashes every chunk into a 32-byte chaining value, and then hashes
+// pairs of chaining values into parent nodes up to the root. The left subtree of every parent is the largest complete
+// power of two of chunks, which is exactly the shape of a merkel tree that hashes its levels pairwise from the left.
+// Every chunk is hashed with its index, and the root is hashed with a flag of its own, so a chaining value only
+// stands for its bytes at that place in a file, and a root hash can't be mistaken for the chaining value of a subtree.
+
+#define BLAKE3_CHUNK_BYTES 1024
+#define BLAKE3_BLOCK_BYTES 64
+#define BLAKE3_OUT_BYTES 32
+
+// Flags of the compression function
+#define BLAKE3_CHUNK_START 1
+#define BLAKE3_CHUNK_END 2
+#define BLAKE3_PARENT 4
+#define BLAKE3_ROOT 8
+
+// A multi-buffer implementation: hashes `lanes` inputs of _blocks 64-byte blocks each, input i starting at
+// _data + i*_stride, into `lanes` chaining values back to back at _out. Input i is hashed with counter _counter + i
+// if _incrementCounter, else with _counter. _flagsStart is added to the flags of the first block, _flagsEnd to the last.
+struct Blake3MultiBackend
+{
+	const char* name;
+	unsigned int lanes;
+	void (*hashMany)(const unsigned char* _data, unsigned int _stride, unsigned int _blocks, uint64_t _counter, bool _incrementCounter, uint8_t _flags, uint8_t _flagsStart, uint8_t _flagsEnd, unsigned char* _out);
+};
+
+// All multi-buffer backends that are compiled in and supported by this CPU.
+std::vector<Blake3MultiBackend> blake3_supportedMultiBackends();
+
+// The multi-buffer backend used by blake3_hashChunks and blake3_hashParents, or nullptr if there is none.
+const Blake3MultiBackend* blake3_activeMultiBackend();
+
+// Checks the portable implementation against known digests.
+bool blake3_selfTest();
+
+// Checks _backend against the portable implementation.
+bool blake3_selfTest(const Blake3MultiBackend& _backend);
+
+// Chaining values of _amount whole chunks, back to back at _data, of which the first is chunk _firstChunk of its input.
+// Writes _amount chaining values back to back to _cvs.
+void blake3_hashChunks(const unsigned char* _data, unsigned long _amount, uint64_t _firstChunk, unsigned char* _cvs);
+
+// Chaining values of _amount parent nodes, whose children are the pairs of chaining values back to back at _children.
+void blake3_hashParents(const unsigned char* _children, unsigned long _amount, unsigned char* _cvs);
+
+// Root hash of a tree whose root has the two chaining values at _children as its children
+void blake3_hashRootParent(const unsigned char* _children, unsigned char* _hash);
+
+// Incremental BLAKE3. Hashes a whole input, or the subtree of an input that starts at chunk _firstChunk. That subtree
+// is only a subtree of the whole input's tree if _firstChunk is a multiple of the largest power of two that is not
+// smaller than the amount of chunks in it. Copyable, so the state after a prefix can be kept and resumed.
+class Blake3
+{
+private:
+	// Enough for 2^54 chunks, the most a 64-bit byte count can have
+	static const int MAX_DEPTH = 54;
+	
+	uint32_t chunkCv[8];
+	uint64_t firstChunk;
+	uint64_t chunkCounter;
+	unsigned char block[BLAKE3_BLOCK_BYTES];
+	unsigned int blockBytes;
+	unsigned int blocksCompressed;
+	unsigned int amountStacked;
+	uint32_t cvStack[MAX_DEPTH][8];
+	
+	void pushChunkCv(const uint32_t* _cv, uint64_t _amountChunks);
+	void finalOutput(uint32_t* _inputCv, uint32_t* _blockWords, uint64_t& _counter, unsigned int& _blockBytes, uint8_t& _flags) const;
+public:
+	Blake3(uint64_t _firstChunk = 0);
+	void update(const unsigned char* _data, unsigned long _length);
+	
+	// The root hash of the input, as b3sum prints it
+	void final(unsigned char* _hash) const;
+	
+	// The chaining value of the subtree of everything hashed so far
+	void finalChainingValue(unsigned char* _cv) const;
+};
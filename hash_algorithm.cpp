@@ -0,0 +1,130 @@
+#include <array>
+#include <string>
+#include <vector>
+#include <optional>
+#include <variant>
+#include <cstring>
+
+#include "hash_algorithm.h"
+
+const char* hashAlgorithmName(HashAlgorithm _algorithm)
+{
+	switch (_algorithm)
+	{
+		case HASH_SHA256: return "sha256";
+		case HASH_BLAKE3: return "blake3";
+	}
+	return "unknown";
+}
+
+std::optional<HashAlgorithm> parseHashAlgorithm(const std::string& _name)
+{
+	if (_name == "sha256") return HASH_SHA256;
+	if (_name == "blake3") return HASH_BLAKE3;
+	return std::nullopt;
+}
+
+bool isValidHashAlgorithm(long _value)
+{
+	return _value == HASH_SHA256 || _value == HASH_BLAKE3;
+}
+
+bool rootIsTopNode(HashAlgorithm _algorithm)
+{
+	return _algorithm == HASH_SHA256;
+}
+
+void hashLeaves(HashAlgorithm _algorithm, const char* _data, long _amount, int _leafSize, long _firstLeaf, std::array<char, 32>* _hashes)
+{
+	if (_amount == 0) return;
+	
+	if (_algorithm == HASH_SHA256)
+	{
+		sha256_hashMany((const unsigned char*)_data, _amount, _leafSize, (unsigned char*)_hashes[0].data());
+		return;
+	}
+	
+	long chunksPerLeaf = _leafSize / BLAKE3_CHUNK_BYTES;
+	if (chunksPerLeaf == 1)
+	{
+		blake3_hashChunks((const unsigned char*)_data, _amount, _firstLeaf, (unsigned char*)_hashes[0].data());
+		return;
+	}
+	
+	// Every full leaf is a complete subtree of chunks, so pairing up a whole level of chaining values never pairs
+	// two different leaves. The levels are hashed in place: parent i only overwrites children that were already read.
+	std::vector<std::array<char, 32>> cvs(_amount * chunksPerLeaf);
+	blake3_hashChunks((const unsigned char*)_data, cvs.size(), _firstLeaf * chunksPerLeaf, (unsigned char*)cvs[0].data());
+	for (long levelSize = cvs.size(); levelSize > _amount; levelSize /= 2)
+	{
+		blake3_hashParents((const unsigned char*)cvs[0].data(), levelSize / 2, (unsigned char*)cvs[0].data());
+	}
+	memcpy(_hashes[0].data(), cvs[0].data(), _amount * 32);
+}
+
+std::array<char, 32> hashLeaf(HashAlgorithm _algorithm, const char* _data, long _amountBytes, int _leafSize, long _leafIndex)
+{
+	LeafHasher hasher(_algorithm, _leafSize, _leafIndex);
+	hasher.update(_data, _amountBytes);
+	return hasher.final();
+}
+
+void hashNodes(HashAlgorithm _algorithm, const std::array<char, 32>* _children, long _amount, std::array<char, 32>* _hashes)
+{
+	if (_amount == 0) return;
+	
+	// The two child hashes of a node are adjacent in memory, so a whole level is hashed as 64-byte messages in one go
+	if (_algorithm == HASH_SHA256) sha256_hashMany((const unsigned char*)_children[0].data(), _amount, 64, (unsigned char*)_hashes[0].data());
+	else blake3_hashParents((const unsigned char*)_children[0].data(), _amount, (unsigned char*)_hashes[0].data());
+}
+
+std::array<char, 32> hashRootNode(HashAlgorithm _algorithm, const std::array<char, 32>* _children)
+{
+	std::array<char, 32> ret;
+	if (_algorithm == HASH_SHA256) hashNodes(_algorithm, _children, 1, &ret);
+	else blake3_hashRootParent((const unsigned char*)_children[0].data(), (unsigned char*)ret.data());
+	return ret;
+}
+
+std::array<char, 32> hashRootLeaf(HashAlgorithm _algorithm, const char* _data, long _amountBytes)
+{
+	return hashBytes(_algorithm, _data, _amountBytes);
+}
+
+std::array<char, 32> hashBytes(HashAlgorithm _algorithm, const char* _data, long _amountBytes)
+{
+	std::array<char, 32> ret;
+	if (_algorithm == HASH_SHA256)
+	{
+		SHA256 sha256;
+		sha256.update((const unsigned char*)_data, _amountBytes);
+		sha256.final((unsigned char*)ret.data());
+	}
+	else
+	{
+		Blake3 blake3;
+		blake3.update((const unsigned char*)_data, _amountBytes);
+		blake3.final((unsigned char*)ret.data());
+	}
+	return ret;
+}
+
+LeafHasher::LeafHasher(HashAlgorithm _algorithm, int _leafSize, long _leafIndex)
+{
+	if (_algorithm == HASH_SHA256) this->state.emplace<SHA256>();
+	else this->state.emplace<Blake3>(_leafIndex * (_leafSize / BLAKE3_CHUNK_BYTES));
+}
+
+void LeafHasher::update(const char* _data, long _amountBytes)
+{
+	if (SHA256* sha256 = std::get_if<SHA256>(&this->state)) sha256->update((const unsigned char*)_data, _amountBytes);
+	else std::get<Blake3>(this->state).update((const unsigned char*)_data, _amountBytes);
+}
+
+std::array<char, 32> LeafHasher::final()
+{
+	std::array<char, 32> ret;
+	if (SHA256* sha256 = std::get_if<SHA256>(&this->state)) sha256->final((unsigned char*)ret.data());
+	else std::get<Blake3>(this->state).finalChainingValue((unsigned char*)ret.data());
+	return ret;
+}
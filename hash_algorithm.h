@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <optional>
+#include <variant>
+#include <cstdint>
+
+#include "sha256.h"
+#include "blake3.h"
+
+// The hash a repo names its files by and builds their merkel trees with, set with hash= in fmrepo.conf.
+// Every tree records the algorithm it was built with, so changing it only affects files added afterwards.
+enum HashAlgorithm : uint8_t
+{
+	HASH_SHA256 = 0,
+	HASH_BLAKE3 = 1,
+};
+
+#define DEFAULT_HASH_ALGORITHM HASH_SHA256
+
+// A tagbase is not tied to a repo, so tag names are hashed the same in every tagbase
+#define TAG_HASH_ALGORITHM HASH_SHA256
+
+const char* hashAlgorithmName(HashAlgorithm _algorithm);
+
+// Returns nothing if _name is not the name of a hash algorithm
+std::optional<HashAlgorithm> parseHashAlgorithm(const std::string& _name);
+
+bool isValidHashAlgorithm(long _value);
+
+// With SHA256, a leaf hash is the SHA256 of the leaf, a node hash is the SHA256 of the hashes of its two children,
+// and the root hash is the hash of the top node.
+// With BLAKE3, the merkel tree is the BLAKE3 tree of the file: a leaf hash is the chaining value of the chunks of the
+// leaf, a node hash is the chaining value of a parent node, and the root hash is the BLAKE3 hash of the whole file,
+// as b3sum prints it. The root is hashed with a flag of its own, so it is not the hash of the top node.
+
+// True if the root hash of a file is the hash of its top node, as with SHA256
+bool rootIsTopNode(HashAlgorithm _algorithm);
+
+// Hashes of _amount full leaves of _leafSize bytes, back to back at _data, of which the first is leaf _firstLeaf of its file
+void hashLeaves(HashAlgorithm _algorithm, const char* _data, long _amount, int _leafSize, long _firstLeaf, std::array<char, 32>* _hashes);
+
+// Hash of leaf _leafIndex of a file, which is _amountBytes long: _leafSize bytes, or less for the last leaf
+std::array<char, 32> hashLeaf(HashAlgorithm _algorithm, const char* _data, long _amountBytes, int _leafSize, long _leafIndex);
+
+// Hashes of _amount nodes, whose children's hashes are the pairs of hashes back to back at _children
+void hashNodes(HashAlgorithm _algorithm, const std::array<char, 32>* _children, long _amount, std::array<char, 32>* _hashes);
+
+// Root hash of a file whose top node has the children _children[0] and _children[1]
+std::array<char, 32> hashRootNode(HashAlgorithm _algorithm, const std::array<char, 32>* _children);
+
+// Root hash of a file that is a single leaf
+std::array<char, 32> hashRootLeaf(HashAlgorithm _algorithm, const char* _data, long _amountBytes);
+
+// Hash of a message that is not part of a file, such as a tag name
+std::array<char, 32> hashBytes(HashAlgorithm _algorithm, const char* _data, long _amountBytes);
+
+// Hashes one leaf bit by bit, with the same result as hashLeaf. Copyable, so the state after a prefix of the leaf can be
+// kept and resumed, which is what tryFixBlockUsingHash does for every candidate.
+class LeafHasher
+{
+private:
+	std::variant<SHA256, Blake3> state;
+public:
+	LeafHasher(HashAlgorithm _algorithm, int _leafSize, long _leafIndex);
+	void update(const char* _data, long _amountBytes);
+	std::array<char, 32> final();
+};
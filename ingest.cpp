@@ -0,0 +1,118 @@
+#include <memory>
+#include <string>
+#include <array>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <vector>
+#include <filesystem>
+
+#include "util.h"
+#include "ingest.h"
+#include "repository.h"
+#include "path_pattern.h"
+
+struct IngestResult
+{
+	std::string path;
+	std::array<char, 32> hash;
+	bool wasNewlyAdded;
+};
+
+static void checkIsRegularFile(const std::string& path)
+{
+	if (!std::filesystem::is_regular_file(path))
+	{
+		exitWithError("The file you're trying to add is not a regular file: " + path);
+	}
+}
+
+void ingestFiles(
+	std::shared_ptr<Repository> _repository,
+	std::shared_ptr<PathPattern> _pathPattern,
+	int _jobs,
+	std::function<void(const std::string& path, const std::array<char, 32>& hash, bool wasNewlyAdded)> _onAdded
+)
+{
+	if (_jobs <= 1)
+	{
+		_pathPattern->findFiles(".", [&_repository, &_onAdded](const std::string& path){
+			checkIsRegularFile(path);
+			auto [hash, wasNewlyAdded] = _repository->add(path);
+			_onAdded(path, hash, wasNewlyAdded);
+		});
+		return;
+	}
+	
+	// Maximum amount of files that have been found by the directory walk but not yet reported.
+	// Bounds both the work queue and the reorder buffer.
+	const long maxFilesInFlight = (long)_jobs * 4;
+	
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<std::pair<long, std::string>> queue;
+	std::map<long, IngestResult> finished;
+	long amountFound = 0;
+	long amountReported = 0;
+	bool walkDone = false;
+	
+	std::thread walker([&](){
+		_pathPattern->findFiles(".", [&](const std::string& path){
+			checkIsRegularFile(path);
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [&]{ return amountFound - amountReported < maxFilesInFlight; });
+			queue.emplace_back(amountFound++, path);
+			cv.notify_all();
+		});
+		std::lock_guard<std::mutex> lock(mutex);
+		walkDone = true;
+		cv.notify_all();
+	});
+	
+	std::vector<std::thread> workers;
+	for (int i=0; i<_jobs; i++)
+	{
+		workers.emplace_back([&](){
+			while (true)
+			{
+				std::pair<long, std::string> job;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					cv.wait(lock, [&]{ return !queue.empty() || walkDone; });
+					if (queue.empty()) return;
+					job = std::move(queue.front());
+					queue.pop_front();
+				}
+				
+				auto [hash, wasNewlyAdded] = _repository->add(job.second);
+				
+				std::lock_guard<std::mutex> lock(mutex);
+				finished[job.first] = IngestResult{std::move(job.second), hash, wasNewlyAdded};
+				cv.notify_all();
+			}
+		});
+	}
+	
+	// Report results in the order the files were found
+	while (true)
+	{
+		IngestResult result;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [&]{ return finished.count(amountReported) != 0 || (walkDone && amountReported == amountFound); });
+			auto it = finished.find(amountReported);
+			if (it == finished.end()) break;
+			result = std::move(it->second);
+			finished.erase(it);
+			amountReported++;
+			cv.notify_all();
+		}
+		_onAdded(result.path, result.hash, result.wasNewlyAdded);
+	}
+	
+	walker.join();
+	for (auto& worker : workers) worker.join();
+}
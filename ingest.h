@@ -0,0 +1,20 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <array>
+#include <functional>
+
+class Repository;
+class PathPattern;
+
+// Adds every file matched by _pathPattern to _repository using _jobs worker threads.
+// The directory walk runs on its own thread and is throttled so that no more than a few files per
+// worker are queued or waiting to be reported. _onAdded is called on the calling thread, in the order
+// in which the directory walk found the files.
+void ingestFiles(
+	std::shared_ptr<Repository> _repository,
+	std::shared_ptr<PathPattern> _pathPattern,
+	int _jobs,
+	std::function<void(const std::string& path, const std::array<char, 32>& hash, bool wasNewlyAdded)> _onAdded
+);
@@ -10,17 +10,24 @@
 #include <locale>
 #include <array>
 #include <memory>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 #include <magic.h>
 
 #include "sqlite3.h"
 #include "util.h"
 #include "sha256.h"
+#include "blake3.h"
 #include "repository.h"
 #include "tag.h"
 #include "tag_query.h"
 #include "tag_parser.h"
 #include "tag_query_parser.h"
 #include "path_pattern.h"
+#include "ingest.h"
+#include "scrub.h"
+#include "async_reader.h"
 #include "json.h"
 #include "uuid.h"
 
@@ -46,7 +53,18 @@ int main(int argc, char* argv[])
 				<< "\r\nFiles:\r\n"
 				<< "--files=[hashlist]   Select the files with hash in [hashlist]\r\n"
 				<< "--add-files=[file]   Add files matching [file] to selected repo, and select them\r\n"
+				<< "--jobs=[n]           Use [n] threads for --add-files and --migrate-trees (default 1)\r\n"
+				<< "--tree-threads=[n]   Use [n] threads to hash each large file (default: CPU cores / jobs)\r\n"
 				<< "--errcheck           Run error checks on the selected files\r\n"
+				<< "--errcheck-threads=[n] Use [n] threads for --errcheck (default: CPU cores)\r\n"
+				<< "--errcheck-io=[n]    Let at most [n] --errcheck threads read from disk at once (default 1, raise for SSDs)\r\n"
+				<< "--errcheck-order=[o] Check files in order of on-disk location, size or none (default location)\r\n"
+				<< "--errfix             Try to repair the selected files\r\n"
+				<< "--errfix-threads=[n] Use [n] threads to search for the fix of a damaged block (default: CPU cores)\r\n"
+				<< "--migrate-trees      Rewrite old .fmtree files of the selected files (default: all files) in the current format\r\n"
+				<< "--io-engine=[e]      Read files using io_uring, pread or auto (default auto: io_uring if available)\r\n"
+				<< "--io-depth=[n]       Keep [n] reads in flight for every file that is being read (default 4)\r\n"
+				<< "--streaming-io=[m]   Keep the data read or written out of the page cache: off, fadvise or direct (default off)\r\n"
 				<< "\r\nTags:\r\n"
 				<< "--tag=[tagquery]        Find files that match the given [tagquery]\r\n"
 				<< "--add-tags=[taglist]    Add [tags] to the selected files\r\n"
@@ -54,6 +72,8 @@ int main(int argc, char* argv[])
 				<< "--remove-tags=[taglist] Remove [tags] from the selected files\r\n"
 				<< "\r\nOutput format:\r\n"
 				<< "--json               Format output as JSON\r\n"
+				<< "\r\nDiagnostics:\r\n"
+				<< "--selftest           Check every SHA256 and BLAKE3 backend supported by this CPU, and parity repair\r\n"
 				<< "\r\nExamples of [taglist] syntax:\r\n"
 				<< "--add-tag=football,match,sport,team[Los Angeles],team[Chicago]\r\n"
 				<< "--untag=team[name=Chicago]\r\n"
@@ -78,6 +98,17 @@ int main(int argc, char* argv[])
 		bool arg_add_fs_tags = false;
 		bool arg_errcheck = false;
 		bool arg_errfix = false;
+		bool arg_migrate_trees = false;
+		bool arg_selftest = false;
+		int arg_jobs = 1;
+		std::optional<int> arg_tree_threads;
+		std::optional<int> arg_errfix_threads;
+		std::optional<int> arg_errcheck_threads;
+		int arg_errcheck_io = 1;
+		ScrubOrder arg_errcheck_order = SO_LOCATION;
+		AsyncReadEngine arg_io_engine = ARE_AUTO;
+		int arg_io_depth = ASYNC_READ_DEFAULT_QUEUE_DEPTH;
+		StreamingIoMode arg_streaming_io = SIO_OFF;
 		
 		for (int i = 1; i < argc; i++)
 		{
@@ -114,6 +145,14 @@ int main(int argc, char* argv[])
 			{
 				arg_errfix = true;
 			}
+			else if (field == "migrate-trees")
+			{
+				arg_migrate_trees = true;
+			}
+			else if (field == "selftest")
+			{
+				arg_selftest = true;
+			}
 			else if (field == "debug")
 			{
 				DEBUGGING = true;
@@ -122,6 +161,54 @@ int main(int argc, char* argv[])
 			{
 				arg_add_files = value;
 			}
+			else if (field == "jobs")
+			{
+				try { arg_jobs = std::stoi(value); }
+				catch (...) { exitWithError("--jobs takes a number"); }
+				if (arg_jobs < 1) exitWithError("--jobs must be at least 1");
+			}
+			else if (field == "tree-threads")
+			{
+				try { arg_tree_threads = std::stoi(value); }
+				catch (...) { exitWithError("--tree-threads takes a number"); }
+				if (*arg_tree_threads < 1) exitWithError("--tree-threads must be at least 1");
+			}
+			else if (field == "errfix-threads")
+			{
+				try { arg_errfix_threads = std::stoi(value); }
+				catch (...) { exitWithError("--errfix-threads takes a number"); }
+				if (*arg_errfix_threads < 1) exitWithError("--errfix-threads must be at least 1");
+			}
+			else if (field == "errcheck-threads")
+			{
+				try { arg_errcheck_threads = std::stoi(value); }
+				catch (...) { exitWithError("--errcheck-threads takes a number"); }
+				if (*arg_errcheck_threads < 1) exitWithError("--errcheck-threads must be at least 1");
+			}
+			else if (field == "errcheck-io")
+			{
+				try { arg_errcheck_io = std::stoi(value); }
+				catch (...) { exitWithError("--errcheck-io takes a number"); }
+				if (arg_errcheck_io < 1) exitWithError("--errcheck-io must be at least 1");
+			}
+			else if (field == "errcheck-order")
+			{
+				arg_errcheck_order = parseScrubOrder(value);
+			}
+			else if (field == "io-engine")
+			{
+				arg_io_engine = parseAsyncReadEngine(value);
+			}
+			else if (field == "io-depth")
+			{
+				try { arg_io_depth = std::stoi(value); }
+				catch (...) { exitWithError("--io-depth takes a number"); }
+				if (arg_io_depth < 1) exitWithError("--io-depth must be at least 1");
+			}
+			else if (field == "streaming-io")
+			{
+				arg_streaming_io = parseStreamingIoMode(value);
+			}
 			else if (field == "repo")
 			{
 				arg_repo = value;
@@ -172,6 +259,7 @@ int main(int argc, char* argv[])
 			}
 		}
 		
+		configureAsyncReads(arg_io_engine, arg_io_depth, arg_streaming_io);
 		
 		
 		
@@ -182,6 +270,112 @@ int main(int argc, char* argv[])
 		
 		
 		
+		
+		//////////////////////////
+		//// --selftest
+		
+		if (arg_selftest)
+		{
+			auto backendsArray = std::make_shared<JsonValue_Array>();
+			bool allOk = true;
+			
+			for (const SHA256Backend& backend : sha256_supportedBackends())
+			{
+				bool ok = sha256_selfTest(backend);
+				if (!ok) allOk = false;
+				bool active = backend.transform == sha256_activeBackend().transform;
+				
+				if (arg_json)
+				{
+					auto backendMap = std::make_shared<JsonValue_Map>();
+					backendMap->set("name", std::string(backend.name));
+					backendMap->set("result", std::string(ok ? "ok" : "failed"));
+					backendMap->set("active", active ? 1 : 0);
+					backendsArray->array.push_back(backendMap);
+				}
+				else
+				{
+					printf("[--selftest] SHA256 backend %s: %s%s\r\n", backend.name, ok ? "ok" : "FAILED", active ? " (active)" : "");
+				}
+			}
+			
+			for (const SHA256MultiBackend& backend : sha256_supportedMultiBackends())
+			{
+				bool ok = sha256_selfTest(backend);
+				if (!ok) allOk = false;
+				bool active = sha256_activeMultiBackend() != nullptr && backend.hashMany == sha256_activeMultiBackend()->hashMany;
+				
+				if (arg_json)
+				{
+					auto backendMap = std::make_shared<JsonValue_Map>();
+					backendMap->set("name", std::string(backend.name));
+					backendMap->set("result", std::string(ok ? "ok" : "failed"));
+					backendMap->set("active", active ? 1 : 0);
+					backendsArray->array.push_back(backendMap);
+				}
+				else
+				{
+					printf("[--selftest] SHA256 multi-buffer backend %s: %s%s\r\n", backend.name, ok ? "ok" : "FAILED", active ? " (active)" : "");
+				}
+			}
+			
+			if (arg_json) jsonOutput.set("sha256_backends", backendsArray);
+			
+			auto blake3BackendsArray = std::make_shared<JsonValue_Array>();
+			bool blake3Ok = blake3_selfTest();
+			if (arg_json)
+			{
+				auto backendMap = std::make_shared<JsonValue_Map>();
+				backendMap->set("name", std::string("portable"));
+				backendMap->set("result", std::string(blake3Ok ? "ok" : "failed"));
+				backendMap->set("active", 1);
+				blake3BackendsArray->array.push_back(backendMap);
+			}
+			else
+			{
+				printf("[--selftest] BLAKE3 backend portable: %s\r\n", blake3Ok ? "ok" : "FAILED");
+			}
+			
+			for (const Blake3MultiBackend& backend : blake3_supportedMultiBackends())
+			{
+				bool ok = blake3_selfTest(backend);
+				if (!ok) blake3Ok = false;
+				bool active = blake3_activeMultiBackend() != nullptr && backend.hashMany == blake3_activeMultiBackend()->hashMany;
+				
+				if (arg_json)
+				{
+					auto backendMap = std::make_shared<JsonValue_Map>();
+					backendMap->set("name", std::string(backend.name));
+					backendMap->set("result", std::string(ok ? "ok" : "failed"));
+					backendMap->set("active", active ? 1 : 0);
+					blake3BackendsArray->array.push_back(backendMap);
+				}
+				else
+				{
+					printf("[--selftest] BLAKE3 multi-buffer backend %s: %s%s\r\n", backend.name, ok ? "ok" : "FAILED", active ? " (active)" : "");
+				}
+			}
+			
+			if (arg_json) jsonOutput.set("blake3_backends", blake3BackendsArray);
+			
+			bool parityOk = parity_selfTest();
+			if (arg_json) jsonOutput.set("parity_repair", std::string(parityOk ? "ok" : "failed"));
+			else printf("[--selftest] Parity repair: %s\r\n", parityOk ? "ok" : "FAILED");
+			
+			if (!allOk) exitWithError("SHA256 self-test failed");
+			if (!blake3Ok) exitWithError("BLAKE3 self-test failed");
+			if (!parityOk) exitWithError("Parity repair self-test failed");
+			
+			// On its own, --selftest doesn't need a repo or tagbase
+			bool otherActions = arg_init_repo || arg_init_tagbase || arg_add_files.has_value() || arg_files.has_value() || arg_tags.has_value() ||
+				arg_add_tags.has_value() || arg_remove_tags.has_value() || arg_errcheck || arg_errfix || arg_migrate_trees;
+			if (!otherActions)
+			{
+				if (arg_json) jsonOutput.write(std::cout);
+				return 0;
+			}
+		}
+		
 		//////////////////////////
 		//// --init-repo
 		
@@ -237,6 +431,8 @@ int main(int argc, char* argv[])
 			if (std::filesystem::is_directory(selected_repository_path))
 			{
 				selected_repository = std::make_shared<Repository>(selected_repository_path);
+				selected_repository->treeThreads = arg_tree_threads.has_value() ? *arg_tree_threads : std::max(1, (int)std::thread::hardware_concurrency() / arg_jobs);
+				selected_repository->errfixThreads = arg_errfix_threads.has_value() ? *arg_errfix_threads : std::max(1, (int)std::thread::hardware_concurrency());
 			}
 			else if (arg_repo.has_value())
 			{
@@ -400,12 +596,7 @@ int main(int argc, char* argv[])
 			long long amountOFilesAdded = 0;
 			long long amountOfNewFilesAdded = 0;
 			
-			pathPattern->findFiles(".", [&selected_repository, &selected_file_hashes, &selected_file_paths, &amountOFilesAdded, &amountOfNewFilesAdded](const std::string& path){
-				if (!std::filesystem::is_regular_file(path))
-				{
-					exitWithError("The file you're trying to add is not a regular file: " + path);
-				}
-				auto [hash, wasNewlyAdded] = selected_repository->add(path);
+			ingestFiles(selected_repository, pathPattern, arg_jobs, [&selected_file_hashes, &selected_file_paths, &amountOFilesAdded, &amountOfNewFilesAdded](const std::string& path, const std::array<char, 32>& hash, bool wasNewlyAdded){
 				selected_file_hashes.push_back(hash);
 				selected_file_paths.push_back(path);
 				amountOFilesAdded++;
@@ -497,11 +688,13 @@ int main(int argc, char* argv[])
 			unsigned long amountNotFound = 0;
 			unsigned long amountError = 0;
 			
-			for (auto hash : selected_file_hashes)
+			int threads = arg_errcheck_threads.has_value() ? *arg_errcheck_threads : std::max(1, (int)std::thread::hardware_concurrency());
+			std::vector<ErrorCheckResult> results = errorCheckFiles(selected_repository, selected_file_hashes, threads, arg_errcheck_io, arg_errcheck_order);
+			
+			for (size_t i=0; i<selected_file_hashes.size(); i++)
 			{
-				std::string hashStr = bytes_to_hex(hash);
-				
-				ErrorCheckResult ecr = selected_repository->errorCheck(hash);
+				std::string hashStr = bytes_to_hex(selected_file_hashes[i]);
+				ErrorCheckResult ecr = results[i];
 				
 				if (arg_json)
 				{
@@ -600,6 +793,82 @@ int main(int argc, char* argv[])
 		
 		
 		
+		/////////////////////////////////////////////////////
+		//// --migrate-trees
+		
+		if (arg_migrate_trees)
+		{
+			if (selected_repository == nullptr)
+			{
+				exitWithError("A repository must be selected to use --migrate-trees");
+			}
+			
+			std::vector<std::array<char, 32>> hashes = selected_file_hashes.size() != 0 ? selected_file_hashes : selected_repository->listFiles();
+			std::vector<TreeMigrationResult> results(hashes.size());
+			
+			// Every tree is independent, so the jobs just take the next one from a shared counter
+			std::atomic<size_t> nextIndex(0);
+			auto migrateNext = [&](){
+				for (size_t i = nextIndex++; i < hashes.size(); i = nextIndex++)
+				{
+					results[i] = selected_repository->migrateTree(hashes[i]);
+				}
+			};
+			std::vector<std::thread> jobs;
+			for (int i=1; i<arg_jobs; i++) jobs.emplace_back(migrateNext);
+			migrateNext();
+			for (auto& job : jobs) job.join();
+			
+			std::shared_ptr<JsonValue_Array> treesMigrated = std::make_shared<JsonValue_Array>();
+			std::shared_ptr<JsonValue_Array> treesAlreadyCurrent = std::make_shared<JsonValue_Array>();
+			std::shared_ptr<JsonValue_Array> treesFailed = std::make_shared<JsonValue_Array>();
+			std::shared_ptr<JsonValue_Array> treesNotFound = std::make_shared<JsonValue_Array>();
+			
+			unsigned long amountMigrated = 0;
+			unsigned long amountAlreadyCurrent = 0;
+			unsigned long amountFailed = 0;
+			unsigned long amountNotFound = 0;
+			
+			for (size_t i=0; i<hashes.size(); i++)
+			{
+				std::string hashStr = bytes_to_hex(hashes[i]);
+				TreeMigrationResult tmr = results[i];
+				
+				if (arg_json)
+				{
+					if (tmr == TMR_MIGRATED) treesMigrated->array.push_back(std::shared_ptr<JsonValue>(new JsonValue_String(hashStr)));
+					else if (tmr == TMR_ALREADY_CURRENT) treesAlreadyCurrent->array.push_back(std::shared_ptr<JsonValue>(new JsonValue_String(hashStr)));
+					else if (tmr == TMR_FAILED) treesFailed->array.push_back(std::shared_ptr<JsonValue>(new JsonValue_String(hashStr)));
+					else if (tmr == TMR_NOT_FOUND) treesNotFound->array.push_back(std::shared_ptr<JsonValue>(new JsonValue_String(hashStr)));
+					else exitWithError("Unknown TMR code");
+				}
+				else
+				{
+					if (tmr == TMR_MIGRATED) { amountMigrated++; }
+					else if (tmr == TMR_ALREADY_CURRENT) { amountAlreadyCurrent++; }
+					else if (tmr == TMR_FAILED) { printf("[--migrate-trees] Tree of file %s is damaged and was not migrated, run --errfix on it\r\n", hashStr.c_str()); amountFailed++; }
+					else if (tmr == TMR_NOT_FOUND) { printf("[--migrate-trees] Tree of file %s was not found!\r\n", hashStr.c_str()); amountNotFound++; }
+					else exitWithError("Unknown TMR code");
+				}
+			}
+			
+			if (arg_json)
+			{
+				jsonOutput.set("trees_migrated", treesMigrated);
+				jsonOutput.set("trees_already_current", treesAlreadyCurrent);
+				jsonOutput.set("trees_failed", treesFailed);
+				jsonOutput.set("trees_not_found", treesNotFound);
+			}
+			else
+			{
+				printf("[--migrate-trees] %lu trees: %lu migrated, %lu already current, %lu damaged, %lu not found\r\n", amountMigrated + amountAlreadyCurrent + amountFailed + amountNotFound, amountMigrated, amountAlreadyCurrent, amountFailed, amountNotFound);
+			}
+		}
+		
+		
+		
+		
+		
 		//////////////////////////////////////////////////////////
 		//// --add-tags
 		
@@ -3,351 +3,807 @@
 #include <filesystem>
 #include <fstream>
 #include <vector>
+#include <cstring>
+#include <algorithm>
 
-#include "sha256.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "hash_algorithm.h"
 #include "util.h"
 #include "merkel_tree.h"
+#include "async_reader.h"
+
+MerkelTree::MerkelTree(int _leafSize, HashAlgorithm _hashAlgorithm):
+	leafSize(_leafSize),
+	hashAlgorithm(_hashAlgorithm)
+{
+	if (!isValidMerkelLeafSize(_leafSize)) exitWithError("Invalid merkel tree leaf size " + std::to_string(_leafSize));
+}
 
-MerkelNode::MerkelNode(int _level, std::shared_ptr<MerkelNode> _parent):
-	level(_level),
-	parent(_parent)
+int merkelTreeFileVersion(std::istream& _serializedTree)
 {
+	int firstByte = _serializedTree.peek();
+	if (firstByte == EOF) return 0;
+	else if (firstByte == MERKEL_TREE_V2_MAGIC[0]) return 2;
+	else return 1;
 }
 
-void MerkelNode::setData(const char* _data, int _amountBytes)
+long merkelTreeFileLeafSize(std::istream& _serializedTree)
 {
-	if (this->level != 0) exitWithError("MerkelNode::setData, but node is not level 0");
-	if (this->dataSize != -1) exitWithError("MerkelNode::setData, but node already has data");
-	if (this->hash.has_value()) exitWithError("MerkelNode::setData, but node already has hash");
+	int version = merkelTreeFileVersion(_serializedTree);
+	if (version == 1) return 1024;
+	if (version != 2) return 0;
 	
-	SHA256 sha256;
-	sha256.init();
-	sha256.update((const unsigned char*)&_data[0], _amountBytes);
-	this->hash = ZERO_HASH;
-	sha256.final((unsigned char*)this->hash->data());
-	this->dataSize = _amountBytes;
+	std::streampos start = _serializedTree.tellg();
+	MerkelTreeFileHeader header;
+	_serializedTree.read((char*)&header, sizeof(header));
+	bool complete = _serializedTree.gcount() == sizeof(header);
+	_serializedTree.clear();
+	_serializedTree.seekg(start);
+	
+	if (!complete || !isValidMerkelLeafSize(header.leafSize)) return 0;
+	return header.leafSize;
 }
 
-void MerkelNode::forgetChildrenIfFull()
+std::optional<HashAlgorithm> merkelTreeFileHashAlgorithm(std::istream& _serializedTree)
 {
-	if (this->isFull())
-	{
-		this->getHash(false);
-		this->calcDataSize();
-		this->child0 = nullptr;
-		this->child1 = nullptr;
-		this->parent->forgetChildrenIfFull();
-	}
+	int version = merkelTreeFileVersion(_serializedTree);
+	if (version == 1) return HASH_SHA256;
+	if (version != 2) return std::nullopt;
+	
+	std::streampos start = _serializedTree.tellg();
+	MerkelTreeFileHeader header;
+	_serializedTree.read((char*)&header, sizeof(header));
+	bool complete = _serializedTree.gcount() == sizeof(header);
+	_serializedTree.clear();
+	_serializedTree.seekg(start);
+	
+	if (!complete || !isValidHashAlgorithm(header.hashAlgorithm)) return std::nullopt;
+	return (HashAlgorithm)header.hashAlgorithm;
+}
+
+bool isValidMerkelLeafSize(long _leafSize)
+{
+	return _leafSize >= MERKEL_MIN_LEAF_SIZE && _leafSize <= MERKEL_MAX_LEAF_SIZE && (_leafSize & (_leafSize - 1)) == 0;
 }
 
-void MerkelNode::setChild0(std::shared_ptr<MerkelNode> _child0)
+std::vector<long> merkelLevelSizes(long _totalBytes, long _leafSize)
 {
-	if (level == 0) exitWithError("setChild0 called on level 0");
-	this->child0 = _child0;
+	std::vector<long> ret;
+	ret.push_back((_totalBytes + _leafSize - 1) / _leafSize);
+	while (ret.back() > 1) ret.push_back((ret.back() + 1) / 2);
+	ret.push_back(1);
+	return ret;
 }
 
-void MerkelNode::setChild1(std::shared_ptr<MerkelNode> _child1)
+long MerkelTree::levelSize(int _level) const
 {
-	if (level == 0) exitWithError("setChild1 called on level 0");
-	this->child1 = _child1;
+	return this->levelOffsets[_level + 1] - this->levelOffsets[_level];
+}
+
+long MerkelTree::getTotalBytes() const
+{
+	if (!this->hash.has_value()) exitWithError("getTotalBytes() called on non-finalized merkel tree");
+	return totalBytes;
+}
+
+int MerkelTree::getLeafSize() const
+{
+	return this->leafSize;
+}
+
+HashAlgorithm MerkelTree::getHashAlgorithm() const
+{
+	return this->hashAlgorithm;
+}
+
+void MerkelTree::finalize()
+{
+	if (this->hash.has_value()) exitWithError("finalize() called on already finalized merkel tree");
+	this->flushPendingLeaves();
+	if (this->hashes.empty()) exitWithError("finalize() called on merkel tree without data");
+	
+	this->levelOffsets = {0};
+	this->buildLevelsAbove(0);
+	this->hash = this->hashes.back();
 }
 
-const std::array<char, 32>& MerkelNode::getHash(bool _cleanupChildrenWhenDone)
+void MerkelTree::addData(const char* data, int amountBytes)
 {
-	if (level == 0)
+	if (this->hash.has_value()) exitWithError("Cannot addData to finalized merkel tree");
+	else if (amountBytes < 0) exitWithError("addData amountBytes<0");
+	else if (seenPartialLeaf) exitWithError("Merkel tree saw a partial leaf already.");
+	else if (amountBytes == leafSize) {}
+	else if (amountBytes < leafSize) seenPartialLeaf = true;
+	else exitWithError("Merkel tree must only receive whole leaves, and optionally one last partial leaf.");
+	
+	totalBytes += amountBytes;
+	
+	if (amountBytes == leafSize)
 	{
-		if (dataSize == 0) exitWithError("getHash() on level==0 && dataSize==0");
-		if (!this->hash.has_value()) exitWithError("getHash() on level==0 without hash");
-		return *this->hash;
+		if (pendingLeafData.empty()) pendingLeafData.resize(MERKEL_LEAF_BATCH * (long)leafSize);
+		memcpy(&pendingLeafData[amountPendingLeaves * (long)leafSize], data, leafSize);
+		amountPendingLeaves++;
+		if (amountPendingLeaves == MERKEL_LEAF_BATCH) this->flushPendingLeaves();
 	}
 	else
 	{
-		if (!this->hash.has_value())
-		{
-			if (child0 == nullptr && child1 == nullptr)
-			{
-				exitWithError("child0 == nullptr && child1 == nullptr");
-			}
-			else if (child0 == nullptr && child1 != nullptr)
-			{
-				exitWithError("child0 == nullptr && child1 != nullptr");
-			}
-			else if (child0 != nullptr && child1 == nullptr)
-			{
-				this->hash = child0->getHash(_cleanupChildrenWhenDone);
-				if (_cleanupChildrenWhenDone) this->child0 = nullptr;
-			}
-			else if (child0 != nullptr && child1 != nullptr)
-			{
-				this->hash = ZERO_HASH;
-				SHA256 sha256;
-				sha256.update((unsigned char*)child0->getHash(_cleanupChildrenWhenDone).data(), 32);
-				sha256.update((unsigned char*)child1->getHash(_cleanupChildrenWhenDone).data(), 32);
-				sha256.final((unsigned char*)this->hash->data());
-				if (_cleanupChildrenWhenDone) this->child0 = nullptr;
-				if (_cleanupChildrenWhenDone) this->child1 = nullptr;
-			}
-		}
-		return *this->hash;
+		this->flushPendingLeaves();
+		this->addLeaves(data, amountBytes);
 	}
 }
 
-long MerkelNode::calcDataSize()
+void MerkelTree::flushPendingLeaves()
 {
-	if (this->dataSize >= 1) return dataSize;
-	else return this->dataSize = (child0 == nullptr ? 0 : child0->calcDataSize()) + (child1 == nullptr ? 0 : child1->calcDataSize());
+	if (amountPendingLeaves == 0) return;
+	this->addLeaves(pendingLeafData.data(), amountPendingLeaves * (long)leafSize);
+	amountPendingLeaves = 0;
 }
 
-bool MerkelNode::isFull() const
+// Appends the leaf hashes of _data to level 0. Only the last leaf of the tree may be shorter than leafSize.
+void MerkelTree::addLeaves(const char* _data, long _amountBytes)
 {
-	if (level == 0) return false; //this->dataSize >= 1;
-	else return this->hash.has_value() || (child0 != nullptr && child1 != nullptr && child0->isFull() && child1->isFull());
+	long amountFullLeaves = _amountBytes / leafSize;
+	long tailBytes = _amountBytes % leafSize;
+	long first = this->hashes.size();
+	
+	this->hashes.resize(first + amountFullLeaves + (tailBytes != 0 ? 1 : 0));
+	this->sizes.resize(this->hashes.size(), leafSize);
+	
+	hashLeaves(this->hashAlgorithm, _data, amountFullLeaves, leafSize, this->firstLeaf + first, &this->hashes[first]);
+	
+	if (tailBytes != 0)
+	{
+		this->hashes.back() = hashLeaf(this->hashAlgorithm, &_data[amountFullLeaves * leafSize], tailBytes, leafSize, this->firstLeaf + first + amountFullLeaves);
+		this->sizes.back() = tailBytes;
+	}
+	
+	if (this->firstLeaf + first == 0 && !rootIsTopNode(this->hashAlgorithm))
+	{
+		this->firstLeafRootHash = hashRootLeaf(this->hashAlgorithm, _data, std::min(_amountBytes, (long)leafSize));
+	}
 }
 
-void MerkelNode::serialize(std::ostream& _dest)
+// Root hash of the tree, once every level below the root is built. The trees of the chunks of a MerkelTreeBuilder
+// are not whole files, and their roots are never used, so their top node stands in.
+std::array<char, 32> MerkelTree::computeRootHash() const
 {
-	this->calcDataSize();
-	this->getHash(false);
-	if (this->hash == std::nullopt) exitWithError("no hash after getHash()");
+	int topLevel = this->rootLevel - 1;
+	if (rootIsTopNode(this->hashAlgorithm) || this->firstLeaf != 0) return this->hashes[this->levelOffsets[topLevel]];
+	if (topLevel >= 1) return hashRootNode(this->hashAlgorithm, &this->hashes[this->levelOffsets[topLevel - 1]]);
+	if (!this->firstLeafRootHash.has_value()) exitWithError("Fatal bug in MerkelTree: root hash of a single leaf tree without its leaf");
+	return *this->firstLeafRootHash;
+}
+
+// Levels 0.._level are complete and end at the end of hashes/sizes. Builds every level above it, up to and including the root.
+void MerkelTree::buildLevelsAbove(int _level)
+{
+	int fromLevel = _level;
+	this->levelOffsets.resize(_level + 1);
+	long below = this->levelOffsets[_level];
+	long belowSize = this->hashes.size() - below;
+	
+	this->hashes.reserve(this->hashes.size() + belowSize + 64);
 	
-	_dest.write((char*)&this->level, 1);
-	_dest.write((char*)&this->dataSize, 8);
-	_dest.write(this->hash->data(), 32);
-	if (this->child0 != nullptr) this->child0->serialize(_dest);
-	if (this->child1 != nullptr) this->child1->serialize(_dest);
+	while (true)
+	{
+		// The level above a single node is the root, which has that node as its only child
+		bool isRoot = (belowSize == 1);
+		long amountPairs = isRoot ? 0 : belowSize / 2;
+		long levelStart = this->hashes.size();
+		long levelSize = (belowSize + 1) / 2;
+		
+		this->levelOffsets.push_back(levelStart);
+		this->hashes.resize(levelStart + levelSize);
+		
+		hashNodes(this->hashAlgorithm, &this->hashes[below], amountPairs, &this->hashes[levelStart]);
+		if (belowSize % 2 == 1) this->hashes[levelStart + levelSize - 1] = this->hashes[below + belowSize - 1];
+		
+		_level++;
+		below = levelStart;
+		belowSize = levelSize;
+		if (isRoot) break;
+	}
+	
+	this->rootLevel = _level;
+	this->levelOffsets.push_back(this->hashes.size());
+	this->hashes.back() = this->computeRootHash();
+	this->buildSizesAbove(fromLevel);
 }
 
-MerkelNode::MerkelNode(std::istream& _serializedTree)
+// Sizes of levels 0.._level are known; fills in the sizes of every level above it
+void MerkelTree::buildSizesAbove(int _level)
 {
-	_serializedTree.read((char*)&this->level, 1);
+	this->sizes.resize(this->hashes.size());
+	for (int level=_level+1; level<=this->rootLevel; level++)
+	{
+		long below = this->levelOffsets[level - 1];
+		long belowSize = this->levelSize(level - 1);
+		long at = this->levelOffsets[level];
+		for (long i=0; i<this->levelSize(level); i++)
+		{
+			this->sizes[at + i] = this->sizes[below + 2*i] + (2*i + 1 < belowSize ? this->sizes[below + 2*i + 1] : 0);
+		}
+	}
+}
+
+void MerkelTree::serialize(std::ostream& _dest) const
+{
+	if (!this->hash.has_value()) exitWithError("Fatal bug in MerkelTree: serialize called on non-finalized tree");
+	
+	MerkelTreeFileHeader header;
+	memcpy(header.magic, MERKEL_TREE_V2_MAGIC, 8);
+	header.leafSize = this->leafSize;
+	header.rootLevel = this->rootLevel;
+	header.hashAlgorithm = this->hashAlgorithm;
+	header.reserved = 0;
+	header.totalBytes = this->totalBytes;
+	header.amountNodes = this->hashes.size();
+	
+	_dest.write((const char*)&header, sizeof(header));
+	_dest.write(this->hashes[0].data(), this->hashes.size() * 32);
+}
+
+void MerkelTree::deserializeNode(std::istream& _serializedTree, std::vector<std::vector<std::array<char, 32>>>& _hashes, std::vector<std::vector<long>>& _sizes, int _level, long _index)
+{
+	unsigned char level;
+	_serializedTree.read((char*)&level, 1);
 	if (_serializedTree.gcount() != 1) throw Error_MerkelTreeFileCorrupted();
+	if (level != _level) throw Error_MerkelTreeFileCorrupted();
 	
-	_serializedTree.read((char*)&this->dataSize, 8);
+	// Nodes of a level must appear left to right, and node i must be the parent of nodes 2i and 2i+1
+	if (_index != (long)_hashes[level].size()) throw Error_MerkelTreeFileCorrupted();
+	
+	long dataSize;
+	_serializedTree.read((char*)&dataSize, 8);
 	if (_serializedTree.gcount() != 8) throw Error_MerkelTreeFileCorrupted();
 	
-	this->hash = ZERO_HASH;
-	_serializedTree.read(this->hash->data(), 32);
+	std::array<char, 32> hash;
+	_serializedTree.read(hash.data(), 32);
 	if (_serializedTree.gcount() != 32) throw Error_MerkelTreeFileCorrupted();
 	
+	_hashes[level].push_back(hash);
+	_sizes[level].push_back(dataSize);
+	
 	if (!_serializedTree.eof())
 	{
 		unsigned char nextLevel = (unsigned char)_serializedTree.peek();
 		if (nextLevel < level)
 		{
 			if (nextLevel+1 != level) throw Error_MerkelTreeFileCorrupted();
-			this->child0 = std::make_shared<MerkelNode>(_serializedTree);
-			//this->child0->parent = this->shared_from_this();
+			this->deserializeNode(_serializedTree, _hashes, _sizes, level - 1, 2*_index);
 		}
 		
 		nextLevel = (unsigned char)_serializedTree.peek();
 		if (nextLevel < level)
 		{
 			if (nextLevel+1 != level) throw Error_MerkelTreeFileCorrupted();
-			this->child1 = std::make_shared<MerkelNode>(_serializedTree);
-			//this->child1->parent = this->shared_from_this();
+			this->deserializeNode(_serializedTree, _hashes, _sizes, level - 1, 2*_index + 1);
 		}
 	}
+	
+	if (level != 0 && (long)_hashes[level - 1].size() <= 2*_index) throw Error_MerkelTreeFileCorrupted();
 }
 
-
 MerkelTree::MerkelTree(std::istream& _serializedTree)
 {
-	serializable = true;
-	rootMerkelNode = std::make_shared<MerkelNode>(_serializedTree);
-	this->hash = rootMerkelNode->getHash(false);
-	totalBytes = rootMerkelNode->calcDataSize();
+	int version = merkelTreeFileVersion(_serializedTree);
+	if (version == 1) this->deserializeV1(_serializedTree);
+	else if (version == 2) this->deserializeV2(_serializedTree);
+	else throw Error_MerkelTreeFileCorrupted();
+	
+	this->totalBytes = this->sizes.back();
+	this->hash = this->hashes.back();
 }
 
-MerkelTree::MerkelTree(bool _serializable)
+void MerkelTree::deserializeV2(std::istream& _serializedTree)
 {
-	currentMerkelNode = rootMerkelNode = std::make_shared<MerkelNode>(0, nullptr);
-	seenNon1024segment = false;
-	totalBytes = 0;
-	serializable = _serializable;
+	MerkelTreeFileHeader header;
+	_serializedTree.read((char*)&header, sizeof(header));
+	if (_serializedTree.gcount() != sizeof(header)) throw Error_MerkelTreeFileCorrupted();
+	if (memcmp(header.magic, MERKEL_TREE_V2_MAGIC, 8) != 0) throw Error_MerkelTreeFileCorrupted();
+	if (!isValidMerkelLeafSize(header.leafSize)) throw Error_MerkelTreeFileCorrupted();
+	if (!isValidHashAlgorithm(header.hashAlgorithm) || header.reserved != 0) throw Error_MerkelTreeFileCorrupted();
+	if (header.totalBytes <= 0) throw Error_MerkelTreeFileCorrupted();
+	
+	this->leafSize = header.leafSize;
+	this->hashAlgorithm = (HashAlgorithm)header.hashAlgorithm;
+	std::vector<long> levelSizes = merkelLevelSizes(header.totalBytes, this->leafSize);
+	if (header.rootLevel != levelSizes.size() - 1) throw Error_MerkelTreeFileCorrupted();
+	
+	this->rootLevel = header.rootLevel;
+	this->levelOffsets.push_back(0);
+	for (long levelSize : levelSizes) this->levelOffsets.push_back(this->levelOffsets.back() + levelSize);
+	if (header.amountNodes != this->levelOffsets.back()) throw Error_MerkelTreeFileCorrupted();
+	
+	// Don't trust a damaged header with a huge allocation
+	std::streampos hashesStart = _serializedTree.tellg();
+	_serializedTree.seekg(0, std::ios::end);
+	std::streampos end = _serializedTree.tellg();
+	_serializedTree.seekg(hashesStart);
+	if (hashesStart != -1 && end != -1 && end - hashesStart < header.amountNodes * 32) throw Error_MerkelTreeFileCorrupted();
+	
+	this->hashes.resize(header.amountNodes);
+	_serializedTree.read(this->hashes[0].data(), header.amountNodes * 32);
+	if (_serializedTree.gcount() != header.amountNodes * 32) throw Error_MerkelTreeFileCorrupted();
+	
+	// Sets eof if the whole file was consumed, just like after reading a version 1 tree
+	_serializedTree.peek();
+	
+	this->sizes.resize(levelSizes[0], this->leafSize);
+	this->sizes.back() = header.totalBytes - (levelSizes[0] - 1) * this->leafSize;
+	this->buildSizesAbove(0);
 }
-long MerkelTree::getTotalBytes() const
+
+void MerkelTree::deserializeV1(std::istream& _serializedTree)
 {
-	if (!this->hash.has_value()) exitWithError("getTotalBytes() called on non-finalized merkel tree");
-	return totalBytes;
+	// The root comes first, so its level tells how many levels to expect
+	int rootLevel = _serializedTree.peek();
+	
+	std::vector<std::vector<std::array<char, 32>>> levelHashes(rootLevel + 1);
+	std::vector<std::vector<long>> levelSizes(rootLevel + 1);
+	this->deserializeNode(_serializedTree, levelHashes, levelSizes, rootLevel, 0);
+	
+	long amountNodes = 0;
+	for (const auto& level : levelHashes) amountNodes += level.size();
+	this->hashes.reserve(amountNodes);
+	this->sizes.reserve(amountNodes);
+	
+	for (int level=0; level<=rootLevel; level++)
+	{
+		this->levelOffsets.push_back(this->hashes.size());
+		this->hashes.insert(this->hashes.end(), levelHashes[level].begin(), levelHashes[level].end());
+		this->sizes.insert(this->sizes.end(), levelSizes[level].begin(), levelSizes[level].end());
+		levelHashes[level] = std::vector<std::array<char, 32>>();
+		levelSizes[level] = std::vector<long>();
+	}
+	this->levelOffsets.push_back(this->hashes.size());
+	
+	this->rootLevel = rootLevel;
 }
-void MerkelTree::finalize()
+
+bool MerkelTree::equals(const MerkelTree& _other) const
 {
-	if (this->hash.has_value()) exitWithError("finalize() called on already finalized merkel tree");
-	this->hash = rootMerkelNode->getHash(!serializable);
-	if (!serializable) this->rootMerkelNode = nullptr;
+	if (this->totalBytes != _other.totalBytes) return false;
+	if (this->leafSize != _other.leafSize) return false;
+	if (this->hashAlgorithm != _other.hashAlgorithm) return false;
+	if (this->rootLevel != _other.rootLevel) return false;
+	if (this->levelOffsets != _other.levelOffsets) return false;
+	if (this->sizes != _other.sizes) return false;
+	if (this->hashes != _other.hashes) return false;
+	return true;
 }
 
-void MerkelTree::addData(const char* data, int amountBytes)
+bool MerkelTree::errorCheck() const
 {
-	if (this->hash.has_value()) exitWithError("Cannot addData to finalized merkel tree");
-	else if (amountBytes < 0) exitWithError("addData amountBytes<0");
-	else if (seenNon1024segment) exitWithError("Merkel tree saw a non-1024-byte segment already.");
-	else if (amountBytes == 1024) {}
-	else if (amountBytes < 1024) seenNon1024segment = true;
-	else exitWithError("Merkel tree must only receive blocks of 1024 bytes, and optionally one last block less than 1024 bytes.");
+	if (!this->hash.has_value()) return false;
+	if (this->levelSize(this->rootLevel) != 1) return false;
+	if (this->totalBytes != this->sizes.back()) return false;
+	if (this->hash != this->hashes.back()) return false;
 	
-	// Search upwards until we're at the finished root node, or we're at a node with < 2 children
-	while (true)
+	// Only the last leaf may be shorter than leafSize
+	long amountLeaves = this->levelSize(0);
+	for (long i=0; i<amountLeaves-1; i++)
 	{
-		if (currentMerkelNode == rootMerkelNode)
-		{
-			rootMerkelNode = std::make_shared<MerkelNode>(currentMerkelNode->level + 1, nullptr);
-			rootMerkelNode->setChild0(currentMerkelNode);
-			currentMerkelNode->parent = rootMerkelNode;
-			break;
-		}
-		else if (currentMerkelNode->child0 != nullptr && currentMerkelNode->child1 != nullptr)
+		if (this->sizes[i] != this->leafSize) return false;
+	}
+	if (this->sizes[amountLeaves-1] < 1 || this->sizes[amountLeaves-1] > this->leafSize) return false;
+	
+	std::vector<std::array<char, 32>> recomputedHashes;
+	for (int level=1; level<=this->rootLevel; level++)
+	{
+		long below = this->levelOffsets[level - 1];
+		long belowSize = this->levelSize(level - 1);
+		long at = this->levelOffsets[level];
+		long amountPairs = belowSize / 2;
+		
+		if (this->levelSize(level) != (belowSize + 1) / 2) return false;
+		if (level == this->rootLevel && belowSize != 1) return false;
+		
+		// The root of a single leaf can only be checked against the bytes of the leaf
+		if (level == this->rootLevel && !rootIsTopNode(this->hashAlgorithm))
 		{
-			currentMerkelNode->getHash(!serializable);
-			currentMerkelNode = currentMerkelNode->parent;
+			if (level >= 2 && this->hashes[at] != hashRootNode(this->hashAlgorithm, &this->hashes[this->levelOffsets[level - 2]])) return false;
+			if (this->sizes[at] != this->sizes[below]) return false;
 			continue;
 		}
-		else if (currentMerkelNode->child0 == nullptr && currentMerkelNode->child1 == nullptr && currentMerkelNode->hash.has_value())
+		
+		recomputedHashes.resize(amountPairs);
+		hashNodes(this->hashAlgorithm, &this->hashes[below], amountPairs, recomputedHashes.data());
+		for (long i=0; i<amountPairs; i++)
 		{
-			currentMerkelNode->getHash(!serializable);
-			currentMerkelNode = currentMerkelNode->parent;
-			continue;
+			if (this->hashes[at + i] != recomputedHashes[i]) return false;
+			if (this->sizes[at + i] != this->sizes[below + 2*i] + this->sizes[below + 2*i + 1]) return false;
 		}
-		else
+		if (belowSize % 2 == 1)
 		{
-			break;
+			if (this->hashes[at + this->levelSize(level) - 1] != this->hashes[below + belowSize - 1]) return false;
+			if (this->sizes[at + this->levelSize(level) - 1] != this->sizes[below + belowSize - 1]) return false;
 		}
 	}
+	return true;
+}
+
+std::vector<std::array<char, 32>> MerkelTree::listBlockHashes() const
+{
+	return std::vector<std::array<char, 32>>(this->hashes.begin(), this->hashes.begin() + this->levelSize(0));
+}
+
+MappedMerkelTree::MappedMerkelTree(const std::string& _path)
+{
+	int fd = open(_path.c_str(), O_RDONLY);
+	if (fd == -1) throw Error_MerkelTreeFileCorrupted();
 	
-	// Search downwards until we're at a bottom node
-	while (currentMerkelNode->level > 0)
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (long)sizeof(MerkelTreeFileHeader))
 	{
-		std::shared_ptr<MerkelNode> newNode = std::make_shared<MerkelNode>(currentMerkelNode->level - 1, currentMerkelNode);
-		
-		if (currentMerkelNode->child0 == nullptr) currentMerkelNode->setChild0(newNode);
-		else if (currentMerkelNode->child1 == nullptr) currentMerkelNode->setChild1(newNode);
-		else exitWithError("Fatal bug in MerkelTree: lower level node already has two children");
-		
-		currentMerkelNode = newNode;
+		close(fd);
+		throw Error_MerkelTreeFileCorrupted();
 	}
 	
-	currentMerkelNode->setData(data, amountBytes);
-	if (!serializable) currentMerkelNode->parent->forgetChildrenIfFull();
+	void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) throw Error_MerkelTreeFileCorrupted();
 	
-	totalBytes += amountBytes;
+	this->data = (const char*)mapped;
+	this->fileBytes = st.st_size;
+	this->header = (const MerkelTreeFileHeader*)this->data;
+	
+	if (memcmp(this->header->magic, MERKEL_TREE_V2_MAGIC, 8) != 0 ||
+		!isValidMerkelLeafSize(this->header->leafSize) ||
+		!isValidHashAlgorithm(this->header->hashAlgorithm) ||
+		this->header->reserved != 0 ||
+		this->header->totalBytes <= 0)
+	{
+		munmap((void*)this->data, this->fileBytes);
+		throw Error_MerkelTreeFileCorrupted();
+	}
+	
+	std::vector<long> levelSizes = merkelLevelSizes(this->header->totalBytes, this->header->leafSize);
+	this->levelOffsets.push_back(0);
+	for (long levelSize : levelSizes) this->levelOffsets.push_back(this->levelOffsets.back() + levelSize);
+	
+	if (this->header->rootLevel != levelSizes.size() - 1 ||
+		this->header->amountNodes != this->levelOffsets.back() ||
+		this->fileBytes < (long)sizeof(MerkelTreeFileHeader) + this->levelOffsets.back() * 32)
+	{
+		munmap((void*)this->data, this->fileBytes);
+		throw Error_MerkelTreeFileCorrupted();
+	}
+	
+	madvise((void*)this->data, this->fileBytes, MADV_SEQUENTIAL);
 }
 
-void MerkelTree::serialize(std::ostream& _dest)
+MappedMerkelTree::~MappedMerkelTree()
 {
-	if (!this->serializable) exitWithError("Fatal bug in MerkelTree: serialize called on non-serializable tree");
-	
-	rootMerkelNode->serialize(_dest);
+	munmap((void*)this->data, this->fileBytes);
 }
 
-bool MerkelTree::equals(const MerkelTree& _other) const
+long MappedMerkelTree::getTotalBytes() const
 {
-	if (this->totalBytes != _other.totalBytes) return false;
-	return this->rootMerkelNode->equals(*_other.rootMerkelNode);
-}
-bool MerkelNode::equals(MerkelNode& _other)
-{
-	if (this->level != _other.level) return false;
-	this->calcDataSize();
-	_other.calcDataSize();
-	if (this->dataSize != _other.dataSize) return false;
-	if ((this->child0 == nullptr) != (_other.child0 == nullptr)) return false;
-	if ((this->child1 == nullptr) != (_other.child1 == nullptr)) return false;
-	if (this->child0 != nullptr && !this->child0->equals(*_other.child0)) return false;
-	if (this->child1 != nullptr && !this->child1->equals(*_other.child1)) return false;
-	return true;
+	return this->header->totalBytes;
+}
+
+int MappedMerkelTree::getLeafSize() const
+{
+	return this->header->leafSize;
+}
+
+HashAlgorithm MappedMerkelTree::getHashAlgorithm() const
+{
+	return (HashAlgorithm)this->header->hashAlgorithm;
+}
+
+long MappedMerkelTree::getAmountLeaves() const
+{
+	return this->getLevelSize(0);
+}
+
+int MappedMerkelTree::getRootLevel() const
+{
+	return this->header->rootLevel;
+}
+
+long MappedMerkelTree::getLevelSize(int _level) const
+{
+	return this->levelOffsets[_level + 1] - this->levelOffsets[_level];
+}
+
+const std::array<char, 32>& MappedMerkelTree::getNodeHash(int _level, long _index) const
+{
+	const std::array<char, 32>* hashes = (const std::array<char, 32>*)(this->data + sizeof(MerkelTreeFileHeader));
+	return hashes[this->levelOffsets[_level] + _index];
+}
+
+const std::array<char, 32>& MappedMerkelTree::getLeafHash(long _index) const
+{
+	return this->getNodeHash(0, _index);
 }
 
-bool MerkelNode::errorCheck(bool _isRightMostNode)
+const std::array<char, 32>& MappedMerkelTree::getRootHash() const
 {
-	if (this->child0 == nullptr && this->child1 != nullptr) return false;
-	if ((this->child0 == nullptr && this->child1 == nullptr) ^ (this->level == 0)) return false;
-	if (this->child0 != nullptr)
+	return this->getNodeHash(this->getRootLevel(), 0);
+}
+
+bool MappedMerkelTree::hasTrailingBytes() const
+{
+	return this->fileBytes != (long)sizeof(MerkelTreeFileHeader) + this->levelOffsets.back() * 32;
+}
+
+MerkelTreeLeafReader::MerkelTreeLeafReader(const std::string& _path)
+{
+	std::ifstream ifs(_path, std::ios::binary);
+	int version = merkelTreeFileVersion(ifs);
+	
+	if (version == 2)
 	{
-		if (this->child0->level != this->level - 1) return false;
-		//if (this->child0->parent.get() != this) return false;
-		if (!this->child0->errorCheck(_isRightMostNode && this->child1 == nullptr)) return false;
+		ifs.close();
+		this->mapped = std::make_unique<MappedMerkelTree>(_path);
+		this->totalBytes = this->mapped->getTotalBytes();
+		this->leafSize = this->mapped->getLeafSize();
+		this->hashAlgorithm = this->mapped->getHashAlgorithm();
+		this->amountLeaves = this->mapped->getAmountLeaves();
+		this->leafHashes = &this->mapped->getLeafHash(0);
+		this->rootHash = this->mapped->getRootHash();
+		return;
 	}
-	if (this->child1 != nullptr)
+	if (version != 1) throw Error_MerkelTreeFileCorrupted();
+	
+	const long recordBytes = 1 + 8 + 32;
+	
+	ifs.seekg(0, std::ios::end);
+	long fileBytes = ifs.tellg();
+	ifs.seekg(0);
+	if (fileBytes <= 0 || fileBytes % recordBytes != 0) throw Error_MerkelTreeFileCorrupted();
+	
+	std::vector<char> data(fileBytes);
+	ifs.read(data.data(), fileBytes);
+	if (ifs.gcount() != fileBytes) throw Error_MerkelTreeFileCorrupted();
+	
+	memcpy(&this->totalBytes, &data[1], 8);
+	memcpy(this->rootHash.data(), &data[9], 32);
+	
+	std::vector<long> levelSizes = merkelLevelSizes(this->totalBytes, 1024);
+	if (this->totalBytes <= 0 || (unsigned char)data[0] != levelSizes.size() - 1) throw Error_MerkelTreeFileCorrupted();
+	
+	this->amountLeaves = levelSizes[0];
+	this->v1LeafHashes.reserve(this->amountLeaves);
+	for (long offset=0; offset<fileBytes; offset+=recordBytes)
 	{
-		if (this->child1->level != this->level - 1) return false;
-		//if (this->child1->parent.get() != this) return false;
-		if (!this->child1->errorCheck(_isRightMostNode)) return false;
+		if (data[offset] != 0) continue;
+		
+		// Every leaf is 1024 bytes, except the last one
+		long leafIndex = this->v1LeafHashes.size();
+		if (leafIndex == this->amountLeaves) throw Error_MerkelTreeFileCorrupted();
+		long leafBytes;
+		memcpy(&leafBytes, &data[offset + 1], 8);
+		if (leafBytes != std::min(1024L, this->totalBytes - leafIndex * 1024)) throw Error_MerkelTreeFileCorrupted();
+		
+		this->v1LeafHashes.emplace_back();
+		memcpy(this->v1LeafHashes.back().data(), &data[offset + 9], 32);
 	}
-	if (this->level != 0)
+	if ((long)this->v1LeafHashes.size() != this->amountLeaves) throw Error_MerkelTreeFileCorrupted();
+	
+	this->leafHashes = this->v1LeafHashes.data();
+}
+
+long MerkelTreeLeafReader::getTotalBytes() const
+{
+	return this->totalBytes;
+}
+
+int MerkelTreeLeafReader::getLeafSize() const
+{
+	return this->leafSize;
+}
+
+HashAlgorithm MerkelTreeLeafReader::getHashAlgorithm() const
+{
+	return this->hashAlgorithm;
+}
+
+long MerkelTreeLeafReader::getAmountLeaves() const
+{
+	return this->amountLeaves;
+}
+
+const std::array<char, 32>& MerkelTreeLeafReader::getRootHash() const
+{
+	return this->rootHash;
+}
+
+const std::array<char, 32>* MerkelTreeLeafReader::getLeafHashes() const
+{
+	return this->leafHashes;
+}
+
+std::shared_ptr<MerkelTree> MerkelTreeBuilder::buildChunkTree(long _chunkIndex, const std::vector<char>& _chunk) const
+{
+	std::shared_ptr<MerkelTree> chunkTree = std::make_shared<MerkelTree>(this->leafSize, this->hashAlgorithm);
+	chunkTree->firstLeaf = _chunkIndex << this->chunkLevel;
+	chunkTree->totalBytes = _chunk.size();
+	chunkTree->addLeaves(_chunk.data(), _chunk.size());
+	chunkTree->finalize();
+	return chunkTree;
+}
+
+MerkelTreeBuilder::MerkelTreeBuilder(int _threads, int _leafSize, HashAlgorithm _hashAlgorithm):
+	threads(_threads),
+	leafSize(_leafSize),
+	hashAlgorithm(_hashAlgorithm),
+	chunkLevel(0)
+{
+	if (!isValidMerkelLeafSize(_leafSize)) exitWithError("Invalid merkel tree leaf size " + std::to_string(_leafSize));
+	while (((long)this->leafSize << this->chunkLevel) < MERKEL_CHUNK_BYTES) this->chunkLevel++;
+}
+
+MerkelTreeBuilder::~MerkelTreeBuilder()
+{
+	this->stopWorkers();
+}
+
+void MerkelTreeBuilder::stopWorkers()
+{
 	{
-		std::array<char, 32> recomputedHash;
-		if (child1 != nullptr)
-		{
-			SHA256 sha256;
-			sha256.update((unsigned char*)child0->getHash(false).data(), 32);
-			sha256.update((unsigned char*)child1->getHash(false).data(), 32);
-			sha256.final((unsigned char*)recomputedHash.data());
-		}
-		else
-		{
-			recomputedHash = child0->getHash(false);
-		}
-		if (this->hash != recomputedHash) return false;
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		cv.notify_all();
 	}
-	if (this->level == 0)
+	for (auto& worker : workers) worker.join();
+	workers.clear();
+}
+
+void MerkelTreeBuilder::workerLoop()
+{
+	while (true)
 	{
-		if (this->dataSize != 1024)
+		std::pair<long, std::vector<char>> job;
 		{
-			if (!_isRightMostNode) return false;
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this]{ return !queue.empty() || stopping; });
+			if (queue.empty()) return;
+			job = std::move(queue.front());
+			queue.pop_front();
+			cv.notify_all();
 		}
+		
+		std::shared_ptr<MerkelTree> chunkTree = buildChunkTree(job.first, job.second);
+		
+		std::lock_guard<std::mutex> lock(mutex);
+		chunkTrees[job.first] = chunkTree;
+		freeBuffers.push_back(std::move(job.second));
+		amountChunksDone++;
+		cv.notify_all();
 	}
-	return true;
 }
 
-bool MerkelTree::errorCheck()
+std::vector<char> MerkelTreeBuilder::takeBuffer()
 {
-	if (this->totalBytes != this->rootMerkelNode->dataSize) return false;
-	if (this->hash != this->rootMerkelNode->getHash(false)) return false;
-	if (!this->rootMerkelNode->errorCheck()) return false;
-	return true;
+	std::lock_guard<std::mutex> lock(mutex);
+	if (freeBuffers.empty()) return std::vector<char>();
+	std::vector<char> ret = std::move(freeBuffers.back());
+	freeBuffers.pop_back();
+	return ret;
 }
 
-std::shared_ptr<MerkelTree> generateMerkelTreeFromFilePath(std::string _path, long maxBytesToRead)
+void MerkelTreeBuilder::addChunk(std::vector<char>&& _buffer)
 {
-	std::shared_ptr<MerkelTree> merkelTree = std::make_shared<MerkelTree>(true);
-	if (maxBytesToRead == -1) maxBytesToRead = std::filesystem::file_size(_path);
-	unsigned long bytesRead = 0;
+	if (_buffer.size() == 0) return;
+	if (seenPartialChunk) exitWithError("MerkelTreeBuilder::addChunk called after a partial chunk");
+	if ((long)_buffer.size() > MERKEL_CHUNK_BYTES) exitWithError("MerkelTreeBuilder::addChunk chunk too large");
+	if ((long)_buffer.size() < MERKEL_CHUNK_BYTES) seenPartialChunk = true;
 	
-	if (DEBUGGING) std::cout << "maxBytesToRead=" << maxBytesToRead << " _path=" << _path << "\r\n";
-	std::ifstream file(_path, std::ios_base::binary);
-	char buff[1024];
-	while (bytesRead < maxBytesToRead)
+	totalBytes += _buffer.size();
+	
+	std::unique_lock<std::mutex> lock(mutex);
+	long chunkIndex = chunkTrees.size();
+	chunkTrees.push_back(nullptr);
+	
+	if (threads <= 1)
 	{
-		int amountToRead;
-		if (bytesRead + 1024 <= maxBytesToRead) amountToRead = 1024;
-		else amountToRead = maxBytesToRead - bytesRead;
-		readExactly(file, &buff[0], amountToRead);
-		merkelTree->addData(&buff[0], amountToRead);
-		bytesRead += amountToRead;
+		lock.unlock();
+		std::shared_ptr<MerkelTree> chunkTree = buildChunkTree(chunkIndex, _buffer);
+		lock.lock();
+		chunkTrees[chunkIndex] = chunkTree;
+		freeBuffers.push_back(std::move(_buffer));
+		amountChunksDone++;
+		return;
 	}
-	file.close();
-	if (bytesRead != maxBytesToRead) exitWithError("Failed to read entire file in generateMerkelTreeFromFilePath");
-	merkelTree->finalize();
-	return merkelTree;
+	
+	// Most files fit in one chunk, so only start the worker threads once a second chunk arrives
+	if (chunkIndex == 1 && workers.empty())
+	{
+		for (int i=0; i<threads; i++) workers.emplace_back(&MerkelTreeBuilder::workerLoop, this);
+	}
+	
+	cv.wait(lock, [this]{ return (long)queue.size() < threads; });
+	queue.emplace_back(chunkIndex, std::move(_buffer));
+	cv.notify_all();
 }
 
-void MerkelNode::listBlockHashes(std::vector<std::array<char, 32>>& _out) const
+std::shared_ptr<MerkelTree> MerkelTreeBuilder::finalize()
 {
-	if (this->level == 0)
+	if (workers.empty())
 	{
-		_out.push_back(*this->hash);
+		// At most one chunk was queued, and no worker will pick it up
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!queue.empty())
+		{
+			std::pair<long, std::vector<char>> job = std::move(queue.front());
+			queue.pop_front();
+			chunkTrees[job.first] = buildChunkTree(job.first, job.second);
+			freeBuffers.push_back(std::move(job.second));
+			amountChunksDone++;
+		}
 	}
 	else
 	{
-		if (this->child0 == nullptr) exitWithError("wtf983498324");
-		else this->child0->listBlockHashes(_out);
-		if (this->child1 != nullptr) this->child1->listBlockHashes(_out);
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [this]{ return amountChunksDone == (long)chunkTrees.size(); });
+	}
+	this->stopWorkers();
+	
+	if (chunkTrees.size() == 0) exitWithError("MerkelTreeBuilder::finalize called without any data");
+	if (chunkTrees.size() == 1) return chunkTrees[0];
+	
+	// Up to chunkLevel, every level of the whole tree is the concatenation of that level of every chunk.
+	// The last chunk may be partial, in which case its top node stands in for it on the levels above its own top node.
+	// Its root is not used, because with BLAKE3 that is not the same hash as its top node.
+	std::shared_ptr<MerkelTree> tree = std::make_shared<MerkelTree>(this->leafSize, this->hashAlgorithm);
+	tree->totalBytes = totalBytes;
+	
+	long levelStart = 0;
+	for (int level=0; level<=this->chunkLevel; level++)
+	{
+		tree->levelOffsets.push_back(levelStart);
+		for (const auto& chunkTree : chunkTrees) levelStart += chunkTree->levelSize(std::min(level, chunkTree->rootLevel - 1));
+	}
+	std::vector<long> levelCursors = tree->levelOffsets;
+	tree->hashes.resize(levelStart);
+	tree->sizes.resize(levelStart);
+	
+	for (auto& chunkTree : chunkTrees)
+	{
+		for (int level=0; level<=this->chunkLevel; level++)
+		{
+			int chunkTreeLevel = std::min(level, chunkTree->rootLevel - 1);
+			long from = chunkTree->levelOffsets[chunkTreeLevel];
+			long amount = chunkTree->levelSize(chunkTreeLevel);
+			std::copy(chunkTree->hashes.begin() + from, chunkTree->hashes.begin() + from + amount, tree->hashes.begin() + levelCursors[level]);
+			std::copy(chunkTree->sizes.begin() + from, chunkTree->sizes.begin() + from + amount, tree->sizes.begin() + levelCursors[level]);
+			levelCursors[level] += amount;
+		}
+		chunkTree = nullptr;
 	}
+	
+	tree->buildLevelsAbove(this->chunkLevel);
+	tree->hash = tree->hashes.back();
+	return tree;
 }
 
-std::vector<std::array<char, 32>> MerkelTree::listBlockHashes() const
+std::shared_ptr<MerkelTree> generateMerkelTreeFromFilePath(std::string _path, long maxBytesToRead, int threads, int leafSize, HashAlgorithm hashAlgorithm)
 {
-	std::vector<std::array<char, 32>> ret;
-	this->rootMerkelNode->listBlockHashes(ret);
-	return ret;
+	if (maxBytesToRead == -1) maxBytesToRead = std::filesystem::file_size(_path);
+	long bytesRead = 0;
+	
+	if (DEBUGGING) std::cout << "maxBytesToRead=" << maxBytesToRead << " _path=" << _path << "\r\n";
+	int fd = open(_path.c_str(), O_RDONLY);
+	if (fd == -1) exitWithError("Failed to open file " + _path);
+	MerkelTreeBuilder builder(threads, leafSize, hashAlgorithm);
+	{
+		AsyncFileReader reader(fd, maxBytesToRead, MERKEL_CHUNK_BYTES);
+		while (bytesRead < maxBytesToRead)
+		{
+			std::vector<char> buff = builder.takeBuffer();
+			if (reader.next(buff) != RCR_CHUNK) exitWithError("Failed to read file " + _path);
+			bytesRead += buff.size();
+			builder.addChunk(std::move(buff));
+		}
+	}
+	close(fd);
+	if (bytesRead != maxBytesToRead) exitWithError("Failed to read entire file in generateMerkelTreeFromFilePath");
+	return builder.finalize();
 }
@@ -4,59 +4,210 @@
 #include <optional>
 #include <array>
 #include <ostream>
+#include <istream>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <cstdint>
 
-class Error_MerkelTreeFileCorrupted
+#include "hash_algorithm.h"
+
+#define MERKEL_LEAF_BATCH 16
+
+// Leaves are a power of two bytes in this range. The leaf size of a repo is set with leaf_size= in fmrepo.conf.
+#define MERKEL_DEFAULT_LEAF_SIZE 1024
+#define MERKEL_MIN_LEAF_SIZE 1024
+#define MERKEL_MAX_LEAF_SIZE (1L << 20)
+
+// MerkelTreeBuilder hashes the file in chunks of this many bytes, a power of two multiple of every leaf size
+#define MERKEL_CHUNK_BYTES (4L << 20)
+
+// Version 2 .fmtree files start with this magic. Version 1 files start with the level byte of their root node instead.
+#define MERKEL_TREE_V2_MAGIC "FMTREEv2"
+
+// A version 2 .fmtree file is this header, followed by the hash of every node: level by level from the leaves
+// up to the root, in the same order as MerkelTree keeps them in memory. Node sizes are not stored, they follow
+// from totalBytes. The header is 32 bytes, so in a mapped file every hash is 32-byte aligned.
+// hashAlgorithm is a HashAlgorithm, and reserved is always 0.
+struct MerkelTreeFileHeader
 {
+	char magic[8];
+	uint32_t leafSize;
+	uint16_t rootLevel;
+	uint8_t hashAlgorithm;
+	uint8_t reserved;
+	int64_t totalBytes;
+	int64_t amountNodes;
 };
+static_assert(sizeof(MerkelTreeFileHeader) == 32, "MerkelTreeFileHeader must be 32 bytes");
+
+// Returns the .fmtree version (1 or 2) of the stream without consuming anything, or 0 if the stream is empty
+int merkelTreeFileVersion(std::istream& _serializedTree);
+
+// Leaf size of a .fmtree file, without consuming anything: from the header of version 2 files, always 1024 for version 1.
+// Returns 0 if the stream is empty or the header has an invalid leaf size.
+long merkelTreeFileLeafSize(std::istream& _serializedTree);
+
+bool isValidMerkelLeafSize(long _leafSize);
+
+// Hash algorithm of a .fmtree file, without consuming anything: from the header of version 2 files, always SHA256 for
+// version 1. Returns nothing if the stream is empty or the header has an invalid hash algorithm.
+std::optional<HashAlgorithm> merkelTreeFileHashAlgorithm(std::istream& _serializedTree);
+
+// Amount of nodes on every level of the tree of a file of _totalBytes bytes, from the leaves up to and including the root
+std::vector<long> merkelLevelSizes(long _totalBytes, long _leafSize);
 
-class MerkelNode : public std::enable_shared_from_this<MerkelNode>
+class Error_MerkelTreeFileCorrupted
 {
-public:
-	MerkelNode(int _level, std::shared_ptr<MerkelNode> _parent);
-	MerkelNode(std::istream& _serializedTree);
-	void setData(const char* _data, int _amountBytes);
-	unsigned char level;
-	std::optional<std::array<char, 32>> hash = std::nullopt;
-	long dataSize = -1;
-	std::shared_ptr<MerkelNode> parent;
-	std::shared_ptr<MerkelNode> child0 = nullptr;
-	std::shared_ptr<MerkelNode> child1 = nullptr;
-	
-	void forgetChildrenIfFull();
-	
-	void setChild0(std::shared_ptr<MerkelNode> _child0);
-	void setChild1(std::shared_ptr<MerkelNode> _child1);
-	
-	const std::array<char, 32>& getHash(bool _cleanupChildrenWhenDone);
-	
-	bool isFull() const;
-	long calcDataSize();
-	void serialize(std::ostream& _dest);
-	bool equals(MerkelNode& _other);
-	void listBlockHashes(std::vector<std::array<char, 32>>& _out) const;
-	bool errorCheck(bool _isRightMostNode=true);
 };
 
+// The tree is stored as one implicit, level-ordered array: all leaves first, then level 1, and so on up to the root.
+// Node i of a level has children 2i and 2i+1 (if present) on the level below, so no per-node pointers are needed.
+// Every level has ceil(size of level below / 2) nodes, and the root is one extra level with a single child.
+// With SHA256 the root is a copy of its child, with BLAKE3 it is hashed again, see hash_algorithm.h.
 class MerkelTree
 {
+	friend class MerkelTreeBuilder;
 private:
-	std::shared_ptr<MerkelNode> rootMerkelNode;
-	std::shared_ptr<MerkelNode> currentMerkelNode;
-	bool seenNon1024segment;
-	long totalBytes;
+	long totalBytes = 0;
+	int leafSize = MERKEL_DEFAULT_LEAF_SIZE;
+	HashAlgorithm hashAlgorithm = DEFAULT_HASH_ALGORITHM;
+	bool seenPartialLeaf = false;
+	
+	// Index in the file of the first leaf, which is not 0 for the trees of the chunks of a MerkelTreeBuilder
+	long firstLeaf = 0;
+	
+	// Root hash of the file if its first leaf were the whole file, for when it is
+	std::optional<std::array<char, 32>> firstLeafRootHash;
+	
+	// levelOffsets[l] is the index of the first node of level l in hashes/sizes; levelOffsets[rootLevel+1] == hashes.size()
+	int rootLevel = -1;
+	std::vector<long> levelOffsets;
+	std::vector<std::array<char, 32>> hashes;
+	std::vector<long> sizes;
+	
+	// Full leaves are hashed MERKEL_LEAF_BATCH at a time using hashLeaves
+	std::vector<char> pendingLeafData;
+	int amountPendingLeaves = 0;
+	void flushPendingLeaves();
+	void addLeaves(const char* _data, long _amountBytes);
+	void buildLevelsAbove(int _level);
+	void buildSizesAbove(int _level);
+	std::array<char, 32> computeRootHash() const;
+	void deserializeV1(std::istream& _serializedTree);
+	void deserializeV2(std::istream& _serializedTree);
+	void deserializeNode(std::istream& _serializedTree, std::vector<std::vector<std::array<char, 32>>>& _hashes, std::vector<std::vector<long>>& _sizes, int _level, long _index);
+	long levelSize(int _level) const;
 public:
-	bool serializable;
 	std::optional<std::array<char, 32>> hash;
-	MerkelTree(bool _serializable);
+	explicit MerkelTree(int _leafSize = MERKEL_DEFAULT_LEAF_SIZE, HashAlgorithm _hashAlgorithm = DEFAULT_HASH_ALGORITHM);
 	MerkelTree(std::istream& _serializedTree);
 	long getTotalBytes() const;
+	int getLeafSize() const;
+	HashAlgorithm getHashAlgorithm() const;
 	void finalize();
 	void addData(const char* data, int amountBytes);
-	void serialize(std::ostream& _dest);
+	void serialize(std::ostream& _dest) const;
 	bool equals(const MerkelTree& _other) const;
-	bool errorCheck();
+	bool errorCheck() const;
 	std::vector<std::array<char, 32>> listBlockHashes() const;
 };
 
-std::shared_ptr<MerkelTree> generateMerkelTreeFromFilePath(std::string _path, long maxBytesToRead=-1);
+// Read-only view of a version 2 .fmtree file, mapped into memory, giving direct access to any node's hash.
+// Throws Error_MerkelTreeFileCorrupted if the file is missing, is not version 2, or its header does not match its size.
+class MappedMerkelTree
+{
+private:
+	const char* data = nullptr;
+	long fileBytes = 0;
+	const MerkelTreeFileHeader* header = nullptr;
+	std::vector<long> levelOffsets;
+public:
+	MappedMerkelTree(const std::string& _path);
+	~MappedMerkelTree();
+	MappedMerkelTree(const MappedMerkelTree&) = delete;
+	MappedMerkelTree& operator=(const MappedMerkelTree&) = delete;
+	
+	long getTotalBytes() const;
+	int getLeafSize() const;
+	HashAlgorithm getHashAlgorithm() const;
+	long getAmountLeaves() const;
+	int getRootLevel() const;
+	long getLevelSize(int _level) const;
+	const std::array<char, 32>& getNodeHash(int _level, long _index) const;
+	const std::array<char, 32>& getLeafHash(long _index) const;
+	const std::array<char, 32>& getRootHash() const;
+	
+	// True if the file has bytes after the root hash
+	bool hasTrailingBytes() const;
+};
+
+// The leaf hashes of a .fmtree file of either version, which is all that's needed to verify a file against its tree.
+// Version 2 files are mapped and their leaf hashes are used in place. Version 1 files are read with one bulk read and
+// walked once: they are a pre-order list of 41-byte records (level, size, hash), so the level 0 records are the leaves
+// from left to right and the first record is the root.
+// Throws Error_MerkelTreeFileCorrupted if the file is missing or its records don't add up to a tree.
+class MerkelTreeLeafReader
+{
+private:
+	std::unique_ptr<MappedMerkelTree> mapped;
+	std::vector<std::array<char, 32>> v1LeafHashes;
+	std::array<char, 32> rootHash;
+	long totalBytes = 0;
+	int leafSize = MERKEL_DEFAULT_LEAF_SIZE;
+	HashAlgorithm hashAlgorithm = HASH_SHA256;
+	long amountLeaves = 0;
+	const std::array<char, 32>* leafHashes = nullptr;
+public:
+	MerkelTreeLeafReader(const std::string& _path);
+	
+	long getTotalBytes() const;
+	int getLeafSize() const;
+	HashAlgorithm getHashAlgorithm() const;
+	long getAmountLeaves() const;
+	const std::array<char, 32>& getRootHash() const;
+	
+	// All leaf hashes, back to back
+	const std::array<char, 32>* getLeafHashes() const;
+};
+
+// Builds a serializable merkel tree from consecutive chunks of MERKEL_CHUNK_BYTES bytes; only the last chunk may be shorter.
+// Every chunk covers an aligned power-of-two range of leaves, so its subtree can be hashed on a worker thread on its own.
+// finalize() stitches the subtrees together into exactly the tree MerkelTree::addData would have built.
+class MerkelTreeBuilder
+{
+private:
+	int threads;
+	int leafSize;
+	HashAlgorithm hashAlgorithm;
+	
+	// Level of the tree on which every chunk has its own root, log2 of the amount of leaves per chunk
+	int chunkLevel;
+	
+	long totalBytes = 0;
+	bool seenPartialChunk = false;
+	std::vector<std::shared_ptr<MerkelTree>> chunkTrees;
+	long amountChunksDone = 0;
+	
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<std::pair<long, std::vector<char>>> queue;
+	std::vector<std::vector<char>> freeBuffers;
+	std::vector<std::thread> workers;
+	bool stopping = false;
+	
+	std::shared_ptr<MerkelTree> buildChunkTree(long _chunkIndex, const std::vector<char>& _chunk) const;
+	void workerLoop();
+	void stopWorkers();
+public:
+	MerkelTreeBuilder(int _threads, int _leafSize = MERKEL_DEFAULT_LEAF_SIZE, HashAlgorithm _hashAlgorithm = DEFAULT_HASH_ALGORITHM);
+	~MerkelTreeBuilder();
+	std::vector<char> takeBuffer();
+	void addChunk(std::vector<char>&& _buffer);
+	std::shared_ptr<MerkelTree> finalize();
+};
+
+std::shared_ptr<MerkelTree> generateMerkelTreeFromFilePath(std::string _path, long maxBytesToRead=-1, int threads=1, int leafSize=MERKEL_DEFAULT_LEAF_SIZE, HashAlgorithm hashAlgorithm=DEFAULT_HASH_ALGORITHM);
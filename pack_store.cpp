@@ -0,0 +1,312 @@
+#include <string>
+#include <array>
+#include <vector>
+#include <map>
+#include <optional>
+#include <mutex>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "sqlite3.h"
+#include "pack_store.h"
+
+PackStore::PackStore(const std::string& _repoPath) :
+	packDir(_repoPath + "/packs"),
+	dbPath(_repoPath + "/fmpackindex.sqlite")
+{
+}
+
+PackStore::~PackStore()
+{
+	for (auto& [pack, fd] : this->packFds) close(fd);
+	if (this->db == nullptr) return;
+	sqlite3_finalize(this->lookupStmt);
+	sqlite3_finalize(this->insertStmt);
+	sqlite3_finalize(this->replaceStmt);
+	sqlite3_close(this->db);
+}
+
+bool PackStore::open(bool _create)
+{
+	if (this->db != nullptr) return true;
+	if (!_create && !std::filesystem::exists(this->dbPath)) return false;
+	
+	int sqlite_returncode = sqlite3_open(this->dbPath.c_str(), &this->db);
+	if (sqlite_returncode != SQLITE_OK)
+	{
+		exitWithError("Cannot open pack index at " + this->dbPath + " because of sqlite error " + std::to_string(sqlite_returncode) + ": " + sqlite3_errmsg(this->db));
+	}
+	
+	const char* setupQueries[] = {
+		"PRAGMA journal_mode = WAL",
+		"PRAGMA busy_timeout = 10000",
+		"CREATE TABLE IF NOT EXISTS pack_index"
+		"("
+		"	hash BLOB NOT NULL PRIMARY KEY,"
+		"	pack INTEGER NOT NULL,"
+		"	offset INTEGER NOT NULL,"
+		"	data_bytes INTEGER NOT NULL,"
+		"	tree_bytes INTEGER NOT NULL,"
+		"	parity_bytes INTEGER NOT NULL"
+		") WITHOUT ROWID"
+	};
+	for (const char* query : setupQueries)
+	{
+		char* errorMessage = nullptr;
+		if (sqlite3_exec(this->db, query, nullptr, nullptr, &errorMessage) != SQLITE_OK)
+		{
+			std::string error = errorMessage != nullptr ? errorMessage : "unknown error";
+			sqlite3_free(errorMessage);
+			exitWithError("Failed to set up pack index at " + this->dbPath + ": " + error);
+		}
+	}
+	
+	const char* lookupQuery = "SELECT pack, offset, data_bytes, tree_bytes, parity_bytes FROM pack_index WHERE hash = ?";
+	const char* insertQuery = "INSERT OR IGNORE INTO pack_index (hash, pack, offset, data_bytes, tree_bytes, parity_bytes) VALUES (?, ?, ?, ?, ?, ?)";
+	const char* replaceQuery = "INSERT OR REPLACE INTO pack_index (hash, pack, offset, data_bytes, tree_bytes, parity_bytes) VALUES (?, ?, ?, ?, ?, ?)";
+	if (sqlite3_prepare_v2(this->db, lookupQuery, -1, &this->lookupStmt, nullptr) != SQLITE_OK ||
+		sqlite3_prepare_v2(this->db, insertQuery, -1, &this->insertStmt, nullptr) != SQLITE_OK ||
+		sqlite3_prepare_v2(this->db, replaceQuery, -1, &this->replaceStmt, nullptr) != SQLITE_OK)
+	{
+		exitWithError("Failed to prepare pack index queries: " + std::string(sqlite3_errmsg(this->db)));
+	}
+	return true;
+}
+
+std::string PackStore::packPath(long _pack) const
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/%08ld.fmpack", _pack);
+	return this->packDir + name;
+}
+
+int PackStore::packFd(long _pack, bool _create)
+{
+	auto it = this->packFds.find(_pack);
+	if (it != this->packFds.end()) return it->second;
+	
+	int fd = ::open(this->packPath(_pack).c_str(), O_RDWR | O_CLOEXEC | (_create ? O_CREAT : 0), 0666);
+	if (fd == -1)
+	{
+		if (!_create && errno == ENOENT) return -1;
+		exitWithError("Cannot open pack file " + this->packPath(_pack) + ": " + strerror(errno));
+	}
+	this->packFds[_pack] = fd;
+	return fd;
+}
+
+std::optional<PackEntry> PackStore::lookup(const std::array<char, 32>& _hash)
+{
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	if (!this->open(false)) return std::nullopt;
+	
+	sqlite3_reset(this->lookupStmt);
+	sqlite3_bind_blob(this->lookupStmt, 1, _hash.data(), 32, SQLITE_TRANSIENT);
+	
+	int stepResult = sqlite3_step(this->lookupStmt);
+	if (stepResult == SQLITE_DONE)
+	{
+		sqlite3_reset(this->lookupStmt);
+		return std::nullopt;
+	}
+	if (stepResult != SQLITE_ROW) exitWithError("Pack index lookup failed: " + std::string(sqlite3_errmsg(this->db)));
+	
+	PackEntry entry;
+	entry.pack = sqlite3_column_int64(this->lookupStmt, 0);
+	entry.offset = sqlite3_column_int64(this->lookupStmt, 1);
+	entry.dataBytes = sqlite3_column_int64(this->lookupStmt, 2);
+	entry.treeBytes = sqlite3_column_int64(this->lookupStmt, 3);
+	entry.parityBytes = sqlite3_column_int64(this->lookupStmt, 4);
+	
+	// Don't leave the statement on its row, that keeps the read transaction open until the next lookup
+	sqlite3_reset(this->lookupStmt);
+	return entry;
+}
+
+void PackStore::writeEntry(int _fd, long _offset, const std::array<char, 32>& _hash, const PackedBlob& _blob)
+{
+	PackEntryHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PACK_ENTRY_MAGIC, 8);
+	memcpy(header.hash, _hash.data(), 32);
+	header.dataBytes = _blob.data.size();
+	header.treeBytes = _blob.tree.size();
+	header.parityBytes = _blob.parity.size();
+	
+	// One write for the whole entry
+	std::vector<char> entry(sizeof(header) + _blob.data.size() + _blob.tree.size() + _blob.parity.size());
+	char* out = entry.data();
+	memcpy(out, &header, sizeof(header)); out += sizeof(header);
+	memcpy(out, _blob.data.data(), _blob.data.size()); out += _blob.data.size();
+	memcpy(out, _blob.tree.data(), _blob.tree.size()); out += _blob.tree.size();
+	memcpy(out, _blob.parity.data(), _blob.parity.size());
+	
+	long written = 0;
+	while (written < (long)entry.size())
+	{
+		ssize_t result = pwrite(_fd, entry.data() + written, entry.size() - written, _offset + written);
+		if (result < 0 && errno == EINTR) continue;
+		if (result <= 0) exitWithError("Failed to write to pack file: " + std::string(strerror(errno)));
+		written += result;
+	}
+}
+
+PackEntry PackStore::append(const std::array<char, 32>& _hash, const PackedBlob& _blob)
+{
+	if (this->appendPack == -1)
+	{
+		std::filesystem::create_directories(this->packDir);
+		
+		// Continue in the last pack file
+		this->appendPack = 0;
+		for (const auto& dirEntry : std::filesystem::directory_iterator(this->packDir))
+		{
+			std::string name = dirEntry.path().filename().string();
+			if (name.length() != 15 || name.substr(8) != ".fmpack") continue;
+			try { this->appendPack = std::max(this->appendPack, std::stol(name.substr(0, 8))); }
+			catch (...) {}
+		}
+	}
+	
+	PackEntry entry;
+	entry.dataBytes = _blob.data.size();
+	entry.treeBytes = _blob.tree.size();
+	entry.parityBytes = _blob.parity.size();
+	long entryBytes = sizeof(PackEntryHeader) + entry.dataBytes + entry.treeBytes + entry.parityBytes;
+	
+	while (true)
+	{
+		int fd = this->packFd(this->appendPack, true);
+		
+		// Other processes may be appending to the same pack file
+		if (flock(fd, LOCK_EX) != 0) exitWithError("Cannot lock pack file " + this->packPath(this->appendPack) + ": " + strerror(errno));
+		struct stat st;
+		if (fstat(fd, &st) != 0) exitWithError("Cannot stat pack file " + this->packPath(this->appendPack) + ": " + strerror(errno));
+		
+		if (st.st_size != 0 && st.st_size + entryBytes > PACK_FILE_MAX_BYTES)
+		{
+			flock(fd, LOCK_UN);
+			this->appendPack++;
+			continue;
+		}
+		
+		entry.pack = this->appendPack;
+		entry.offset = st.st_size;
+		this->writeEntry(fd, entry.offset, _hash, _blob);
+		flock(fd, LOCK_UN);
+		return entry;
+	}
+}
+
+bool PackStore::add(const std::array<char, 32>& _hash, const PackedBlob& _blob)
+{
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	this->open(true);
+	if (this->lookup(_hash).has_value()) return false;
+	
+	PackEntry entry = this->append(_hash, _blob);
+	
+	// If another process packed the same blob in the meantime, this copy is simply never referenced
+	sqlite3_reset(this->insertStmt);
+	sqlite3_bind_blob(this->insertStmt, 1, _hash.data(), 32, SQLITE_TRANSIENT);
+	sqlite3_bind_int64(this->insertStmt, 2, entry.pack);
+	sqlite3_bind_int64(this->insertStmt, 3, entry.offset);
+	sqlite3_bind_int64(this->insertStmt, 4, entry.dataBytes);
+	sqlite3_bind_int64(this->insertStmt, 5, entry.treeBytes);
+	sqlite3_bind_int64(this->insertStmt, 6, entry.parityBytes);
+	if (sqlite3_step(this->insertStmt) != SQLITE_DONE) exitWithError("Pack index insert failed: " + std::string(sqlite3_errmsg(this->db)));
+	return sqlite3_changes(this->db) != 0;
+}
+
+bool PackStore::read(const std::array<char, 32>& _hash, const PackEntry& _entry, PackedBlob& _blob)
+{
+	int fd;
+	{
+		std::lock_guard<std::recursive_mutex> lock(this->mutex);
+		fd = this->packFd(_entry.pack, false);
+	}
+	if (fd == -1) return false;
+	
+	// The sizes come from the index, so check them against the pack file before allocating anything
+	if (_entry.offset < 0 || _entry.dataBytes < 0 || _entry.treeBytes < 0 || _entry.parityBytes < 0) return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0) return false;
+	if (_entry.dataBytes > st.st_size || _entry.treeBytes > st.st_size || _entry.parityBytes > st.st_size) return false;
+	long entryBytes = sizeof(PackEntryHeader) + _entry.dataBytes + _entry.treeBytes + _entry.parityBytes;
+	if (_entry.offset + entryBytes > st.st_size) return false;
+	
+	std::vector<char> entry(entryBytes);
+	long amountRead = 0;
+	while (amountRead < (long)entry.size())
+	{
+		ssize_t result = pread(fd, entry.data() + amountRead, entry.size() - amountRead, _entry.offset + amountRead);
+		if (result < 0 && errno == EINTR) continue;
+		if (result <= 0) return false;
+		amountRead += result;
+	}
+	
+	PackEntryHeader header;
+	memcpy(&header, entry.data(), sizeof(header));
+	
+	const char* data = entry.data() + sizeof(header);
+	_blob.data.assign(data, data + _entry.dataBytes);
+	_blob.tree.assign(data + _entry.dataBytes, _entry.treeBytes);
+	_blob.parity.assign(data + _entry.dataBytes + _entry.treeBytes, _entry.parityBytes);
+	
+	return memcmp(header.magic, PACK_ENTRY_MAGIC, 8) == 0 &&
+		memcmp(header.hash, _hash.data(), 32) == 0 &&
+		header.dataBytes == _entry.dataBytes &&
+		header.treeBytes == _entry.treeBytes &&
+		header.parityBytes == _entry.parityBytes;
+}
+
+void PackStore::replace(const std::array<char, 32>& _hash, const PackEntry& _entry, const PackedBlob& _blob)
+{
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	
+	if ((long)_blob.data.size() == _entry.dataBytes && (long)_blob.tree.size() == _entry.treeBytes && (long)_blob.parity.size() == _entry.parityBytes)
+	{
+		this->writeEntry(this->packFd(_entry.pack, false), _entry.offset, _hash, _blob);
+		return;
+	}
+	
+	this->open(true);
+	PackEntry entry = this->append(_hash, _blob);
+	sqlite3_reset(this->replaceStmt);
+	sqlite3_bind_blob(this->replaceStmt, 1, _hash.data(), 32, SQLITE_TRANSIENT);
+	sqlite3_bind_int64(this->replaceStmt, 2, entry.pack);
+	sqlite3_bind_int64(this->replaceStmt, 3, entry.offset);
+	sqlite3_bind_int64(this->replaceStmt, 4, entry.dataBytes);
+	sqlite3_bind_int64(this->replaceStmt, 5, entry.treeBytes);
+	sqlite3_bind_int64(this->replaceStmt, 6, entry.parityBytes);
+	if (sqlite3_step(this->replaceStmt) != SQLITE_DONE) exitWithError("Pack index update failed: " + std::string(sqlite3_errmsg(this->db)));
+}
+
+std::vector<std::array<char, 32>> PackStore::list()
+{
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	std::vector<std::array<char, 32>> ret;
+	if (!this->open(false)) return ret;
+	
+	sqlite3_stmt* listStmt = nullptr;
+	if (sqlite3_prepare_v2(this->db, "SELECT hash FROM pack_index ORDER BY hash", -1, &listStmt, nullptr) != SQLITE_OK)
+	{
+		exitWithError("Failed to prepare pack index query: " + std::string(sqlite3_errmsg(this->db)));
+	}
+	while (sqlite3_step(listStmt) == SQLITE_ROW)
+	{
+		if (sqlite3_column_bytes(listStmt, 0) != 32) continue;
+		ret.push_back(sqlite3_column_32chars(listStmt, 0));
+	}
+	sqlite3_finalize(listStmt);
+	return ret;
+}
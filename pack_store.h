@@ -0,0 +1,98 @@
+#pragma once
+
+#include <string>
+#include <array>
+#include <vector>
+#include <map>
+#include <optional>
+#include <mutex>
+#include <cstdint>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+// Pack files are started anew once they reach this size
+#define PACK_FILE_MAX_BYTES (1L << 30)
+
+// pack_threshold= in fmrepo.conf can't be more than this, because packed blobs are handled in memory
+#define PACK_THRESHOLD_LIMIT (16L << 20)
+
+#define PACK_ENTRY_MAGIC "FMPACKe1"
+
+// Every entry of a pack file is this header, followed by the blob, its .fmtree and its .fmparity.
+// The header repeats what the index says, so an entry can be recognized without the index.
+struct PackEntryHeader
+{
+	char magic[8];
+	char hash[32];
+	int64_t dataBytes;
+	uint32_t treeBytes;
+	uint32_t parityBytes;
+	int64_t reserved;
+};
+static_assert(sizeof(PackEntryHeader) == 64, "PackEntryHeader must be 64 bytes");
+
+// Where the index says a packed blob is
+struct PackEntry
+{
+	long pack;
+	long offset;
+	long dataBytes;
+	long treeBytes;
+	long parityBytes;
+};
+
+// A packed blob with its tree and parity, read in one go
+struct PackedBlob
+{
+	std::vector<char> data;
+	std::string tree;
+	std::string parity;
+};
+
+// Small blobs, each with its tree and parity, stored as entries appended to large pack files packs/NNNNNNNN.fmpack,
+// so they don't cost three files each. An sqlite index, ordered by hash, tells where every blob is.
+// Entries are only ever appended, or overwritten with data of the same size when --errfix repairs them.
+// Nothing is created before the first blob is packed. All methods are thread-safe.
+class PackStore
+{
+private:
+	std::string packDir;
+	std::string dbPath;
+	sqlite3* db = nullptr;
+	sqlite3_stmt* lookupStmt = nullptr;
+	sqlite3_stmt* insertStmt = nullptr;
+	sqlite3_stmt* replaceStmt = nullptr;
+	std::recursive_mutex mutex;
+	
+	// Open read-write descriptors of the pack files, by number
+	std::map<long, int> packFds;
+	long appendPack = -1;
+	
+	// Returns false if the index doesn't exist and _create is false
+	bool open(bool _create);
+	int packFd(long _pack, bool _create);
+	std::string packPath(long _pack) const;
+	PackEntry append(const std::array<char, 32>& _hash, const PackedBlob& _blob);
+	void writeEntry(int _fd, long _offset, const std::array<char, 32>& _hash, const PackedBlob& _blob);
+public:
+	PackStore(const std::string& _repoPath);
+	~PackStore();
+	PackStore(const PackStore&) = delete;
+	PackStore& operator=(const PackStore&) = delete;
+	
+	std::optional<PackEntry> lookup(const std::array<char, 32>& _hash);
+	
+	// Appends the blob to the current pack file. Returns false, and appends nothing, if it was packed already.
+	bool add(const std::array<char, 32>& _hash, const PackedBlob& _blob);
+	
+	// Returns false if the entry can't be read, or its header doesn't match the index.
+	// In the second case _blob is filled in anyway, so that --errfix can repair the entry.
+	bool read(const std::array<char, 32>& _hash, const PackEntry& _entry, PackedBlob& _blob);
+	
+	// Overwrites the entry in place if the sizes are unchanged, otherwise appends it again and points the index there
+	void replace(const std::array<char, 32>& _hash, const PackEntry& _entry, const PackedBlob& _blob);
+	
+	// Hashes of all packed blobs, in order
+	std::vector<std::array<char, 32>> list();
+};
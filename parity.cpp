@@ -0,0 +1,554 @@
+#include <ostream>
+#include <sstream>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <cstdio>
+
+#include "util.h"
+#include "hash_algorithm.h"
+#include "parity.h"
+#include "reed_solomon.h"
+
+#define PARITY_READ_BUFFER_BYTES (1 << 20)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PARITY_X86 1
+#include <immintrin.h>
+#endif
+
+// XORs the full 1024-byte block _src into each of the _amountDests 64-byte aligned blocks in _dests.
+// The kernels load a piece of _src into registers once and XOR it into every destination, so the source
+// is read once per block rather than once per divisor.
+typedef void (*ParityXorKernel)(const char* _src, char* const* _dests, int _amountDests);
+
+static void xorInto_scalar(const char* _src, char* const* _dests, int _amountDests)
+{
+	uint64_t src[128];
+	memcpy(src, _src, 1024);
+	for (int d=0; d<_amountDests; d++)
+	{
+		uint64_t* dest = (uint64_t*)_dests[d];
+		for (int i=0; i<128; i++) dest[i] ^= src[i];
+	}
+}
+
+#ifdef PARITY_X86
+
+__attribute__((target("avx2")))
+static void xorInto_avx2(const char* _src, char* const* _dests, int _amountDests)
+{
+	// 256 bytes of the source at a time, in 8 of the 16 ymm registers
+	for (int offset=0; offset<1024; offset+=256)
+	{
+		__m256i src[8];
+		for (int i=0; i<8; i++) src[i] = _mm256_loadu_si256((const __m256i*)(_src + offset + 32*i));
+		for (int d=0; d<_amountDests; d++)
+		{
+			__m256i* dest = (__m256i*)(_dests[d] + offset);
+			for (int i=0; i<8; i++) _mm256_store_si256(&dest[i], _mm256_xor_si256(_mm256_load_si256(&dest[i]), src[i]));
+		}
+	}
+}
+
+__attribute__((target("avx512f")))
+static void xorInto_avx512(const char* _src, char* const* _dests, int _amountDests)
+{
+	// The whole source block fits in 16 of the 32 zmm registers
+	__m512i src[16];
+	for (int i=0; i<16; i++) src[i] = _mm512_loadu_si512((const void*)(_src + 64*i));
+	for (int d=0; d<_amountDests; d++)
+	{
+		__m512i* dest = (__m512i*)_dests[d];
+		for (int i=0; i<16; i++) _mm512_store_si512((void*)&dest[i], _mm512_xor_si512(_mm512_load_si512((const void*)&dest[i]), src[i]));
+	}
+}
+
+#endif // PARITY_X86
+
+static ParityXorKernel selectXorKernel()
+{
+#ifdef PARITY_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) return xorInto_avx512;
+	if (__builtin_cpu_supports("avx2")) return xorInto_avx2;
+#endif
+	return xorInto_scalar;
+}
+
+static ParityXorKernel activeXorKernel()
+{
+	static const ParityXorKernel kernel = selectXorKernel();
+	return kernel;
+}
+
+ParityAccumulator::ParityAccumulator(int _minDivisor, int _maxDivisor):
+	minDivisor(_minDivisor),
+	maxDivisor(_maxDivisor),
+	blockIndex(0)
+{
+	if (minDivisor < 1 || maxDivisor < minDivisor) exitWithError("ParityAccumulator: invalid divisor range");
+	
+	long amountParityBlocks = 0;
+	for (int d=minDivisor; d<=maxDivisor; d++)
+	{
+		divisorOffsets.push_back(amountParityBlocks);
+		amountParityBlocks += d;
+	}
+	parityBlocks.resize(amountParityBlocks);
+	memset(parityBlocks.data(), 0, amountParityBlocks * sizeof(ParityBlock));
+	
+	nextMods.assign(maxDivisor - minDivisor + 1, 0);
+	for (long offset : divisorOffsets) nextDests.push_back(parityBlocks[offset].bytes);
+}
+
+long ParityAccumulator::getAmountOfBlocks() const
+{
+	return blockIndex;
+}
+
+void ParityAccumulator::advance()
+{
+	for (int i=0; i<(int)nextDests.size(); i++)
+	{
+		int d = minDivisor + i;
+		if (++nextMods[i] == d) nextMods[i] = 0;
+		nextDests[i] = parityBlocks[divisorOffsets[i] + nextMods[i]].bytes;
+	}
+	blockIndex++;
+}
+
+void ParityAccumulator::addBlock(const char* _data, int _amountBytes)
+{
+	if (_amountBytes < 0 || _amountBytes > 1024) exitWithError("ParityAccumulator::addBlock amountBytes must be in [0, 1024]");
+	
+	if (_amountBytes == 1024)
+	{
+		activeXorKernel()(_data, nextDests.data(), (int)nextDests.size());
+	}
+	else
+	{
+		for (char* parityBlock : nextDests)
+		{
+			for (int i=0; i<_amountBytes; i++)
+			{
+				parityBlock[i] ^= _data[i];
+			}
+		}
+	}
+	
+	this->advance();
+}
+
+void ParityAccumulator::addBlocks(const char* _data, long _amountBytes)
+{
+	ParityXorKernel xorInto = activeXorKernel();
+	long offset = 0;
+	for (; offset + 1024 <= _amountBytes; offset += 1024)
+	{
+		xorInto(&_data[offset], nextDests.data(), (int)nextDests.size());
+		this->advance();
+	}
+	if (offset < _amountBytes) this->addBlock(&_data[offset], (int)(_amountBytes - offset));
+}
+
+void ParityAccumulator::serialize(std::ostream& _dest) const
+{
+	_dest.write((char*)&minDivisor, 4);
+	_dest.write((char*)&maxDivisor, 4);
+	_dest.write(parityBlocks[0].bytes, parityBlocks.size() * sizeof(ParityBlock));
+}
+
+std::pair<int, int> parityDivisorsFor(long _fileBytes, std::optional<double> _overheadPercent, int _maxDivisor)
+{
+	int maxDivisor = _maxDivisor;
+	if (_overheadPercent.has_value())
+	{
+		// The parity of divisors 2..D is (2 + 3 + ... + D) blocks
+		double budgetBlocks = _fileBytes * (*_overheadPercent / 100.0) / 1024.0;
+		int d = 2;
+		while (d < maxDivisor && ((d+1) * (d+2) / 2 - 1) <= budgetBlocks) d++;
+		maxDivisor = std::min(maxDivisor, d);
+	}
+	
+	long amountBlocks = (_fileBytes + 1023) / 1024;
+	maxDivisor = (int)std::max(1L, std::min((long)maxDivisor, amountBlocks));
+	return {std::min(2, maxDivisor), maxDivisor};
+}
+
+// Reads the divisors from the header of an XOR .fmparity and checks them against the size of the parity file,
+// so a corrupted header can't make the caller allocate parity for divisors the file doesn't have
+static bool readParityHeader(std::istream& _parity, int& _minDivisor, int& _maxDivisor)
+{
+	_parity.read((char*)&_minDivisor, 4);
+	_parity.read((char*)&_maxDivisor, 4);
+	if (_parity.fail() || _minDivisor < 1 || _maxDivisor < _minDivisor || _maxDivisor > PARITY_DIVISOR_LIMIT) return false;
+	
+	// The parity of divisors minDivisor..maxDivisor is (minDivisor + ... + maxDivisor) blocks
+	long amountParityBlocks = ((long)_minDivisor + _maxDivisor) * (_maxDivisor - _minDivisor + 1) / 2;
+	_parity.seekg(0, _parity.end);
+	long parityBytes = _parity.tellg();
+	_parity.seekg(8, _parity.beg);
+	return !_parity.fail() && parityBytes == 8 + 1024 * amountParityBlocks;
+}
+
+std::map<long, std::vector<char>> reconstructBlocksFromParity(std::istream& _file, long _fileBytes, std::istream& _parity, const std::vector<long>& _badBlocks, const ParityBlockCheck& _check)
+{
+	std::map<long, std::vector<char>> ret;
+	if (_badBlocks.empty()) return ret;
+	
+	int minDivisor;
+	int maxDivisor;
+	_parity.clear();
+	_parity.seekg(0, _parity.beg);
+	if (_parity.peek() == REED_SOLOMON_PARITY_MAGIC[0]) return reconstructBlocksFromReedSolomonParity(_file, _fileBytes, _parity, _badBlocks, _check);
+	if (!readParityHeader(_parity, minDivisor, maxDivisor))
+	{
+		if (DEBUGGING) printf("reconstructBlocksFromParity: parity file header is corrupted\r\n");
+		return ret;
+	}
+	int amountDivisors = maxDivisor - minDivisor + 1;
+	long amountBlocks = (_fileBytes + 1023) / 1024;
+	
+	std::vector<bool> isBad(amountBlocks, false);
+	for (long b : _badBlocks) isBad[b] = true;
+	
+	// Only groups that contain a damaged block are needed. groupSlot[i][m] is the slot of group (minDivisor + i, m), or -1.
+	std::vector<std::vector<int>> groupSlot(amountDivisors);
+	std::vector<int> groupBadCount;
+	for (int i=0; i<amountDivisors; i++) groupSlot[i].assign(minDivisor + i, -1);
+	for (long b : _badBlocks)
+	{
+		for (int i=0; i<amountDivisors; i++)
+		{
+			int& slot = groupSlot[i][b % (minDivisor + i)];
+			if (slot == -1)
+			{
+				slot = groupBadCount.size();
+				groupBadCount.push_back(0);
+			}
+			groupBadCount[slot]++;
+		}
+	}
+	
+	std::vector<ParityBlock> groupParity(groupBadCount.size());
+	std::vector<ParityBlock> groupXor(groupBadCount.size());
+	memset(groupXor.data(), 0, groupXor.size() * sizeof(ParityBlock));
+	
+	// Read the parity of those groups, front to back
+	long parityOffset = 8;
+	for (int i=0; i<amountDivisors; i++)
+	{
+		int d = minDivisor + i;
+		for (int m=0; m<d; m++)
+		{
+			int slot = groupSlot[i][m];
+			if (slot == -1) continue;
+			_parity.seekg(parityOffset + m * 1024L, _parity.beg);
+			_parity.read(groupParity[slot].bytes, 1024);
+			if (_parity.gcount() != 1024)
+			{
+				if (DEBUGGING) printf("reconstructBlocksFromParity: parity file is too short\r\n");
+				return ret;
+			}
+		}
+		parityOffset += d * 1024L;
+	}
+	
+	// One pass over the file: XOR every intact block into the groups that have a damaged block
+	ParityXorKernel xorInto = activeXorKernel();
+	std::vector<char> buff(PARITY_READ_BUFFER_BYTES);
+	std::vector<int> mods(amountDivisors, 0);
+	std::vector<char*> dests;
+	dests.reserve(amountDivisors);
+	
+	_file.clear();
+	_file.seekg(0, _file.beg);
+	long blockIndex = 0;
+	for (long totalRead = 0; totalRead < _fileBytes; )
+	{
+		long amountToRead = std::min((long)PARITY_READ_BUFFER_BYTES, _fileBytes - totalRead);
+		_file.read(buff.data(), amountToRead);
+		if (_file.gcount() != amountToRead)
+		{
+			if (DEBUGGING) printf("reconstructBlocksFromParity: file is shorter than expected\r\n");
+			return ret;
+		}
+		
+		for (long offset=0; offset<amountToRead; offset+=1024, blockIndex++)
+		{
+			if (!isBad[blockIndex])
+			{
+				dests.clear();
+				for (int i=0; i<amountDivisors; i++)
+				{
+					int slot = groupSlot[i][mods[i]];
+					if (slot != -1) dests.push_back(groupXor[slot].bytes);
+				}
+				
+				int blockBytes = (int)std::min(1024L, amountToRead - offset);
+				if (blockBytes == 1024) xorInto(&buff[offset], dests.data(), (int)dests.size());
+				else for (char* dest : dests) for (int j=0; j<blockBytes; j++) dest[j] ^= buff[offset + j];
+			}
+			
+			for (int i=0; i<amountDivisors; i++)
+			{
+				if (++mods[i] == minDivisor + i) mods[i] = 0;
+			}
+		}
+		totalRead += amountToRead;
+	}
+	
+	// Peel: rebuild every block that is the only damaged one in one of its groups, largest divisor first.
+	// A rebuilt block is XORed into all of its groups, which may leave another group with a single damaged block.
+	// Repeat until a whole round rebuilds nothing.
+	bool progress = true;
+	while (progress)
+	{
+		progress = false;
+		for (long b : _badBlocks)
+		{
+			if (ret.count(b) != 0) continue;
+			
+			int blockBytes = (int)std::min(1024L, _fileBytes - b * 1024);
+			for (int i=amountDivisors-1; i>=0; i--)
+			{
+				int slot = groupSlot[i][b % (minDivisor + i)];
+				if (groupBadCount[slot] != 1) continue;
+				
+				std::vector<char> candidate(1024);
+				for (int j=0; j<1024; j++) candidate[j] = groupParity[slot].bytes[j] ^ groupXor[slot].bytes[j];
+				
+				// If this fails, the parity of this group is damaged too
+				if (!_check(b, candidate.data(), blockBytes)) continue;
+				
+				if (DEBUGGING) printf("reconstructBlocksFromParity: rebuilt block %li with divisor %i\r\n", b, minDivisor + i);
+				
+				// Bytes past the end of a short last block are zero, just like they were when the parity was made
+				memset(&candidate[blockBytes], 0, 1024 - blockBytes);
+				for (int k=0; k<amountDivisors; k++)
+				{
+					int otherSlot = groupSlot[k][b % (minDivisor + k)];
+					for (int j=0; j<1024; j++) groupXor[otherSlot].bytes[j] ^= candidate[j];
+					groupBadCount[otherSlot]--;
+				}
+				
+				candidate.resize(blockBytes);
+				ret[b] = std::move(candidate);
+				progress = true;
+				break;
+			}
+		}
+	}
+	
+	return ret;
+}
+
+std::vector<long> locateDamagedBlocks(std::istream& _file, long _fileBytes, std::istream& _parity, const std::vector<long>& _suspects, const ParityBlockSetCheck& _check)
+{
+	std::vector<long> ret;
+	if (_suspects.empty()) return ret;
+	
+	int minDivisor;
+	int maxDivisor;
+	_parity.clear();
+	_parity.seekg(0, _parity.beg);
+	if (_parity.peek() == REED_SOLOMON_PARITY_MAGIC[0]) return locateDamagedReedSolomonBlocks(_file, _fileBytes, _parity, _suspects, _check);
+	if (!readParityHeader(_parity, minDivisor, maxDivisor))
+	{
+		if (DEBUGGING) printf("locateDamagedBlocks: parity file header is corrupted\r\n");
+		return ret;
+	}
+	int amountDivisors = maxDivisor - minDivisor + 1;
+	
+	// The parity of the file as it is now
+	ParityAccumulator current(minDivisor, maxDivisor);
+	std::vector<char> buff(PARITY_READ_BUFFER_BYTES);
+	_file.clear();
+	_file.seekg(0, _file.beg);
+	for (long totalRead = 0; totalRead < _fileBytes; )
+	{
+		long amountToRead = std::min((long)PARITY_READ_BUFFER_BYTES, _fileBytes - totalRead);
+		_file.read(buff.data(), amountToRead);
+		if (_file.gcount() != amountToRead)
+		{
+			if (DEBUGGING) printf("locateDamagedBlocks: file is shorter than expected\r\n");
+			return ret;
+		}
+		current.addBlocks(buff.data(), amountToRead);
+		totalRead += amountToRead;
+	}
+	std::ostringstream currentOss;
+	current.serialize(currentOss);
+	std::string currentParity = currentOss.str();
+	
+	std::string storedParity(currentParity.size(), 0);
+	_parity.clear();
+	_parity.seekg(0, _parity.beg);
+	_parity.read(&storedParity[0], storedParity.size());
+	if (_parity.gcount() != (long)storedParity.size())
+	{
+		if (DEBUGGING) printf("locateDamagedBlocks: parity file is too short\r\n");
+		return ret;
+	}
+	
+	// A group whose parity is unchanged has no damaged block
+	std::vector<std::vector<bool>> groupChanged(amountDivisors);
+	long parityOffset = 8;
+	for (int i=0; i<amountDivisors; i++)
+	{
+		int d = minDivisor + i;
+		for (int m=0; m<d; m++)
+		{
+			groupChanged[i].push_back(memcmp(&currentParity[parityOffset + m * 1024L], &storedParity[parityOffset + m * 1024L], 1024) != 0);
+		}
+		parityOffset += d * 1024L;
+	}
+	
+	for (long b : _suspects)
+	{
+		bool inChangedGroups = true;
+		for (int i=0; i<amountDivisors && inChangedGroups; i++) inChangedGroups = groupChanged[i][b % (minDivisor + i)];
+		if (inChangedGroups) ret.push_back(b);
+	}
+	if (DEBUGGING) printf("locateDamagedBlocks: %lu of %lu suspect blocks are damaged\r\n", ret.size(), _suspects.size());
+	return ret;
+}
+
+std::map<long, std::vector<char>> reconstructLeavesFromParity(std::istream& _file, long _fileBytes, std::istream& _parity, const std::vector<long>& _badLeaves, const std::vector<std::array<char, 32>>& _leafHashes, int _leafSize, HashAlgorithm _hashAlgorithm)
+{
+	auto leafHashMatches = [&](long _leafIndex, const char* _data, int _amountBytes){
+		return hashLeaf(_hashAlgorithm, _data, _amountBytes, _leafSize, _leafIndex) == _leafHashes[_leafIndex];
+	};
+	
+	// Leaves are parity blocks, so every rebuilt block is checked on its own
+	if (_leafSize == 1024) return reconstructBlocksFromParity(_file, _fileBytes, _parity, _badLeaves, leafHashMatches);
+	
+	std::map<long, std::vector<char>> ret;
+	long blocksPerLeaf = _leafSize / 1024;
+	long amountBlocks = (_fileBytes + 1023) / 1024;
+	std::vector<long> suspects;
+	for (long leaf : _badLeaves)
+	{
+		for (long b = leaf * blocksPerLeaf; b < std::min((leaf + 1) * blocksPerLeaf, amountBlocks); b++) suspects.push_back(b);
+	}
+	
+	// Leaf _leaf as it is in the file, with the blocks of _rebuiltBlocks put in. Empty if the file is too short.
+	auto readLeaf = [&](long _leaf, const std::map<long, std::vector<char>>& _rebuiltBlocks){
+		long leafStart = _leaf * _leafSize;
+		int leafBytes = (int)std::min((long)_leafSize, _fileBytes - leafStart);
+		std::vector<char> data(leafBytes);
+		_file.clear();
+		_file.seekg(leafStart, _file.beg);
+		_file.read(data.data(), leafBytes);
+		if (_file.gcount() != leafBytes) return std::vector<char>();
+		
+		for (long b = _leaf * blocksPerLeaf; b < std::min((_leaf + 1) * blocksPerLeaf, amountBlocks); b++)
+		{
+			auto it = _rebuiltBlocks.find(b);
+			if (it != _rebuiltBlocks.end()) memcpy(&data[b * 1024 - leafStart], it->second.data(), it->second.size());
+		}
+		return data;
+	};
+	
+	// A single block can't be checked, only the leaf it is part of
+	auto leavesMatch = [&](const std::map<long, std::vector<char>>& _blocks){
+		long lastLeaf = -1;
+		for (const auto& [b, _] : _blocks)
+		{
+			long leaf = b / blocksPerLeaf;
+			if (leaf == lastLeaf) continue;
+			lastLeaf = leaf;
+			std::vector<char> data = readLeaf(leaf, _blocks);
+			if (data.empty() || !leafHashMatches(leaf, data.data(), data.size())) return false;
+		}
+		return true;
+	};
+	
+	auto rebuildLeaves = [&](const std::vector<long>& _badBlocks){
+		std::map<long, std::vector<char>> rebuiltBlocks = reconstructBlocksFromParity(_file, _fileBytes, _parity, _badBlocks, [](long, const char*, int){ return true; });
+		for (long leaf : _badLeaves)
+		{
+			if (ret.count(leaf) != 0) continue;
+			std::vector<char> data = readLeaf(leaf, rebuiltBlocks);
+			if (!data.empty() && leafHashMatches(leaf, data.data(), data.size()))
+			{
+				if (DEBUGGING) printf("reconstructLeavesFromParity: rebuilt leaf %li\r\n", leaf);
+				ret[leaf] = std::move(data);
+			}
+		}
+	};
+	
+	std::vector<long> badBlocks = locateDamagedBlocks(_file, _fileBytes, _parity, suspects, leavesMatch);
+	if (!badBlocks.empty()) rebuildLeaves(badBlocks);
+	
+	// Locating can miss damaged blocks, for example when their damage cancels out in a group. Rebuilding intact
+	// blocks as well only gives them back as they are, so the leaf hashes still reject anything that is wrong.
+	if (ret.size() < _badLeaves.size() && badBlocks.size() < suspects.size())
+	{
+		if (DEBUGGING) printf("reconstructLeavesFromParity: trying again with all %lu blocks of the damaged leaves\r\n", suspects.size());
+		rebuildLeaves(suspects);
+	}
+	return ret;
+}
+
+bool parity_selfTest()
+{
+	const int leafSize = 4096;
+	const long amountBlocks = 40;
+	const long fileBytes = amountBlocks * 1024 - 100;
+	std::string original(fileBytes, 0);
+	uint32_t x = 1;
+	for (long i=0; i<fileBytes; i++)
+	{
+		x = x * 1103515245 + 12345;
+		original[i] = (char)(x >> 16);
+	}
+	
+	long amountLeaves = (fileBytes + leafSize - 1) / leafSize;
+	std::vector<std::array<char, 32>> leafHashes;
+	for (long leaf=0; leaf<amountLeaves; leaf++)
+	{
+		long leafBytes = std::min((long)leafSize, fileBytes - leaf * leafSize);
+		leafHashes.push_back(hashLeaf(HASH_SHA256, &original[leaf * leafSize], leafBytes, leafSize, leaf));
+	}
+	
+	auto [minDivisor, maxDivisor] = parityDivisorsFor(fileBytes, std::nullopt, PARITY_DEFAULT_MAX_DIVISOR);
+	ParityAccumulator xorParity(minDivisor, maxDivisor);
+	ReedSolomonParityAccumulator reedSolomonParity(fileBytes, REED_SOLOMON_DEFAULT_DATA_BLOCKS, REED_SOLOMON_DEFAULT_PARITY_BLOCKS);
+	
+	// Blocks 9 to 12 are in leaves 2 and 3. Blocks 9 and 11 get the same damage, which cancels out in the XOR group
+	// they share.
+	const std::vector<std::vector<long>> damages = { {9, 10, 11, 12}, {9, 11}, {5, 14} };
+	
+	for (ParityEncoder* encoder : std::vector<ParityEncoder*>{ &xorParity, &reedSolomonParity })
+	{
+		encoder->addBlocks(original.data(), fileBytes);
+		std::ostringstream parityOss;
+		encoder->serialize(parityOss);
+		
+		for (const std::vector<long>& damage : damages)
+		{
+			std::string damaged = original;
+			std::vector<long> badLeaves;
+			for (long b : damage)
+			{
+				for (int i=0; i<1024; i++) damaged[b * 1024 + i] ^= (char)(i * 7 + 1);
+				long leaf = b * 1024 / leafSize;
+				if (std::find(badLeaves.begin(), badLeaves.end(), leaf) == badLeaves.end()) badLeaves.push_back(leaf);
+			}
+			
+			std::istringstream file(damaged);
+			std::istringstream parity(parityOss.str());
+			std::map<long, std::vector<char>> rebuilt = reconstructLeavesFromParity(file, fileBytes, parity, badLeaves, leafHashes, leafSize, HASH_SHA256);
+			
+			for (long leaf : badLeaves)
+			{
+				auto it = rebuilt.find(leaf);
+				if (it == rebuilt.end() || std::string(it->second.begin(), it->second.end()) != original.substr(leaf * leafSize, leafSize)) return false;
+			}
+		}
+	}
+	return true;
+}
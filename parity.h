@@ -0,0 +1,102 @@
+#pragma once
+
+#include <ostream>
+#include <istream>
+#include <vector>
+#include <array>
+#include <map>
+#include <optional>
+#include <utility>
+#include <functional>
+
+#include "hash_algorithm.h"
+
+// XOR parity over 1024-byte blocks: for every divisor d in [minDivisor, maxDivisor]
+// and every m in [0, d), parity block (d, m) is the XOR of all blocks with index % d == m.
+// Parity blocks are 1024 bytes whatever the leaf size of the file's merkel tree is.
+
+// Every block is XORed into one parity block per divisor, so the cost of making parity grows with the largest divisor
+#define PARITY_DIVISOR_LIMIT 64
+#define PARITY_DEFAULT_MAX_DIVISOR 11
+
+// One parity block. Aligned so the XOR kernels can use aligned 512-bit loads and stores on it.
+struct alignas(64) ParityBlock
+{
+	char bytes[1024];
+};
+
+// Makes the .fmparity of a file while the file is streamed through it
+class ParityEncoder
+{
+public:
+	virtual ~ParityEncoder() {}
+	virtual long getAmountOfBlocks() const = 0;
+	
+	// Adds consecutive 1024-byte blocks; only the last one may be shorter
+	virtual void addBlocks(const char* _data, long _amountBytes) = 0;
+	virtual void serialize(std::ostream& _dest) const = 0;
+};
+
+class ParityAccumulator : public ParityEncoder
+{
+private:
+	int minDivisor;
+	int maxDivisor;
+	long blockIndex;
+	
+	// All parity blocks in one buffer, in the order they are serialized: divisor by divisor, then by modulo
+	std::vector<ParityBlock> parityBlocks;
+	std::vector<long> divisorOffsets;
+	
+	// Destinations of the next block, one per divisor, advanced in step with blockIndex
+	std::vector<char*> nextDests;
+	std::vector<int> nextMods;
+	
+	void advance();
+public:
+	ParityAccumulator(int _minDivisor, int _maxDivisor);
+	long getAmountOfBlocks() const override;
+	void addBlock(const char* _data, int _amountBytes);
+	void addBlocks(const char* _data, long _amountBytes) override;
+	void serialize(std::ostream& _dest) const override;
+};
+
+// Divisors to use for a file of _fileBytes bytes. The parity of divisors 2..maxDivisor takes at most _overheadPercent
+// of the file size if that is given, and maxDivisor is never more than _maxDivisor. Divisors larger than the amount of
+// blocks add no protection, because every block is alone in its group already, so small files get small parity.
+std::pair<int, int> parityDivisorsFor(long _fileBytes, std::optional<double> _overheadPercent, int _maxDivisor);
+
+// Decides whether a block rebuilt from parity is right, given its index, bytes and size
+typedef std::function<bool(long _blockIndex, const char* _data, int _amountBytes)> ParityBlockCheck;
+
+// Decides whether blocks rebuilt from parity are right, given them by block index, for blocks that can only be checked
+// together, such as the blocks of one leaf
+typedef std::function<bool(const std::map<long, std::vector<char>>& _blocks)> ParityBlockSetCheck;
+
+// Rebuilds the damaged blocks _badBlocks of a file of _fileBytes bytes from its .fmparity. A damaged block is the XOR
+// of the parity of one of its groups and all other blocks in that group, so it can be rebuilt from any group in which
+// it is the only damaged block. Every rebuilt block is added back to its groups, which can leave other groups with only
+// one damaged block, so clustered damage is peeled off block by block.
+// The groups are built in one sequential pass over _file, and every rebuilt block must pass _check.
+// Returns the rebuilt blocks by block index. Blocks that could not be rebuilt are left out.
+// Reed-Solomon .fmparity files are handed to reconstructBlocksFromReedSolomonParity.
+std::map<long, std::vector<char>> reconstructBlocksFromParity(std::istream& _file, long _fileBytes, std::istream& _parity, const std::vector<long>& _badBlocks, const ParityBlockCheck& _check);
+
+// The blocks of _suspects that the parity says are damaged. The parity of the file as it is now is made again and
+// compared with the .fmparity: a block is damaged if every group it is in has a different parity now. Damage in two
+// blocks of one group can cancel out in its parity, so this can miss damaged blocks.
+// Reed-Solomon .fmparity files are handed to locateDamagedReedSolomonBlocks, which uses _check where the parity alone
+// can't tell which blocks are damaged.
+std::vector<long> locateDamagedBlocks(std::istream& _file, long _fileBytes, std::istream& _parity, const std::vector<long>& _suspects, const ParityBlockSetCheck& _check);
+
+// Rebuilds the damaged leaves _badLeaves of _leafSize bytes, checking every rebuilt leaf against _leafHashes, which
+// were hashed with _hashAlgorithm.
+// A leaf larger than a parity block is damaged in only some of its blocks, which locateDamagedBlocks finds first,
+// because marking all of them as damaged would leave more damaged blocks in their groups than the parity can rebuild.
+// Leaves that are still damaged after that are tried once more with all their blocks marked as damaged.
+// Returns the rebuilt leaves by leaf index.
+std::map<long, std::vector<char>> reconstructLeavesFromParity(std::istream& _file, long _fileBytes, std::istream& _parity, const std::vector<long>& _badLeaves, const std::vector<std::array<char, 32>>& _leafHashes, int _leafSize, HashAlgorithm _hashAlgorithm);
+
+// Damages a few blocks of two neighbouring leaves of a generated file and checks that XOR and Reed-Solomon parity
+// repair them, with leaves of several parity blocks
+bool parity_selfTest();
@@ -0,0 +1,128 @@
+#include <string>
+#include <filesystem>
+#include <cerrno>
+#include <cstring>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#include "util.h"
+#include "placement.h"
+
+PlacementStrategy parsePlacementStrategy(const std::string& _name)
+{
+	if (_name == "copy") return PS_COPY;
+	else if (_name == "copy_file_range") return PS_COPY_FILE_RANGE;
+	else if (_name == "reflink") return PS_REFLINK;
+	else if (_name == "hardlink") return PS_HARDLINK;
+	else exitWithError("Unknown placement strategy '" + _name + "', expected copy, copy_file_range, reflink or hardlink");
+	return PS_COPY;
+}
+
+const char* placementStrategyName(PlacementStrategy _strategy)
+{
+	if (_strategy == PS_COPY) return "copy";
+	else if (_strategy == PS_COPY_FILE_RANGE) return "copy_file_range";
+	else if (_strategy == PS_REFLINK) return "reflink";
+	else if (_strategy == PS_HARDLINK) return "hardlink";
+	else return "unknown";
+}
+
+// Errors that mean "this filesystem (pair) can't do that", as opposed to real I/O errors
+static bool isUnsupportedError(int _errno)
+{
+	return _errno == EXDEV || _errno == EOPNOTSUPP || _errno == ENOTSUP || _errno == ENOTTY || _errno == ENOSYS || _errno == EINVAL || _errno == EPERM || _errno == EMLINK;
+}
+
+static bool tryHardlink(const std::string& _source, const std::string& _dest)
+{
+	if (link(_source.c_str(), _dest.c_str()) == 0) return true;
+	if (isUnsupportedError(errno)) return false;
+	exitWithError("Failed to hardlink " + _source + " to " + _dest + ": " + strerror(errno));
+	return false;
+}
+
+// Opens _source and creates _dest, then runs _copy on the two descriptors.
+// If _copy reports the operation is unsupported, _dest is removed again and false is returned.
+template <typename F>
+static bool tryDescriptorCopy(const std::string& _source, const std::string& _dest, const char* _what, F _copy)
+{
+	int sourceFd = open(_source.c_str(), O_RDONLY);
+	if (sourceFd == -1) exitWithError("Failed to open file " + _source + ": " + strerror(errno));
+	int destFd = open(_dest.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (destFd == -1)
+	{
+		close(sourceFd);
+		exitWithError("Failed to create file " + _dest + ": " + strerror(errno));
+	}
+	
+	int err = _copy(sourceFd, destFd);
+	
+	close(sourceFd);
+	if (close(destFd) != 0 && err == 0) err = errno;
+	
+	if (err == 0) return true;
+	
+	unlink(_dest.c_str());
+	if (err == -1) return false;
+	exitWithError(std::string("Failed to ") + _what + " " + _source + " to " + _dest + ": " + strerror(err));
+	return false;
+}
+
+static bool tryReflink(const std::string& _source, const std::string& _dest)
+{
+	return tryDescriptorCopy(_source, _dest, "reflink", [](int _sourceFd, int _destFd){
+#ifdef FICLONE
+		if (ioctl(_destFd, FICLONE, _sourceFd) == 0) return 0;
+		return isUnsupportedError(errno) ? -1 : errno;
+#else
+		(void)_sourceFd; (void)_destFd;
+		return -1;
+#endif
+	});
+}
+
+static bool tryCopyFileRange(const std::string& _source, const std::string& _dest)
+{
+	return tryDescriptorCopy(_source, _dest, "copy_file_range", [](int _sourceFd, int _destFd){
+		bool copiedAnything = false;
+		while (true)
+		{
+			ssize_t copied = copy_file_range(_sourceFd, nullptr, _destFd, nullptr, 1L << 30, 0);
+			if (copied == 0) return 0;
+			if (copied < 0)
+			{
+				if (errno == EINTR) continue;
+				// Only fall back if nothing was copied yet, otherwise it's a real error
+				return (!copiedAnything && isUnsupportedError(errno)) ? -1 : errno;
+			}
+			copiedAnything = true;
+		}
+	});
+}
+
+PlacementStrategy placeFile(const std::string& _source, const std::string& _dest, PlacementStrategy _strategy)
+{
+	if (_strategy == PS_HARDLINK)
+	{
+		if (tryHardlink(_source, _dest)) return PS_HARDLINK;
+		_strategy = PS_REFLINK;
+	}
+	if (_strategy == PS_REFLINK)
+	{
+		if (tryReflink(_source, _dest)) return PS_REFLINK;
+		_strategy = PS_COPY_FILE_RANGE;
+	}
+	if (_strategy == PS_COPY_FILE_RANGE)
+	{
+		if (tryCopyFileRange(_source, _dest)) return PS_COPY_FILE_RANGE;
+	}
+	
+	std::error_code ec;
+	std::filesystem::copy_file(_source, _dest, ec);
+	if (ec) exitWithError("Failed to copy " + _source + " to " + _dest + ": " + ec.message());
+	return PS_COPY;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+
+// How Repository::add puts a file's bytes into the repository, set with placement= in fmrepo.conf.
+// PS_COPY streams the bytes through filemass while they are hashed. The others create the copy after
+// hashing, without passing the data through userspace, and fall back to the next strategy in this list
+// when the filesystem does not support them:
+//   hardlink         - the repo file is the source file; changing the source later corrupts the repo file
+//   reflink          - copy-on-write clone (FICLONE), e.g. on btrfs and XFS
+//   copy_file_range  - in-kernel copy
+//   copy             - plain copy
+
+enum PlacementStrategy
+{
+	PS_COPY,
+	PS_COPY_FILE_RANGE,
+	PS_REFLINK,
+	PS_HARDLINK
+};
+
+// Exits with an error if _name is not a known strategy
+PlacementStrategy parsePlacementStrategy(const std::string& _name);
+const char* placementStrategyName(PlacementStrategy _strategy);
+
+// Creates the new file _dest with the contents of _source. Returns the strategy that was actually used.
+PlacementStrategy placeFile(const std::string& _source, const std::string& _dest, PlacementStrategy _strategy);
@@ -0,0 +1,579 @@
+#include <ostream>
+#include <istream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <array>
+#include <map>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <functional>
+
+#include "util.h"
+#include "sha256.h"
+#include "reed_solomon.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define REED_SOLOMON_X86 1
+#include <immintrin.h>
+#endif
+
+////////////////////////////////////////////
+//// GF(2^8) arithmetic, with the polynomial x^8 + x^4 + x^3 + x^2 + 1
+
+struct GaloisTables
+{
+	uint8_t exp[512];
+	uint8_t log[256];
+	
+	// Products of every constant with every low nibble and every high nibble, for the table lookup kernels
+	alignas(16) uint8_t mulLow[256][16];
+	alignas(16) uint8_t mulHigh[256][16];
+	
+	GaloisTables()
+	{
+		int x = 1;
+		for (int i=0; i<255; i++)
+		{
+			exp[i] = x;
+			log[x] = i;
+			x <<= 1;
+			if (x & 0x100) x ^= 0x11d;
+		}
+		for (int i=255; i<512; i++) exp[i] = exp[i - 255];
+		log[0] = 0;
+		
+		for (int c=0; c<256; c++)
+		{
+			for (int n=0; n<16; n++)
+			{
+				mulLow[c][n] = mul(c, n);
+				mulHigh[c][n] = mul(c, n << 4);
+			}
+		}
+	}
+	
+	uint8_t mul(uint8_t _a, uint8_t _b) const
+	{
+		if (_a == 0 || _b == 0) return 0;
+		return exp[log[_a] + log[_b]];
+	}
+	
+	uint8_t inv(uint8_t _a) const
+	{
+		return exp[255 - log[_a]];
+	}
+};
+
+static const GaloisTables& gf()
+{
+	static const GaloisTables tables;
+	return tables;
+}
+
+// Adds _c * _src to _dest, over 1024 bytes
+typedef void (*GaloisMulAddKernel)(char* _dest, const char* _src, uint8_t _c);
+
+static void mulAdd_scalar(char* _dest, const char* _src, uint8_t _c)
+{
+	const uint8_t* low = gf().mulLow[_c];
+	const uint8_t* high = gf().mulHigh[_c];
+	for (int i=0; i<1024; i++)
+	{
+		uint8_t s = _src[i];
+		_dest[i] ^= low[s & 0x0f] ^ high[s >> 4];
+	}
+}
+
+#ifdef REED_SOLOMON_X86
+
+// c * s = c * (low nibble of s) ^ c * (high nibble of s), and both are a 16-entry table lookup done by PSHUFB
+__attribute__((target("avx2")))
+static void mulAdd_avx2(char* _dest, const char* _src, uint8_t _c)
+{
+	__m256i low = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)gf().mulLow[_c]));
+	__m256i high = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)gf().mulHigh[_c]));
+	__m256i mask = _mm256_set1_epi8(0x0f);
+	for (int i=0; i<1024; i+=32)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i*)(_src + i));
+		__m256i productLow = _mm256_shuffle_epi8(low, _mm256_and_si256(s, mask));
+		__m256i productHigh = _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi16(s, 4), mask));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(_dest + i));
+		_mm256_storeu_si256((__m256i*)(_dest + i), _mm256_xor_si256(d, _mm256_xor_si256(productLow, productHigh)));
+	}
+}
+
+// GCC 12 warns about the deliberately undefined source operands inside its own AVX-512 intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f,avx512bw")))
+static void mulAdd_avx512(char* _dest, const char* _src, uint8_t _c)
+{
+	__m512i low = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i*)gf().mulLow[_c]));
+	__m512i high = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i*)gf().mulHigh[_c]));
+	__m512i mask = _mm512_set1_epi8(0x0f);
+	for (int i=0; i<1024; i+=64)
+	{
+		__m512i s = _mm512_loadu_si512((const void*)(_src + i));
+		__m512i productLow = _mm512_shuffle_epi8(low, _mm512_and_si512(s, mask));
+		__m512i productHigh = _mm512_shuffle_epi8(high, _mm512_and_si512(_mm512_srli_epi16(s, 4), mask));
+		__m512i d = _mm512_loadu_si512((const void*)(_dest + i));
+		_mm512_storeu_si512((void*)(_dest + i), _mm512_xor_si512(d, _mm512_xor_si512(productLow, productHigh)));
+	}
+}
+
+#pragma GCC diagnostic pop
+
+#endif // REED_SOLOMON_X86
+
+static GaloisMulAddKernel selectMulAddKernel()
+{
+#ifdef REED_SOLOMON_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw")) return mulAdd_avx512;
+	if (__builtin_cpu_supports("avx2")) return mulAdd_avx2;
+#endif
+	return mulAdd_scalar;
+}
+
+static GaloisMulAddKernel activeMulAddKernel()
+{
+	static const GaloisMulAddKernel kernel = selectMulAddKernel();
+	return kernel;
+}
+
+// C[j][i] = 1 / (x_j + y_i) with x_j = dataBlocks + j and y_i = i, row by row
+static std::vector<uint8_t> cauchyMatrix(int _dataBlocks, int _parityBlocks)
+{
+	std::vector<uint8_t> ret(_parityBlocks * _dataBlocks);
+	for (int j=0; j<_parityBlocks; j++)
+	{
+		for (int i=0; i<_dataBlocks; i++)
+		{
+			ret[j * _dataBlocks + i] = gf().inv((uint8_t)((_dataBlocks + j) ^ i));
+		}
+	}
+	return ret;
+}
+
+// Inverts the _n by _n matrix _m in place. Returns false if it is singular.
+static bool invertMatrix(std::vector<uint8_t>& _m, int _n)
+{
+	std::vector<uint8_t> inverse(_n * _n, 0);
+	for (int i=0; i<_n; i++) inverse[i * _n + i] = 1;
+	
+	for (int col=0; col<_n; col++)
+	{
+		int pivot = col;
+		while (pivot < _n && _m[pivot * _n + col] == 0) pivot++;
+		if (pivot == _n) return false;
+		for (int k=0; k<_n; k++)
+		{
+			std::swap(_m[col * _n + k], _m[pivot * _n + k]);
+			std::swap(inverse[col * _n + k], inverse[pivot * _n + k]);
+		}
+		
+		uint8_t scale = gf().inv(_m[col * _n + col]);
+		for (int k=0; k<_n; k++)
+		{
+			_m[col * _n + k] = gf().mul(_m[col * _n + k], scale);
+			inverse[col * _n + k] = gf().mul(inverse[col * _n + k], scale);
+		}
+		
+		for (int row=0; row<_n; row++)
+		{
+			uint8_t factor = _m[row * _n + col];
+			if (row == col || factor == 0) continue;
+			for (int k=0; k<_n; k++)
+			{
+				_m[row * _n + k] ^= gf().mul(factor, _m[col * _n + k]);
+				inverse[row * _n + k] ^= gf().mul(factor, inverse[col * _n + k]);
+			}
+		}
+	}
+	
+	_m = inverse;
+	return true;
+}
+
+void checkReedSolomonParameters(int _dataBlocks, int _parityBlocks)
+{
+	// The Cauchy matrix needs dataBlocks + parityBlocks distinct field elements
+	if (_dataBlocks < 1 || _parityBlocks < 1 || _dataBlocks + _parityBlocks > 256)
+	{
+		exitWithError("Reed-Solomon parity needs at least 1 data block and 1 parity block per stripe, and at most 256 blocks in total");
+	}
+}
+
+ReedSolomonParityAccumulator::ReedSolomonParityAccumulator(long _fileBytes, int _dataBlocks, int _parityBlocks):
+	dataBlocks(_dataBlocks),
+	parityBlocks(_parityBlocks),
+	totalBytes(0),
+	blockIndex(0)
+{
+	checkReedSolomonParameters(_dataBlocks, _parityBlocks);
+	
+	long amountBlocks = (_fileBytes + 1023) / 1024;
+	if (amountBlocks < this->dataBlocks) this->dataBlocks = std::max(1L, amountBlocks);
+	
+	long amountStripes = (amountBlocks + this->dataBlocks - 1) / this->dataBlocks;
+	this->stripeParity.resize(amountStripes * this->parityBlocks);
+	memset(this->stripeParity.data(), 0, this->stripeParity.size() * sizeof(ParityBlock));
+	this->coefficients = cauchyMatrix(this->dataBlocks, this->parityBlocks);
+}
+
+long ReedSolomonParityAccumulator::getAmountOfBlocks() const
+{
+	return this->blockIndex;
+}
+
+void ReedSolomonParityAccumulator::addBlock(const char* _data)
+{
+	long stripe = this->blockIndex / this->dataBlocks;
+	int i = this->blockIndex % this->dataBlocks;
+	if (stripe * this->parityBlocks >= (long)this->stripeParity.size()) exitWithError("ReedSolomonParityAccumulator received more blocks than the file has");
+	
+	GaloisMulAddKernel mulAdd = activeMulAddKernel();
+	for (int j=0; j<this->parityBlocks; j++)
+	{
+		mulAdd(this->stripeParity[stripe * this->parityBlocks + j].bytes, _data, this->coefficients[j * this->dataBlocks + i]);
+	}
+	this->blockIndex++;
+}
+
+void ReedSolomonParityAccumulator::addBlocks(const char* _data, long _amountBytes)
+{
+	long offset = 0;
+	for (; offset + 1024 <= _amountBytes; offset += 1024) this->addBlock(&_data[offset]);
+	
+	// A short last block is encoded as if it were padded with zeroes
+	if (offset < _amountBytes)
+	{
+		char lastBlock[1024] = {};
+		memcpy(lastBlock, &_data[offset], _amountBytes - offset);
+		this->addBlock(lastBlock);
+	}
+	this->totalBytes += _amountBytes;
+}
+
+void ReedSolomonParityAccumulator::serialize(std::ostream& _dest) const
+{
+	ReedSolomonParityHeader header;
+	memcpy(header.magic, REED_SOLOMON_PARITY_MAGIC, 8);
+	header.dataBlocks = this->dataBlocks;
+	header.parityBlocks = this->parityBlocks;
+	header.totalBytes = this->totalBytes;
+	header.reserved = 0;
+	
+	_dest.write((const char*)&header, sizeof(header));
+	if (!this->stripeParity.empty()) _dest.write(this->stripeParity[0].bytes, this->stripeParity.size() * sizeof(ParityBlock));
+}
+
+std::map<long, std::vector<char>> reconstructBlocksFromReedSolomonParity(std::istream& _file, long _fileBytes, std::istream& _parity, const std::vector<long>& _badBlocks, const ParityBlockCheck& _check)
+{
+	std::map<long, std::vector<char>> ret;
+	if (_badBlocks.empty()) return ret;
+	
+	ReedSolomonParityHeader header;
+	_parity.clear();
+	_parity.seekg(0, _parity.beg);
+	_parity.read((char*)&header, sizeof(header));
+	if (_parity.gcount() != sizeof(header) ||
+		memcmp(header.magic, REED_SOLOMON_PARITY_MAGIC, 8) != 0 ||
+		header.dataBlocks < 1 || header.parityBlocks < 1 || header.dataBlocks + header.parityBlocks > 256 ||
+		header.totalBytes != _fileBytes)
+	{
+		if (DEBUGGING) printf("reconstructBlocksFromReedSolomonParity: parity file header is corrupted\r\n");
+		return ret;
+	}
+	int k = header.dataBlocks;
+	int m = header.parityBlocks;
+	std::vector<uint8_t> coefficients = cauchyMatrix(k, m);
+	GaloisMulAddKernel mulAdd = activeMulAddKernel();
+	
+	std::map<long, std::vector<long>> stripeToBadBlocks;
+	for (long b : _badBlocks) stripeToBadBlocks[b / k].push_back(b);
+	
+	std::vector<ParityBlock> data(k);
+	std::vector<ParityBlock> parity(m);
+	
+	_file.clear();
+	for (const auto& [stripe, badBlocks] : stripeToBadBlocks)
+	{
+		int e = badBlocks.size();
+		if (e > m)
+		{
+			if (DEBUGGING) printf("reconstructBlocksFromReedSolomonParity: stripe %li has %i damaged blocks, more than its %i parity blocks\r\n", stripe, e, m);
+			continue;
+		}
+		
+		// Read the stripe and its parity. Blocks past the end of the file are zero, like when the parity was made.
+		long stripeStart = stripe * k * 1024L;
+		long stripeBytes = std::min((long)k * 1024, _fileBytes - stripeStart);
+		memset(data.data(), 0, data.size() * sizeof(ParityBlock));
+		_file.seekg(stripeStart, _file.beg);
+		_file.read(data[0].bytes, stripeBytes);
+		if (_file.gcount() != stripeBytes)
+		{
+			if (DEBUGGING) printf("reconstructBlocksFromReedSolomonParity: file is shorter than expected\r\n");
+			return ret;
+		}
+		_parity.seekg(sizeof(header) + stripe * m * 1024L, _parity.beg);
+		_parity.read(parity[0].bytes, m * 1024L);
+		if (_parity.gcount() != m * 1024L)
+		{
+			if (DEBUGGING) printf("reconstructBlocksFromReedSolomonParity: parity file is too short\r\n");
+			return ret;
+		}
+		
+		std::vector<bool> isBad(k, false);
+		for (long b : badBlocks) isBad[b - stripe * k] = true;
+		
+		// e damaged blocks need e parity rows. If a parity block is damaged too, the rebuilt blocks fail their hash check,
+		// so every window of e consecutive rows is tried.
+		for (int firstRow=0; firstRow+e<=m; firstRow++)
+		{
+			// Syndromes: the parity rows minus the contribution of the intact blocks, which leaves C[rows][bad] * bad blocks
+			std::vector<ParityBlock> syndromes(parity.begin() + firstRow, parity.begin() + firstRow + e);
+			for (int r=0; r<e; r++)
+			{
+				for (int i=0; i<k; i++)
+				{
+					if (!isBad[i]) mulAdd(syndromes[r].bytes, data[i].bytes, coefficients[(firstRow + r) * k + i]);
+				}
+			}
+			
+			std::vector<uint8_t> matrix(e * e);
+			for (int r=0; r<e; r++)
+			{
+				for (int c=0; c<e; c++) matrix[r * e + c] = coefficients[(firstRow + r) * k + (badBlocks[c] - stripe * k)];
+			}
+			if (!invertMatrix(matrix, e)) exitWithError("Fatal bug in reconstructBlocksFromReedSolomonParity: Cauchy submatrix is singular");
+			
+			bool allFixed = true;
+			for (int c=0; c<e; c++)
+			{
+				long b = badBlocks[c];
+				if (ret.count(b) != 0) continue;
+				
+				ParityBlock rebuilt;
+				memset(rebuilt.bytes, 0, 1024);
+				for (int r=0; r<e; r++) mulAdd(rebuilt.bytes, syndromes[r].bytes, matrix[c * e + r]);
+				
+				int blockBytes = (int)std::min(1024L, _fileBytes - b * 1024);
+				if (_check(b, rebuilt.bytes, blockBytes))
+				{
+					if (DEBUGGING) printf("reconstructBlocksFromReedSolomonParity: rebuilt block %li\r\n", b);
+					ret[b] = std::vector<char>(rebuilt.bytes, rebuilt.bytes + blockBytes);
+				}
+				else
+				{
+					allFixed = false;
+				}
+			}
+			if (allFixed) break;
+		}
+	}
+	
+	return ret;
+}
+
+// Calls _visit with every set of _size of the numbers [0, _amount), smallest first, until it returns true.
+// Returns whether it did.
+static bool forEachSubset(int _amount, int _size, const std::function<bool(const std::vector<int>&)>& _visit)
+{
+	if (_size > _amount) return false;
+	std::vector<int> subset(_size);
+	for (int i=0; i<_size; i++) subset[i] = i;
+	while (true)
+	{
+		if (_visit(subset)) return true;
+		
+		int i = _size - 1;
+		while (i >= 0 && subset[i] == _amount - _size + i) i--;
+		if (i < 0) return false;
+		subset[i]++;
+		for (int j=i+1; j<_size; j++) subset[j] = subset[j - 1] + 1;
+	}
+}
+
+// Inverse of the square submatrix of the first _positions.size() parity rows and the data blocks _positions of a stripe
+static std::vector<uint8_t> invertedSubmatrix(const std::vector<uint8_t>& _coefficients, int _k, const std::vector<int>& _positions)
+{
+	int t = _positions.size();
+	std::vector<uint8_t> matrix(t * t);
+	for (int r=0; r<t; r++)
+	{
+		for (int c=0; c<t; c++) matrix[r * t + c] = _coefficients[r * _k + _positions[c]];
+	}
+	if (!invertMatrix(matrix, t)) exitWithError("Fatal bug in locateDamagedReedSolomonBlocks: Cauchy submatrix is singular");
+	return matrix;
+}
+
+// Whether damage in exactly the data blocks _positions of a stripe explains its _syndromes: solving for that damage
+// with the first _positions.size() rows must give the difference in every other row too.
+static bool positionsExplainSyndromes(const std::vector<ParityBlock>& _syndromes, const std::vector<uint8_t>& _coefficients, int _k, const std::vector<int>& _positions)
+{
+	int t = _positions.size();
+	int m = _syndromes.size();
+	std::vector<uint8_t> inverse = invertedSubmatrix(_coefficients, _k, _positions);
+	std::vector<uint8_t> errors(t);
+	for (int x=0; x<1024; x++)
+	{
+		for (int c=0; c<t; c++)
+		{
+			errors[c] = 0;
+			for (int r=0; r<t; r++) errors[c] ^= gf().mul(inverse[c * t + r], (uint8_t)_syndromes[r].bytes[x]);
+		}
+		for (int j=t; j<m; j++)
+		{
+			uint8_t predicted = 0;
+			for (int c=0; c<t; c++) predicted ^= gf().mul(_coefficients[j * _k + _positions[c]], errors[c]);
+			if (predicted != (uint8_t)_syndromes[j].bytes[x]) return false;
+		}
+	}
+	return true;
+}
+
+std::vector<long> locateDamagedReedSolomonBlocks(std::istream& _file, long _fileBytes, std::istream& _parity, const std::vector<long>& _suspects, const ParityBlockSetCheck& _check)
+{
+	std::vector<long> ret;
+	if (_suspects.empty()) return ret;
+	
+	ReedSolomonParityHeader header;
+	_parity.clear();
+	_parity.seekg(0, _parity.beg);
+	_parity.read((char*)&header, sizeof(header));
+	if (_parity.gcount() != sizeof(header) ||
+		memcmp(header.magic, REED_SOLOMON_PARITY_MAGIC, 8) != 0 ||
+		header.dataBlocks < 1 || header.parityBlocks < 1 || header.dataBlocks + header.parityBlocks > 256 ||
+		header.totalBytes != _fileBytes)
+	{
+		if (DEBUGGING) printf("locateDamagedReedSolomonBlocks: parity file header is corrupted\r\n");
+		return ret;
+	}
+	int k = header.dataBlocks;
+	int m = header.parityBlocks;
+	std::vector<uint8_t> coefficients = cauchyMatrix(k, m);
+	GaloisMulAddKernel mulAdd = activeMulAddKernel();
+	
+	// The parity of the file as it is now
+	ReedSolomonParityAccumulator current(_fileBytes, k, m);
+	std::vector<char> buff(k * 1024L);
+	_file.clear();
+	_file.seekg(0, _file.beg);
+	for (long totalRead = 0; totalRead < _fileBytes; )
+	{
+		long amountToRead = std::min((long)buff.size(), _fileBytes - totalRead);
+		_file.read(buff.data(), amountToRead);
+		if (_file.gcount() != amountToRead)
+		{
+			if (DEBUGGING) printf("locateDamagedReedSolomonBlocks: file is shorter than expected\r\n");
+			return ret;
+		}
+		current.addBlocks(buff.data(), amountToRead);
+		totalRead += amountToRead;
+	}
+	std::ostringstream currentOss;
+	current.serialize(currentOss);
+	std::string currentParity = currentOss.str();
+	
+	std::string storedParity(currentParity.size(), 0);
+	_parity.clear();
+	_parity.seekg(0, _parity.beg);
+	_parity.read(&storedParity[0], storedParity.size());
+	if (_parity.gcount() != (long)storedParity.size() || memcmp(currentParity.data(), storedParity.data(), sizeof(header)) != 0)
+	{
+		if (DEBUGGING) printf("locateDamagedReedSolomonBlocks: parity file doesn't match the file\r\n");
+		return ret;
+	}
+	
+	std::map<long, std::vector<long>> stripeToSuspects;
+	for (long b : _suspects) stripeToSuspects[b / k].push_back(b);
+	
+	for (const auto& [stripe, suspects] : stripeToSuspects)
+	{
+		// Differences between the current and the stored parity rows of the stripe. Damage e_i in data block i
+		// makes the difference in row j the sum over i of C[j][i] * e_i.
+		std::vector<ParityBlock> syndromes(m);
+		bool anyDifference = false;
+		for (int j=0; j<m; j++)
+		{
+			long offset = sizeof(header) + (stripe * m + j) * 1024L;
+			for (int x=0; x<1024; x++)
+			{
+				syndromes[j].bytes[x] = currentParity[offset + x] ^ storedParity[offset + x];
+				if (syndromes[j].bytes[x] != 0) anyDifference = true;
+			}
+		}
+		if (!anyDifference) continue;
+		
+		int n = suspects.size();
+		auto positionsOf = [&](const std::vector<int>& _subset){
+			std::vector<int> positions;
+			for (int s : _subset) positions.push_back(suspects[s] - stripe * k);
+			return positions;
+		};
+		
+		// The blocks as they were before the damage, if the damage is in exactly the suspects _subset
+		auto rebuild = [&](const std::vector<int>& _subset){
+			std::vector<int> positions = positionsOf(_subset);
+			int t = positions.size();
+			std::vector<uint8_t> inverse = invertedSubmatrix(coefficients, k, positions);
+			std::map<long, std::vector<char>> blocks;
+			for (int c=0; c<t; c++)
+			{
+				long b = suspects[_subset[c]];
+				int blockBytes = (int)std::min(1024L, _fileBytes - b * 1024);
+				ParityBlock rebuilt;
+				memset(rebuilt.bytes, 0, 1024);
+				_file.clear();
+				_file.seekg(b * 1024, _file.beg);
+				_file.read(rebuilt.bytes, blockBytes);
+				for (int r=0; r<t; r++) mulAdd(rebuilt.bytes, syndromes[r].bytes, inverse[c * t + r]);
+				blocks[b] = std::vector<char>(rebuilt.bytes, rebuilt.bytes + blockBytes);
+			}
+			return blocks;
+		};
+		
+		// Damage in fewer than m blocks is normally pinned down by the parity alone, smallest amount first. It isn't
+		// when the damage of several blocks is alike, for example the same bytes flipped in each, so _check decides.
+		// Any m blocks explain any difference, so after that sets of m suspects are tried against _check.
+		std::vector<int> located;
+		std::vector<int> firstExplaining;
+		for (int t=1; t<m && t<=n && located.empty(); t++)
+		{
+			forEachSubset(n, t, [&](const std::vector<int>& _subset){
+				if (!positionsExplainSyndromes(syndromes, coefficients, k, positionsOf(_subset))) return false;
+				if (firstExplaining.empty()) firstExplaining = _subset;
+				if (_check(rebuild(_subset))) located = _subset;
+				return !located.empty();
+			});
+		}
+		if (located.empty() && n > m)
+		{
+			long tried = 0;
+			forEachSubset(n, m, [&](const std::vector<int>& _subset){
+				if (tried++ == REED_SOLOMON_MAX_LOCATE_SETS) return true;
+				if (_check(rebuild(_subset))) located = _subset;
+				return !located.empty();
+			});
+		}
+		
+		// Without a set that passes _check, the damage may be outside this stripe too, so go by the parity alone
+		if (located.empty() && !firstExplaining.empty()) located = firstExplaining;
+		if (located.empty() && n <= m)
+		{
+			ret.insert(ret.end(), suspects.begin(), suspects.end());
+			continue;
+		}
+		if (located.empty() && DEBUGGING) printf("locateDamagedReedSolomonBlocks: no set of suspects in stripe %li passes the check\r\n", stripe);
+		for (int s : located) ret.push_back(suspects[s]);
+	}
+	if (DEBUGGING) printf("locateDamagedReedSolomonBlocks: %lu of %lu suspect blocks are damaged\r\n", ret.size(), _suspects.size());
+	return ret;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <ostream>
+#include <istream>
+#include <vector>
+#include <array>
+#include <map>
+#include <cstdint>
+
+#include "parity.h"
+
+// Reed-Solomon parity over GF(2^8): the blocks of a file are split into stripes of dataBlocks consecutive 1024-byte
+// blocks, and every stripe gets parityBlocks parity blocks. Parity block j of a stripe is the sum over its data blocks i
+// of C[j][i] * block i, computed byte by byte, where C is a Cauchy matrix. Every square submatrix of C is invertible,
+// so any parityBlocks damaged blocks of a stripe can be rebuilt, as long as the damage is known, which the merkel tree tells.
+
+// Reed-Solomon .fmparity files start with this magic. XOR .fmparity files start with their minDivisor instead.
+#define REED_SOLOMON_PARITY_MAGIC "FMPARrs"
+
+#define REED_SOLOMON_DEFAULT_DATA_BLOCKS 64
+#define REED_SOLOMON_DEFAULT_PARITY_BLOCKS 4
+
+// A Reed-Solomon .fmparity file is this header, followed by the parity blocks of every stripe, stripe by stripe
+struct ReedSolomonParityHeader
+{
+	char magic[8];
+	uint32_t dataBlocks;
+	uint32_t parityBlocks;
+	int64_t totalBytes;
+	int64_t reserved;
+};
+static_assert(sizeof(ReedSolomonParityHeader) == 32, "ReedSolomonParityHeader must be 32 bytes");
+
+// Exits with an error unless _dataBlocks and _parityBlocks make a valid code
+void checkReedSolomonParameters(int _dataBlocks, int _parityBlocks);
+
+// The parity of all stripes is kept in memory until serialize(..), which is _parityBlocks / _dataBlocks of the file size.
+// Files smaller than one stripe are encoded as a single stripe of all their blocks.
+class ReedSolomonParityAccumulator : public ParityEncoder
+{
+private:
+	int dataBlocks;
+	int parityBlocks;
+	long totalBytes;
+	long blockIndex;
+	
+	// Parity of every stripe so far, parityBlocks blocks per stripe
+	std::vector<ParityBlock> stripeParity;
+	std::vector<uint8_t> coefficients;
+	
+	void addBlock(const char* _data);
+public:
+	ReedSolomonParityAccumulator(long _fileBytes, int _dataBlocks, int _parityBlocks);
+	long getAmountOfBlocks() const override;
+	void addBlocks(const char* _data, long _amountBytes) override;
+	void serialize(std::ostream& _dest) const override;
+};
+
+// Same as reconstructBlocksFromParity, for Reed-Solomon parity. Reads the file and the parity once, stripe by stripe.
+std::map<long, std::vector<char>> reconstructBlocksFromReedSolomonParity(std::istream& _file, long _fileBytes, std::istream& _parity, const std::vector<long>& _badBlocks, const ParityBlockCheck& _check);
+
+// At most this many sets of parityBlocks suspects of one stripe are tried by locateDamagedReedSolomonBlocks
+#define REED_SOLOMON_MAX_LOCATE_SETS 16384
+
+// Same as locateDamagedBlocks, for Reed-Solomon parity. The difference between the stored and the current parity of a
+// stripe is C times the damage, so damage in fewer than parityBlocks blocks is found by solving for it with some parity
+// rows and checking the others, set of suspects by set of suspects, and the blocks rebuilt from a set that explains the
+// difference must pass _check. Any parityBlocks blocks explain any difference, so after that sets of that many suspects
+// are tried against _check.
+std::vector<long> locateDamagedReedSolomonBlocks(std::istream& _file, long _fileBytes, std::istream& _parity, const std::vector<long>& _suspects, const ParityBlockSetCheck& _check);
@@ -2,17 +2,44 @@
 #include <map>
 #include <filesystem>
 #include <fstream>
+#include <sstream>
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <cerrno>
+#include <memory>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "util.h"
 #include "repository.h"
 #include "merkel_tree.h"
-#include "sha256.h"
+#include "parity.h"
+#include "hash_algorithm.h"
+#include "uuid.h"
+#include "placement.h"
+#include "stat_cache.h"
+#include "reed_solomon.h"
+#include "scrub.h"
+#include "async_reader.h"
+#include "pack_store.h"
 
 #define DEBUGGING false
 
+// Searching a block for a swapped, modified or inserted byte hashes it once per candidate, which takes time quadratic
+// in the block size. Damaged leaves larger than this are only rebuilt from parity.
+#define ERRFIX_BRUTE_FORCE_MAX_LEAF_BYTES 4096
+
 Repository::Repository(std::string _path) :
-	path(_path)
+	path(_path),
+	statCache(_path + "/fmstatcache.sqlite"),
+	packStore(_path)
 {
 	config_file = path + "/fmrepo.conf";
 	if (std::filesystem::exists(config_file))
@@ -47,39 +74,169 @@ Repository::Repository(std::string _path) :
 	{
 		exitWithError("No repo config file found at " + config_file);
 	}
+	
+	if (this->config.count("placement") != 0) this->placementStrategy = parsePlacementStrategy(this->config["placement"]);
+	
+	if (this->config.count("stat_cache") != 0)
+	{
+		if (this->config["stat_cache"] == "true") this->useStatCache = true;
+		else if (this->config["stat_cache"] == "false") this->useStatCache = false;
+		else exitWithError("stat_cache in " + config_file + " must be true or false");
+	}
+	
+	// With only an overhead given, the overhead decides how far the divisors go
+	if (this->config.count("parity_overhead") != 0)
+	{
+		try { this->parityOverheadPercent = std::stod(this->config["parity_overhead"]); }
+		catch (...) { exitWithError("parity_overhead in " + config_file + " must be a percentage"); }
+		if (!(*this->parityOverheadPercent > 0)) exitWithError("parity_overhead in " + config_file + " must be more than 0");
+		this->parityMaxDivisor = PARITY_DIVISOR_LIMIT;
+	}
+	if (this->config.count("parity_max_divisor") != 0)
+	{
+		try { this->parityMaxDivisor = std::stoi(this->config["parity_max_divisor"]); }
+		catch (...) { exitWithError("parity_max_divisor in " + config_file + " must be a number"); }
+		if (this->parityMaxDivisor < 2 || this->parityMaxDivisor > PARITY_DIVISOR_LIMIT) exitWithError("parity_max_divisor in " + config_file + " must be between 2 and " + std::to_string(PARITY_DIVISOR_LIMIT));
+	}
+	
+	if (this->config.count("parity") != 0)
+	{
+		if (this->config["parity"] == "xor") this->useReedSolomonParity = false;
+		else if (this->config["parity"] == "reed_solomon") this->useReedSolomonParity = true;
+		else exitWithError("parity in " + config_file + " must be xor or reed_solomon");
+	}
+	if (this->config.count("reed_solomon_data_blocks") != 0)
+	{
+		try { this->reedSolomonDataBlocks = std::stoi(this->config["reed_solomon_data_blocks"]); }
+		catch (...) { exitWithError("reed_solomon_data_blocks in " + config_file + " must be a number"); }
+	}
+	if (this->config.count("reed_solomon_parity_blocks") != 0)
+	{
+		try { this->reedSolomonParityBlocks = std::stoi(this->config["reed_solomon_parity_blocks"]); }
+		catch (...) { exitWithError("reed_solomon_parity_blocks in " + config_file + " must be a number"); }
+	}
+	if (this->useReedSolomonParity) checkReedSolomonParameters(this->reedSolomonDataBlocks, this->reedSolomonParityBlocks);
+	
+	if (this->config.count("leaf_size") != 0)
+	{
+		long leafSize = 0;
+		try { leafSize = std::stol(this->config["leaf_size"]); }
+		catch (...) { exitWithError("leaf_size in " + config_file + " must be a number of bytes"); }
+		if (!isValidMerkelLeafSize(leafSize)) exitWithError("leaf_size in " + config_file + " must be a power of two between " + std::to_string(MERKEL_MIN_LEAF_SIZE) + " and " + std::to_string(MERKEL_MAX_LEAF_SIZE));
+		this->leafSize = leafSize;
+	}
+	
+	if (this->config.count("hash") != 0)
+	{
+		std::optional<HashAlgorithm> hashAlgorithm = parseHashAlgorithm(this->config["hash"]);
+		if (!hashAlgorithm.has_value()) exitWithError("hash in " + config_file + " must be sha256 or blake3");
+		this->hashAlgorithm = *hashAlgorithm;
+	}
+	
+	if (this->config.count("pack_threshold") != 0)
+	{
+		try { this->packThreshold = std::stol(this->config["pack_threshold"]); }
+		catch (...) { exitWithError("pack_threshold in " + config_file + " must be a number of bytes"); }
+		if (this->packThreshold < 0 || this->packThreshold > PACK_THRESHOLD_LIMIT) exitWithError("pack_threshold in " + config_file + " must be between 0 and " + std::to_string(PACK_THRESHOLD_LIMIT));
+	}
+	
+	this->rootFd = open(this->path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (this->rootFd == -1) exitWithError("Cannot open repo directory " + this->path + ": " + strerror(errno));
+	
+	this->knownDirectories = std::make_unique<std::atomic<uint64_t>[]>(FANOUT_TOTAL_BITS / 64);
+	for (long i=0; i<FANOUT_TOTAL_BITS / 64; i++) this->knownDirectories[i].store(0, std::memory_order_relaxed);
 }
 
-std::string Repository::hashToFilePath(const std::array<char, 32>& _hash)
+Repository::~Repository()
 {
-	std::string path = this->path;
+	if (this->rootFd != -1) close(this->rootFd);
+}
+
+bool Repository::isKnownDirectory(long _bit) const
+{
+	return (this->knownDirectories[_bit / 64].load(std::memory_order_relaxed) >> (_bit % 64)) & 1;
+}
+
+// After the first file in a directory, this costs no system calls at all
+void Repository::ensureFanoutDirectories(const std::array<char, 32>& _hash)
+{
+	unsigned char b0 = _hash[0], b1 = _hash[1], b2 = _hash[2];
+	long bits[3] = {
+		b0,
+		FANOUT_LEVEL2_BITS_OFFSET + (b0 << 8 | b1),
+		FANOUT_LEVEL3_BITS_OFFSET + (b0 << 16 | b1 << 8 | b2)
+	};
+	if (this->isKnownDirectory(bits[2])) return;
 	
-	std::string hashHex = bytes_to_hex(_hash);
+	// "aa/bb/cc", of which the first 2, 5 and 8 characters are the three levels
+	char dir[9];
+	char hex[6];
+	bytes_to_hex(_hash.data(), 3, hex);
+	dir[0] = hex[0]; dir[1] = hex[1]; dir[2] = '/';
+	dir[3] = hex[2]; dir[4] = hex[3]; dir[5] = '/';
+	dir[6] = hex[4]; dir[7] = hex[5]; dir[8] = 0;
 	
-	path += "/" + hashHex.substr(0, 2);
-	if (!std::filesystem::exists(path)) { if (!std::filesystem::create_directory(path)) exitWithError("Could not create directory: " + path); }
-	else if (!std::filesystem::is_directory(path)) exitWithError("Not a directory: " + path);
+	for (int level=0; level<3; level++)
+	{
+		if (this->isKnownDirectory(bits[level])) continue;
+		
+		char levelDir[9];
+		int length = level * 3 + 2;
+		memcpy(levelDir, dir, length);
+		levelDir[length] = 0;
+		
+		// Another thread or process may create it at the same time, so an existing directory is fine
+		if (mkdirat(this->rootFd, levelDir, 0777) != 0)
+		{
+			if (errno != EEXIST) exitWithError("Could not create directory: " + this->path + "/" + levelDir + ": " + strerror(errno));
+			struct stat st;
+			if (fstatat(this->rootFd, levelDir, &st, 0) != 0 || !S_ISDIR(st.st_mode)) exitWithError("Not a directory: " + this->path + "/" + levelDir);
+		}
+		
+		this->knownDirectories[bits[level] / 64].fetch_or(1UL << (bits[level] % 64), std::memory_order_relaxed);
+	}
+}
+
+std::string Repository::hashToPath(const std::array<char, 32>& _hash, const char* _suffix, bool _createDirectories)
+{
+	if (_createDirectories) this->ensureFanoutDirectories(_hash);
 	
-	path += "/" + hashHex.substr(2, 2);
-	if (!std::filesystem::exists(path)) { if (!std::filesystem::create_directory(path)) exitWithError("Could not create directory: " + path); }
-	else if (!std::filesystem::is_directory(path)) exitWithError("Not a directory: " + path);
+	// path/aa/bb/cc/ + 64 hex characters + suffix
+	size_t suffixLength = strlen(_suffix);
+	std::string ret;
+	ret.resize(this->path.length() + 10 + 64 + suffixLength);
 	
-	path += "/" + hashHex.substr(4, 2);
-	if (!std::filesystem::exists(path)) { if (!std::filesystem::create_directory(path)) exitWithError("Could not create directory: " + path); }
-	else if (!std::filesystem::is_directory(path)) exitWithError("Not a directory: " + path);
+	char* out = &ret[0];
+	memcpy(out, this->path.data(), this->path.length());
+	out += this->path.length();
 	
-	path += "/" + hashHex;
+	char* hex = out + 10;
+	bytes_to_hex(_hash.data(), 32, hex);
+	for (int level=0; level<3; level++)
+	{
+		*out++ = '/';
+		*out++ = hex[level * 2];
+		*out++ = hex[level * 2 + 1];
+	}
+	*out++ = '/';
+	memcpy(hex + 64, _suffix, suffixLength);
 	
-	return path;
+	return ret;
 }
 
-std::string Repository::hashToTreePath(const std::array<char, 32>& _hash)
+std::string Repository::hashToFilePath(const std::array<char, 32>& _hash, bool _createDirectories)
 {
-	return this->hashToFilePath(_hash) + ".fmtree";
+	return this->hashToPath(_hash, "", _createDirectories);
 }
 
-std::string Repository::hashToParityPath(const std::array<char, 32>& _hash)
+std::string Repository::hashToTreePath(const std::array<char, 32>& _hash, bool _createDirectories)
 {
-	return this->hashToFilePath(_hash) + ".fmparity";
+	return this->hashToPath(_hash, ".fmtree", _createDirectories);
+}
+
+std::string Repository::hashToParityPath(const std::array<char, 32>& _hash, bool _createDirectories)
+{
+	return this->hashToPath(_hash, ".fmparity", _createDirectories);
 }
 
 std::pair<std::array<char, 32>, bool> Repository::add(const std::string& _path)
@@ -87,17 +244,141 @@ std::pair<std::array<char, 32>, bool> Repository::add(const std::string& _path)
 	if (!std::filesystem::exists(_path)) exitWithError("File does not exist: " + _path);
 	if (!std::filesystem::is_regular_file(_path)) exitWithError("File is not a regular file: " + _path);
 	
-	std::shared_ptr<MerkelTree> merkelTree = generateMerkelTreeFromFilePath(_path);
-	std::array<char, 32> hash = *merkelTree->hash;	
+	long sourceFileSize = std::filesystem::file_size(_path);
+	if (sourceFileSize == 0) exitWithError("Cannot add empty file: " + _path);
+	
+	// If the source file was added before and hasn't been touched since, and the repo still has it, there's nothing to do
+	FileStat sourceStat = statFile(_path);
+	if (this->useStatCache)
+	{
+		std::optional<std::array<char, 32>> cachedHash = this->statCache.lookup(sourceStat);
+		if (cachedHash.has_value())
+		{
+			std::string cachedFilePath = this->hashToFilePath(*cachedHash, false);
+			std::error_code ec;
+			if ((long)std::filesystem::file_size(cachedFilePath, ec) == sourceStat.size && !ec &&
+				std::filesystem::exists(this->hashToTreePath(*cachedHash, false)) &&
+				std::filesystem::exists(this->hashToParityPath(*cachedHash, false)))
+			{
+				if (DEBUGGING) std::cout << "File " << _path << " is unchanged since it was added as " << cachedFilePath << "\r\n";
+				return {*cachedHash, false};
+			}
+			
+			std::optional<PackEntry> cachedEntry = this->packStore.lookup(*cachedHash);
+			if (cachedEntry.has_value() && cachedEntry->dataBytes == sourceStat.size)
+			{
+				if (DEBUGGING) std::cout << "File " << _path << " is unchanged since it was packed\r\n";
+				return {*cachedHash, false};
+			}
+		}
+	}
 	
-	std::string destFilePath = this->hashToFilePath(hash);
+	// Stream the source file once, feeding the merkel tree, the parity blocks and
+	// a temporary copy inside the repo. The copy is renamed into place once the hash is known.
+	// Chunks of the merkel tree are hashed on treeThreads worker threads while the next chunk is read.
+	// With any placement strategy other than copy, the temporary copy is only made after hashing, by placeFile(..).
+	// Files that will be packed are collected in memory instead.
+	MerkelTreeBuilder merkelTreeBuilder(this->treeThreads, this->leafSize, this->hashAlgorithm);
 	
-	long sourceFileSize = std::filesystem::file_size(_path);
+	std::unique_ptr<ParityEncoder> parity;
+	if (this->useReedSolomonParity)
+	{
+		parity = std::make_unique<ReedSolomonParityAccumulator>(sourceFileSize, this->reedSolomonDataBlocks, this->reedSolomonParityBlocks);
+	}
+	else
+	{
+		auto [minDivisor, maxDivisor] = parityDivisorsFor(sourceFileSize, this->parityOverheadPercent, this->parityMaxDivisor);
+		parity = std::make_unique<ParityAccumulator>(minDivisor, maxDivisor);
+	}
+	
+	std::string tempFilePath = this->path + "/.fmtmp-" + generate_uuid_v4();
+	bool packing = sourceFileSize < this->packThreshold;
+	bool copyWhileReading = this->placementStrategy == PS_COPY && !packing;
+	std::vector<char> packData;
+	if (packing) packData.reserve(sourceFileSize);
+	std::filesystem::file_time_type sourceWriteTime = std::filesystem::last_write_time(_path);
+	
+	int sourceFd = open(_path.c_str(), O_RDONLY);
+	if (sourceFd == -1) exitWithError("Failed to open file " + _path);
+	{
+		std::ofstream tempOfs;
+		if (copyWhileReading)
+		{
+			tempOfs.open(tempFilePath, std::ios::binary);
+			if (!tempOfs.is_open()) exitWithError("Failed to create temporary file " + tempFilePath);
+		}
+		
+		// The reads of the next chunks are in flight while a chunk is hashed, and the buffers go to the tree builder without a copy
+		AsyncFileReader reader(sourceFd, sourceFileSize, MERKEL_CHUNK_BYTES);
+		long totalRead = 0;
+		while (totalRead < sourceFileSize)
+		{
+			std::vector<char> buff = merkelTreeBuilder.takeBuffer();
+			if (reader.next(buff) != RCR_CHUNK) exitWithError("Failed to read file " + _path);
+			long amountToRead = buff.size();
+			
+			parity->addBlocks(buff.data(), amountToRead);
+			
+			if (packing) packData.insert(packData.end(), buff.data(), buff.data() + amountToRead);
+			
+			if (copyWhileReading)
+			{
+				tempOfs.write(buff.data(), amountToRead);
+				if (!tempOfs.good()) exitWithError("Failed to write to temporary file " + tempFilePath);
+			}
+			
+			totalRead += amountToRead;
+			merkelTreeBuilder.addChunk(std::move(buff));
+		}
+		
+		if (copyWhileReading)
+		{
+			tempOfs.close();
+			if (tempOfs.fail()) exitWithError("Failed to write to temporary file " + tempFilePath);
+		}
+	}
+	close(sourceFd);
+	
+	std::shared_ptr<MerkelTree> merkelTree = merkelTreeBuilder.finalize();
+	std::array<char, 32> hash = *merkelTree->hash;
+	
+	if (merkelTree->getTotalBytes() != sourceFileSize) exitWithError("File " + _path + " changed size while it was being added");
+	if (parity->getAmountOfBlocks() != (sourceFileSize+1023) / 1024) exitWithError("Failed to generate parity blocks");
+	
+	// Packed files don't need fanout directories
+	std::string destFilePath = this->hashToFilePath(hash, !packing);
+	
+	if (packing)
+	{
+		bool wasNew = this->addPacked(hash, destFilePath, std::move(packData), *merkelTree, *parity);
+		releasePageCache(_path);
+		this->rememberSourceFile(_path, sourceStat, hash);
+		return {hash, wasNew};
+	}
+	
+	// Files that are already in the repo don't need to be placed at all
+	if (!copyWhileReading && !std::filesystem::exists(destFilePath))
+	{
+		PlacementStrategy usedStrategy = placeFile(_path, tempFilePath, this->placementStrategy);
+		if (DEBUGGING) std::cout << "Placed " << _path << " using " << placementStrategyName(usedStrategy) << "\r\n";
+		
+		// The bytes were not copied while they were hashed, so make sure they are still the same bytes
+		if ((long)std::filesystem::file_size(tempFilePath) != sourceFileSize || std::filesystem::last_write_time(_path) != sourceWriteTime)
+		{
+			std::filesystem::remove(tempFilePath);
+			exitWithError("File " + _path + " changed while it was being added");
+		}
+	}
+	
+	// Several threads may be adding files with the same contents at the same time
+	std::lock_guard<std::mutex> placementLock(this->placementMutex);
 	
 	bool wasNew = false;
 	
 	if (std::filesystem::exists(destFilePath))
 	{
+		std::filesystem::remove(tempFilePath);
+		
 		if (std::filesystem::file_size(destFilePath) == sourceFileSize)
 		{
 			if (DEBUGGING) std::cout << "File " << _path << " already exists at " << destFilePath << "\r\n";
@@ -110,84 +391,23 @@ std::pair<std::array<char, 32>, bool> Repository::add(const std::string& _path)
 	}
 	else
 	{
-		if (std::filesystem::copy_file(_path, destFilePath))
-		{
-			wasNew = true;
-		}
-		else
+		std::error_code ec;
+		std::filesystem::rename(tempFilePath, destFilePath, ec);
+		if (ec)
 		{
-			exitWithError("Failed to copy file " + _path + " to " + destFilePath);
+			std::filesystem::remove(tempFilePath);
+			exitWithError("Failed to move file " + _path + " to " + destFilePath + ": " + ec.message());
 		}
+		wasNew = true;
 	}
 	
-	// Generate parity file
+	// Write parity file
 	std::string destParityPath = this->hashToParityPath(hash);
 	
 	if (!std::filesystem::exists(destParityPath))
 	{
-		std::ifstream ifs(destFilePath);
-		
-		const unsigned long amountOfBlocksInSourceFile = (sourceFileSize+1023) / 1024;
-		unsigned long amountOfBlocksInSourceFile_log2 = 0;
-		{
-			unsigned long temp = amountOfBlocksInSourceFile;
-			while (temp > 0)
-			{
-				temp >>= 1;
-				amountOfBlocksInSourceFile_log2++;
-			}
-		}
-		
-		const int minDivisor = 2;
-		const int maxDivisor = 11; //(amountOfBlocksInSourceFile >> (amountOfBlocksInSourceFile_log2 / 2)) / ; // TODO make amount of parity configurable
-		
-		char** divisor_to_mod_to_parityBlock[maxDivisor+1];
-		
-		for (int d=minDivisor; d<=maxDivisor; d++)
-		{
-			divisor_to_mod_to_parityBlock[d] = new char*[d];
-			for (int m=0; m<d; m++)
-			{
-				divisor_to_mod_to_parityBlock[d][m] = new char[1024];
-				for (int i=0; i<1024; i++) divisor_to_mod_to_parityBlock[d][m][i] = 0x00;
-			}
-		}
-		
-		char buff[1024];
-		long totalRead = 0;
-		long blockIndex = 0;
-		while (!ifs.eof())
-		{
-			ifs.read(buff, 1024);
-			int amountRead = ifs.gcount();
-			
-			for (int d=minDivisor; d<=maxDivisor; d++)
-			{
-				for (int i=0; i<amountRead; i++)
-				{
-					divisor_to_mod_to_parityBlock[d][blockIndex%d][i] ^= buff[i];
-				}
-			}
-			
-			if (amountRead != 1024 && !ifs.eof()) exitWithError("Failed to generate parity blocks (#2)");
-			
-			totalRead += amountRead;
-			blockIndex++;
-		}
-		
-		if (totalRead != sourceFileSize) exitWithError("Failed to generate parity blocks");
-		if (blockIndex != amountOfBlocksInSourceFile) exitWithError("Failed to generate parity blocks (#3)");
-		
-		std::ofstream parityOfs(destParityPath);
-		parityOfs.write((char*)&minDivisor, 4);
-		parityOfs.write((char*)&maxDivisor, 4);
-		for (int d=minDivisor; d<=maxDivisor; d++)
-		{
-			for (int m=0; m<d; m++)
-			{
-				parityOfs.write(divisor_to_mod_to_parityBlock[d][m], 1024);
-			}
-		}
+		std::ofstream parityOfs(destParityPath, std::ios::binary);
+		parity->serialize(parityOfs);
 		parityOfs.close();
 	}
 	
@@ -201,6 +421,12 @@ std::pair<std::array<char, 32>, bool> Repository::add(const std::string& _path)
 		ofs.close();
 	}
 	
+	// The source was read through the reader, but placement and the copy went through the page cache
+	releasePageCache(_path);
+	if (wasNew) releasePageCache(destFilePath);
+	
+	this->rememberSourceFile(_path, sourceStat, hash);
+	
 	if (DEBUGGING)
 	{
 		std::ifstream ifs(destTreePath);
@@ -215,234 +441,315 @@ std::pair<std::array<char, 32>, bool> Repository::add(const std::string& _path)
 	return {hash, wasNew};
 }
 
-ErrorCheckResult Repository::errorCheck(std::array<char, 32> _file)
+bool Repository::addPacked(const std::array<char, 32>& _hash, const std::string& _destFilePath, std::vector<char>&& _data, const MerkelTree& _tree, const ParityEncoder& _parity)
 {
-	std::string filePath = this->hashToFilePath(_file);
-	std::string treePath = this->hashToTreePath(_file);
+	// Several threads may be adding files with the same contents at the same time
+	std::lock_guard<std::mutex> placementLock(this->placementMutex);
 	
-	std::ifstream treeIfs(treePath);
-	std::ifstream fileIfs(filePath);
+	// A loose copy from before packing was enabled is just as good
+	long existingBytes = -1;
+	if (std::filesystem::exists(_destFilePath)) existingBytes = std::filesystem::file_size(_destFilePath);
+	else if (std::optional<PackEntry> entry = this->packStore.lookup(_hash)) existingBytes = entry->dataBytes;
 	
-	char buff[1024];
-	std::array<char, 32> hashFromTree;
-	std::array<char, 32> hashFromFile;
+	if (existingBytes != -1)
+	{
+		if (existingBytes != (long)_data.size()) exitWithError("File with hash " + bytes_to_hex(_hash) + " is already in the repo, but with a different size!");
+		if (DEBUGGING) std::cout << "File with hash " << bytes_to_hex(_hash) << " is already in the repo\r\n";
+		return false;
+	}
 	
-	long lengthAccordingToTreeFile = -1;
-	long totalRead = 0;
+	PackedBlob blob;
+	blob.data = std::move(_data);
+	std::ostringstream treeOss;
+	_tree.serialize(treeOss);
+	blob.tree = treeOss.str();
+	std::ostringstream parityOss;
+	_parity.serialize(parityOss);
+	blob.parity = parityOss.str();
 	
-	while (1)
+	return this->packStore.add(_hash, blob);
+}
+
+void Repository::rememberSourceFile(const std::string& _path, const FileStat& _sourceStat, const std::array<char, 32>& _hash)
+{
+	// Stat again, because placement by hardlink changes the ctime. Only cache the file if it didn't change while it was added.
+	if (this->useStatCache)
+	{
+		FileStat newSourceStat = statFile(_path);
+		if (newSourceStat.size == _sourceStat.size && newSourceStat.mtimeNs == _sourceStat.mtimeNs) this->statCache.store(newSourceStat, _hash);
+	}
+}
+
+ErrorCheckResult Repository::errorCheck(std::array<char, 32> _file, IoSlots* _ioSlots)
+{
+	std::string filePath = this->hashToFilePath(_file, false);
+	if (!std::filesystem::exists(filePath))
 	{
-		fileIfs.read(&buff[0], 1024);
-		int amountRead = fileIfs.gcount();
-		if (amountRead < 0) exitWithError("amountRead<0");
-		SHA256 sha256;
-		sha256.init();
-		sha256.update((const unsigned char*)&buff[0], amountRead);
-		sha256.final((unsigned char*)hashFromFile.data());
+		std::optional<PackEntry> entry = this->packStore.lookup(_file);
+		if (entry.has_value()) return this->errorCheckPacked(_file, *entry, _ioSlots);
+		return ECR_FILE_NOT_FOUND;
+	}
+	
+	return this->errorCheckAt(_file, filePath, this->hashToTreePath(_file, false), _ioSlots);
+}
+
+ErrorCheckResult Repository::errorCheckAt(const std::array<char, 32>& _file, const std::string& _filePath, const std::string& _treePath, IoSlots* _ioSlots)
+{
+	if (!std::filesystem::exists(_filePath)) return ECR_FILE_NOT_FOUND;
+	
+	try
+	{
+		MerkelTreeLeafReader tree(_treePath);
+		if (tree.getRootHash() != _file) { if (DEBUGGING) { printf("Repository::errorCheck(): root hash of tree != file hash\n"); } return ECR_ERROR; }
+		
+		int fd = open(_filePath.c_str(), O_RDONLY);
+		if (fd == -1) { if (DEBUGGING) { printf("Repository::errorCheck(): failed to open file\n"); } return ECR_ERROR; }
 		
-		while (!treeIfs.eof())
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size != tree.getTotalBytes())
 		{
-			treeIfs.read(buff, 1);
-			if (buff[0] == 0) break;
-			else
+			if (DEBUGGING) printf("Repository::errorCheck(): file size != size according to tree\n");
+			close(fd);
+			return ECR_ERROR;
+		}
+		
+		// The file is read in large chunks, with the next reads in flight while a chunk is hashed. Only waiting for
+		// a read holds an I/O slot, not the hashing. Full leaves are hashed many at a time and compared against the
+		// tree's leaf hashes in one go.
+		bool allLeavesMatch = true;
+		{
+			AsyncFileReader reader(fd, tree.getTotalBytes(), ERRCHECK_READ_BUFFER_BYTES);
+			std::vector<char> chunk;
+			long leafSize = tree.getLeafSize();
+			HashAlgorithm hashAlgorithm = tree.getHashAlgorithm();
+			std::vector<std::array<char, 32>> hashesFromFile(ERRCHECK_READ_BUFFER_BYTES / leafSize);
+			for (long chunkStart=0; chunkStart<tree.getTotalBytes(); chunkStart+=ERRCHECK_READ_BUFFER_BYTES)
 			{
-				if (lengthAccordingToTreeFile == -1)
+				ReadChunkResult readResult;
 				{
-					treeIfs.read((char*)&lengthAccordingToTreeFile, 8);
-					treeIfs.read(buff, 32);
+					IoSlotGuard ioSlot(_ioSlots);
+					readResult = reader.next(chunk);
 				}
-				else
+				if (readResult != RCR_CHUNK)
 				{
-					treeIfs.read(buff, 8 + 32);
+					if (DEBUGGING) printf("Repository::errorCheck(): file is shorter than the tree says\n");
+					allLeavesMatch = false;
+					break;
+				}
+				
+				long chunkBytes = chunk.size();
+				long amountFullLeaves = chunkBytes / leafSize;
+				long tailBytes = chunkBytes % leafSize;
+				long firstLeaf = chunkStart / leafSize;
+				hashLeaves(hashAlgorithm, chunk.data(), amountFullLeaves, leafSize, firstLeaf, hashesFromFile.data());
+				if (tailBytes != 0) hashesFromFile[amountFullLeaves] = hashLeaf(hashAlgorithm, &chunk[amountFullLeaves * leafSize], tailBytes, leafSize, firstLeaf + amountFullLeaves);
+				
+				long amountLeaves = amountFullLeaves + (tailBytes != 0 ? 1 : 0);
+				if (memcmp(hashesFromFile.data(), tree.getLeafHashes() + chunkStart / leafSize, amountLeaves * 32) != 0)
+				{
+					if (DEBUGGING) printf("Repository::errorCheck(): hashFromTree != hashFromFile\n");
+					allLeavesMatch = false;
+					break;
+				}
+				
+				// When the root is not the hash of the top node, the root of a single leaf is only tied to the leaf by its bytes
+				if (tree.getAmountLeaves() == 1 && !rootIsTopNode(hashAlgorithm) && hashRootLeaf(hashAlgorithm, chunk.data(), chunkBytes) != tree.getRootHash())
+				{
+					if (DEBUGGING) printf("Repository::errorCheck(): root hash of tree != root hash of file\n");
+					allLeavesMatch = false;
+					break;
 				}
 			}
 		}
-		if (treeIfs.gcount() != 1) { if (DEBUGGING) { printf("Repository::errorCheck(): treeIfs.gcount() != 1\n"); } return ECR_ERROR; }
-		if (lengthAccordingToTreeFile == -1) treeIfs.read((char*)&lengthAccordingToTreeFile, 8);
-		else treeIfs.read(buff, 8);
-		if (treeIfs.gcount() != 8) { if (DEBUGGING) { printf("Repository::errorCheck(): treeIfs.gcount() != 8\n"); } return ECR_ERROR; }
-		treeIfs.read(hashFromTree.data(), 32);
-		if (treeIfs.gcount() != 32) { if (DEBUGGING) { printf("Repository::errorCheck(): treeIfs.gcount() != 32\n"); } return ECR_ERROR; }
-		
-		if (hashFromTree != hashFromFile) { if (DEBUGGING) { printf("Repository::errorCheck(): hashFromTree != hashFromFile\n"); } return ECR_ERROR; }
 		
-		totalRead += amountRead;
-		
-		if (amountRead != 1024) break;
+		// The reader is gone, so no read is using fd anymore
+		close(fd);
+		if (!allLeavesMatch) return ECR_ERROR;
+	}
+	catch (Error_MerkelTreeFileCorrupted)
+	{
+		if (DEBUGGING) printf("Repository::errorCheck(): tree file is corrupted\n");
+		return ECR_ERROR;
 	}
-	
-	if (lengthAccordingToTreeFile != totalRead) { if (DEBUGGING) { printf("Repository::errorCheck(): lengthAccordingToTreeFile=%lu != totalRead=%lu\n", lengthAccordingToTreeFile, totalRead); } return ECR_ERROR; }
-	
-	fileIfs.close();
-	treeIfs.close();
 	
 	return ECR_ALL_OK;
 }
 
-bool tryFixBlockUsingParityAndHash(const std::string& filePath, std::ifstream& file, std::istream& parityFile, long blockIndexToFix, char* _buff, int _buffSize, const std::array<char, 32>& _hash)
+ErrorCheckResult Repository::errorCheckPacked(const std::array<char, 32>& _file, const PackEntry& _entry, IoSlots* _ioSlots)
 {
-	if (DEBUGGING) printf("tryFixBlockUsingParityAndHash blockIndexToFix=%i _buffSize=%i\r\n", (int)blockIndexToFix, _buffSize);
-	
-	
-	file.seekg(0, file.beg);
-	parityFile.seekg(0, parityFile.beg);
-	
-	int minDivisor;
-	int maxDivisor;
-	
-	parityFile.read((char*)&minDivisor, 4);
-	parityFile.read((char*)&maxDivisor, 4);
-	
-	if (DEBUGGING) printf("minDivisor=%i maxDivisor=%i\r\n", minDivisor, maxDivisor);
+	PackedBlob blob;
+	bool entryIntact;
+	{
+		IoSlotGuard ioSlot(_ioSlots);
+		entryIntact = this->packStore.read(_file, _entry, blob);
+	}
+	if (!entryIntact) { if (DEBUGGING) { printf("Repository::errorCheck(): pack entry is unreadable or its header is damaged\n"); } return ECR_ERROR; }
 	
-	int divisor_to_mod[maxDivisor+1];
-	long divisor_to_index[maxDivisor+1];
+	try
+	{
+		std::istringstream treeIss(blob.tree);
+		MerkelTree tree(treeIss);
+		if (treeIss.peek() != EOF) { if (DEBUGGING) { printf("Repository::errorCheck(): packed tree is too long\n"); } return ECR_ERROR; }
+		if (!tree.errorCheck() || *tree.hash != _file) { if (DEBUGGING) { printf("Repository::errorCheck(): packed tree is damaged\n"); } return ECR_ERROR; }
+		if (tree.getTotalBytes() != (long)blob.data.size()) { if (DEBUGGING) { printf("Repository::errorCheck(): packed file size != size according to tree\n"); } return ECR_ERROR; }
+		
+		std::vector<std::array<char, 32>> hashesFromTree = tree.listBlockHashes();
+		std::vector<std::array<char, 32>> hashesFromFile(hashesFromTree.size());
+		long leafSize = tree.getLeafSize();
+		HashAlgorithm hashAlgorithm = tree.getHashAlgorithm();
+		long amountFullLeaves = blob.data.size() / leafSize;
+		long tailBytes = blob.data.size() % leafSize;
+		hashLeaves(hashAlgorithm, blob.data.data(), amountFullLeaves, leafSize, 0, hashesFromFile.data());
+		if (tailBytes != 0) hashesFromFile[amountFullLeaves] = hashLeaf(hashAlgorithm, &blob.data[amountFullLeaves * leafSize], tailBytes, leafSize, amountFullLeaves);
+		if (hashesFromFile != hashesFromTree) { if (DEBUGGING) { printf("Repository::errorCheck(): hashFromTree != hashFromFile\n"); } return ECR_ERROR; }
+		if (hashesFromTree.size() == 1 && !rootIsTopNode(hashAlgorithm) && hashRootLeaf(hashAlgorithm, blob.data.data(), blob.data.size()) != _file) { if (DEBUGGING) { printf("Repository::errorCheck(): root hash of packed tree != root hash of file\n"); } return ECR_ERROR; }
+	}
+	catch (Error_MerkelTreeFileCorrupted)
+	{
+		if (DEBUGGING) printf("Repository::errorCheck(): packed tree is corrupted\n");
+		return ECR_ERROR;
+	}
 	
-	for (int d=minDivisor; d<=maxDivisor; d++)
+	return ECR_ALL_OK;
+}
+
+// Hash states after absorbing the first 0, 64, 128, ... bytes of a block. A candidate fix that only differs from
+// the block at byte _offset and later can start hashing from the state of the 64-byte chunk containing _offset.
+class BlockPrefixStates
+{
+private:
+	std::vector<LeafHasher> states;
+public:
+	BlockPrefixStates(const LeafHasher& _hasher, const char* _block, int _blockSize)
 	{
-		divisor_to_mod[d] = blockIndexToFix % d;
-		if (d == minDivisor) divisor_to_index[d] = 8;
-		else divisor_to_index[d] = divisor_to_index[d-1] + (d-1) * 1024;
+		states.resize(_blockSize / 64 + 1, _hasher);
+		for (int c=1; c<(int)states.size(); c++)
+		{
+			states[c] = states[c-1];
+			states[c].update(&_block[(c-1) * 64], 64);
+		}
 	}
 	
+	// Start of the chunk that contains _offset
+	static int chunkStart(int _offset)
+	{
+		return _offset - _offset % 64;
+	}
 	
-	for (int d=maxDivisor; d>=minDivisor; d--)
+	// State after absorbing all bytes before chunkStart(_offset)
+	const LeafHasher& before(int _offset) const
 	{
-		int m = divisor_to_mod[d];
-		if (DEBUGGING) printf("Trying to fix with parity divisor %i modulo %i\r\n", d, m);
-		
-		char theParity[1024];
-		
-		parityFile.seekg(divisor_to_index[d] + m*1024, file.beg);
-		if (parityFile.tellg() != divisor_to_index[d] + m*1024) exitWithError("Failed to seek in parity file");
-		parityFile.read(theParity, 1024);
-		if (parityFile.gcount() != 1024) exitWithError("Failed to read from parity file");
-		
-		char fileParity[1024];
-		for (int i=0; i<1024; i++) fileParity[i] = 0x00;
-		
-		file.seekg(m * 1024, file.beg);
-		if (file.tellg() != m*1024) { printf("tellg=%i eof=%i\r\n", file.tellg(), file.eof()); exitWithError("seekg failed"); }
-		
-		long currentBlockIndex = m;
-		while (!file.eof())
+		return states[_offset / 64];
+	}
+};
+
+// Calls _tryPosition(i, candidate) for every position i in [0, _amountPositions) on _threads threads, which take
+// the next untried position from a shared counter. Once any call returns true, the others stop at their next position.
+// Returns the position and candidate of the match, or -1 if there was none.
+template <typename F>
+static std::pair<int, int> searchPositions(int _amountPositions, int _threads, F _tryPosition)
+{
+	std::atomic<int> nextPosition(0);
+	std::atomic<bool> found(false);
+	std::mutex resultMutex;
+	std::pair<int, int> result(-1, 0);
+	
+	auto search = [&](){
+		for (int i = nextPosition++; i < _amountPositions && !found; i = nextPosition++)
 		{
-			char buff[1024];
-			
-			file.read(buff, 1024);
-			int amountRead = file.gcount();
-			
-			if (amountRead != 1024 && !file.eof())
+			int candidate;
+			if (_tryPosition(i, candidate))
 			{
-				if (DEBUGGING) printf("amountRead=%i file.eof()=%i file.tellg()=%i\r\n", amountRead, file.eof(), file.tellg());
-				exitWithError("adfskjsdjkf");
+				std::lock_guard<std::mutex> lock(resultMutex);
+				if (!found) result = {i, candidate};
+				found = true;
 			}
-			
-			if (currentBlockIndex == blockIndexToFix)
-			{
-				if (DEBUGGING) printf("skipping block index to fix\r\n");
-			}
-			else
-			{
-				for (int i=0; i<amountRead; i++) fileParity[i] ^= buff[i];
-			}
-			
-			if (file.eof()) break;
-			
-			file.seekg((d-1) * 1024, file.cur);
-			currentBlockIndex += d;
-		}
-		
-		// Reset eof and fail flags
-		// file.clear();
-		file.close();
-		file = std::ifstream(filePath);
-		
-		
-		for (int i=0; i<1024; i++) fileParity[i] ^= theParity[i];
-		
-		std::array<char, 32> newHash;
-		SHA256 sha256;
-		sha256.init();
-		sha256.update((const unsigned char*)&fileParity[0], _buffSize);
-		sha256.final((unsigned char*)newHash.data());
-		
-		if (newHash == _hash)
-		{
-			if (DEBUGGING) printf("Fixed with parity! :D\r\n");
-			
-			for (int i=0; i<_buffSize; i++) _buff[i] = fileParity[i];
-			return true;
 		}
-	}
+	};
 	
-	if (DEBUGGING) printf("tryFixBlockUsingParityAndHash failed :(\r\n");
+	std::vector<std::thread> threads;
+	for (int t=1; t<std::min(_threads, _amountPositions); t++) threads.emplace_back(search);
+	search();
+	for (auto& thread : threads) thread.join();
 	
-	return false;
+	return result;
 }
 
-bool tryFixBlockUsingHash(char* _buff, int _buffSize, const std::array<char, 32>& _hash)
+// _hasher is a fresh LeafHasher for the leaf that _buff is
+bool tryFixBlockUsingHash(char* _buff, int _buffSize, const LeafHasher& _hasher, const std::array<char, 32>& _hash, int _threads)
 {
 	static char prevShiftedChar;
 	
-	std::array<char, 32> newHash;
+	// Every candidate below leaves the bytes before its position untouched
+	BlockPrefixStates prefix(_hasher, _buff, _buffSize);
+	
+	// Hash of the block with _candidate[from.._buffSize) in place of _buff[from.._buffSize)
+	auto hashFrom = [&](const char* _candidate, int _at){
+		int from = BlockPrefixStates::chunkStart(_at);
+		LeafHasher hasher = prefix.before(_at);
+		hasher.update(&_candidate[from], _buffSize - from);
+		return hasher.final();
+	};
 	
 	// Try to fix 2 adjacent swapped bytes
-	for (int i=0; i<_buffSize-1; i++)
+	std::pair<int, int> swapped = searchPositions(_buffSize - 1, _threads, [&](int i, int& _candidate){
+		char candidate[ERRFIX_BRUTE_FORCE_MAX_LEAF_BYTES];
+		memcpy(candidate, _buff, _buffSize);
+		std::swap(candidate[i], candidate[i+1]);
+		_candidate = 0;
+		return hashFrom(candidate, i) == _hash;
+	});
+	if (swapped.first != -1)
 	{
-		std::swap(_buff[i], _buff[i+1]);
-		
-		SHA256 sha256;
-		sha256.init();
-		sha256.update((const unsigned char*)&_buff[0], _buffSize);
-		sha256.final((unsigned char*)newHash.data());
-		if (newHash == _hash) return true;
-		
-		std::swap(_buff[i], _buff[i+1]);
+		std::swap(_buff[swapped.first], _buff[swapped.first + 1]);
+		return true;
 	}
 	
 	// Try to fix 1 modified byte
-	for (int i=0; i<_buffSize; i++)
-	{
-		char orig = _buff[i];
+	std::pair<int, int> modified = searchPositions(_buffSize, _threads, [&](int i, int& _candidate){
+		char candidate[ERRFIX_BRUTE_FORCE_MAX_LEAF_BYTES];
+		memcpy(candidate, _buff, _buffSize);
 		for (int j=0; j<256; j++)
 		{
-			if (j == orig) continue;
-			_buff[i] = (char)j;
-			SHA256 sha256;
-			sha256.init();
-			sha256.update((const unsigned char*)&_buff[0], _buffSize);
-			sha256.final((unsigned char*)newHash.data());
-			if (newHash == _hash) return true;
+			if ((char)j == _buff[i]) continue;
+			candidate[i] = (char)j;
+			if (hashFrom(candidate, i) == _hash) { _candidate = j; return true; }
 		}
-		_buff[i] = orig;
+		return false;
+	});
+	if (modified.first != -1)
+	{
+		_buff[modified.first] = (char)modified.second;
+		return true;
 	}
 	
 	// Try to fix 1 inserted byte
-	char buff1[1];
-	for (int i=0; i<_buffSize; i++)
-	{
+	char lastShiftedChar = prevShiftedChar;
+	std::pair<int, int> inserted = searchPositions(_buffSize, _threads, [&](int i, int& _candidate){
+		int from = BlockPrefixStates::chunkStart(i);
+		char buff1[1];
 		for (int j=-1; j<256; j++)
 		{
-			if (j == -1) buff1[0] = prevShiftedChar;
+			if (j == -1) buff1[0] = lastShiftedChar;
 			else buff1[0] = (char)j;
-			SHA256 sha256;
-			sha256.init();
-			sha256.update((const unsigned char*)&_buff[0], i);
-			sha256.update((const unsigned char*)&buff1[0], 1);
-			sha256.update((const unsigned char*)&_buff[i], _buffSize - i - 1);
-			sha256.final((unsigned char*)newHash.data());
-			if (newHash == _hash)
-			{
-				prevShiftedChar = _buff[_buffSize-1];
-				for (int k=_buffSize-1; k>i; k--)
-				{
-					_buff[k] = _buff[k-1];
-				}
-				_buff[i] = buff1[0];
-				return true;
-			}
+			LeafHasher hasher = prefix.before(i);
+			hasher.update(&_buff[from], i - from);
+			hasher.update(&buff1[0], 1);
+			hasher.update(&_buff[i], _buffSize - i - 1);
+			if (hasher.final() == _hash) { _candidate = buff1[0]; return true; }
 		}
+		return false;
+	});
+	if (inserted.first != -1)
+	{
+		int i = inserted.first;
+		prevShiftedChar = _buff[_buffSize-1];
+		for (int k=_buffSize-1; k>i; k--)
+		{
+			_buff[k] = _buff[k-1];
+		}
+		_buff[i] = (char)inserted.second;
+		return true;
 	}
 	
 	// Try to fix 2 modified bytes
@@ -479,10 +786,29 @@ bool tryFixBlockUsingHash(char* _buff, int _buffSize, const std::array<char, 32>
 }
 
 ErrorFixResult Repository::errorFix(std::array<char, 32> _file)
+{
+	std::string filePath = this->hashToFilePath(_file, false);
+	if (!std::filesystem::exists(filePath))
+	{
+		std::optional<PackEntry> entry = this->packStore.lookup(_file);
+		if (entry.has_value()) return this->errorFixPacked(_file, *entry);
+		return EFR_FILE_NOT_FOUND;
+	}
+	
+	return this->errorFixAt(_file, filePath, this->hashToTreePath(_file, false), this->hashToParityPath(_file, false));
+}
+
+ErrorFixResult Repository::errorFixAt(const std::array<char, 32>& _file, const std::string& _filePath, const std::string& _treePath, const std::string& _parityPath)
 {
 	int fixAttempts = 0;
 checkFixed:
-	ErrorCheckResult ecr = errorCheck(_file);
+	// The previous attempt read the file, the tree and the parity through the page cache
+	if (fixAttempts != 0)
+	{
+		releasePageCache(_filePath);
+		releasePageCache(_parityPath);
+	}
+	ErrorCheckResult ecr = this->errorCheckAt(_file, _filePath, _treePath, nullptr);
 	if (ecr == ECR_ERROR) ;
 	else if (ecr == ECR_ALL_OK) return (fixAttempts == 0) ? EFR_WAS_NOT_BROKEN : EFR_FIXED;
 	else if (ecr == ECR_FILE_NOT_FOUND) return EFR_FILE_NOT_FOUND;
@@ -495,17 +821,19 @@ checkFixed:
 		return EFR_FAILED_TO_FIX;
 	}
 	
-	std::string filePath = this->hashToFilePath(_file);
-	std::string treePath = this->hashToTreePath(_file);
-	std::string parityPath = this->hashToParityPath(_file);
+	std::ifstream treeIfs(_treePath, std::ios::binary);
 	
-	std::shared_ptr<MerkelTree> newTree = generateMerkelTreeFromFilePath(filePath);
+	// The file is hashed again with the leaf size and hash algorithm of its tree, or with the repo's if the tree doesn't tell
+	long leafSize = merkelTreeFileLeafSize(treeIfs);
+	if (leafSize == 0) leafSize = this->leafSize;
+	std::optional<HashAlgorithm> hashAlgorithm = merkelTreeFileHashAlgorithm(treeIfs);
+	if (!hashAlgorithm.has_value()) hashAlgorithm = this->hashAlgorithm;
+	std::shared_ptr<MerkelTree> newTree = generateMerkelTreeFromFilePath(_filePath, -1, this->treeThreads, leafSize, *hashAlgorithm);
 	
-	std::ifstream treeIfs(treePath, std::ios::binary);
-	std::ifstream fileIfs(filePath, std::ios::binary);
-	std::ifstream parityIfs(parityPath, std::ios::binary);
+	std::ifstream fileIfs(_filePath, std::ios::binary);
+	std::ifstream parityIfs(_parityPath, std::ios::binary);
 	
-	MerkelTree storedTree(true);
+	MerkelTree storedTree;
 	try
 	{
 		storedTree = MerkelTree(treeIfs);
@@ -520,7 +848,7 @@ checkFixed:
 		if (*newTree->hash == _file)
 		{
 			// ...just write the new tree to the file.
-			std::ofstream treeOfs(treePath);
+			std::ofstream treeOfs(_treePath);
 			newTree->serialize(treeOfs);
 			treeOfs.close();
 			goto checkFixed;
@@ -538,7 +866,7 @@ checkFixed:
 		
 		treeIfs.close();
 		// ...just write the new tree to the file.
-		std::ofstream treeOfs(treePath);
+		std::ofstream treeOfs(_treePath);
 		newTree->serialize(treeOfs);
 		treeOfs.close();
 		goto checkFixed;
@@ -551,7 +879,7 @@ checkFixed:
 		long pos = treeIfs.tellg();
 		if (pos < 0) exitWithError("tellg() < 0, this should never happen"); // wtf
 		treeIfs.close();
-		std::filesystem::resize_file(treePath, pos);
+		std::filesystem::resize_file(_treePath, pos);
 		goto checkFixed;
 	}
 	
@@ -572,7 +900,7 @@ checkFixed:
 			
 			if (DEBUGGING) printf("File is too long!\r\n");
 			
-			newTree = generateMerkelTreeFromFilePath(filePath, storedTree.getTotalBytes());
+			newTree = generateMerkelTreeFromFilePath(_filePath, storedTree.getTotalBytes(), this->treeThreads, storedTree.getLeafSize(), storedTree.getHashAlgorithm());
 			
 			if (!newTree->errorCheck())
 			{
@@ -585,7 +913,7 @@ checkFixed:
 			{
 				// ...just truncate the file
 				fileIfs.close();
-				std::filesystem::resize_file(filePath, storedTree.getTotalBytes());
+				std::filesystem::resize_file(_filePath, storedTree.getTotalBytes());
 				goto checkFixed;
 			}
 			else
@@ -597,12 +925,16 @@ checkFixed:
 				{
 					if (storedTreeBlockHashes[blockIndex] != newTreeBlockHashes[blockIndex])
 					{
-						char buff[1024];
-						fileIfs.seekg(blockIndex * 1024, fileIfs.beg);
-						fileIfs.read(&buff[0], 1024);
+						long blockSize = storedTree.getLeafSize();
+						if (blockSize > ERRFIX_BRUTE_FORCE_MAX_LEAF_BYTES) continue;
+						
+						char buff[ERRFIX_BRUTE_FORCE_MAX_LEAF_BYTES];
+						fileIfs.seekg(blockIndex * blockSize, fileIfs.beg);
+						fileIfs.read(&buff[0], blockSize);
 						int amountRead = fileIfs.gcount();
 						
-						if (tryFixBlockUsingHash(&buff[0], amountRead, storedTreeBlockHashes[blockIndex]) == true)
+						LeafHasher hasher(storedTree.getHashAlgorithm(), blockSize, blockIndex);
+						if (tryFixBlockUsingHash(&buff[0], amountRead, hasher, storedTreeBlockHashes[blockIndex], this->errfixThreads) == true)
 						{
 							// YAY :)
 							// Write the correct block to the file
@@ -615,14 +947,14 @@ checkFixed:
 							fileIfs.close();
 							
 							{
-								std::fstream fileIOfs(filePath, std::ios::in | std::ios::out | std::ios::binary);
+								std::fstream fileIOfs(_filePath, std::ios::in | std::ios::out | std::ios::binary);
 								fileIOfs.seekg(pos-amountRead, std::ios_base::beg);
 								fileIOfs.write(&buff[0], amountRead);
 								if (fileIOfs.tellg() != pos) exitWithError("askaskdjdsjkaf");
 								fileIOfs.close();
 							}
 							
-							fileIfs = std::ifstream(filePath, std::ios::in | std::ios::binary);
+							fileIfs = std::ifstream(_filePath, std::ios::in | std::ios::binary);
 							fileIfs.seekg(pos);
 							if (fileIfs.tellg() != pos) exitWithError("askaskdjdsjkaf");
 						}
@@ -646,27 +978,26 @@ checkFixed:
 			
 			if (DEBUGGING) printf("File has the correct length!\r\n");
 			
-			// Search for the corruption, block by block.
+			// Search for the corruption, block by block. Blocks are the leaves of the tree.
 			
 			std::vector<std::array<char, 32>> blockhashes = storedTree.listBlockHashes();
+			std::vector<long> badBlocks;
 			
-			char buff[1024];
+			long blockSize = storedTree.getLeafSize();
+			std::vector<char> buff(blockSize);
 			std::array<char, 32> hashFromFile;
 			
-			for (long blockIndex=0; blockIndex<blockhashes.size(); blockIndex++)
+			fileIfs.seekg(0, fileIfs.beg);
+			for (long blockIndex=0; blockIndex<(long)blockhashes.size(); blockIndex++)
 			{
-				fileIfs.seekg(blockIndex * 1024, fileIfs.beg);
-				fileIfs.read(&buff[0], 1024);
+				fileIfs.read(&buff[0], blockSize);
 				int amountRead = fileIfs.gcount();
 				if (amountRead <= 0) exitWithError("fileIfs.gcount() <= 0");
-				SHA256 sha256;
-				sha256.init();
-				sha256.update((const unsigned char*)&buff[0], amountRead);
-				sha256.final((unsigned char*)hashFromFile.data());
+				hashFromFile = hashLeaf(storedTree.getHashAlgorithm(), &buff[0], amountRead, blockSize, blockIndex);
 				
-				if (amountRead != 1024)
+				if (amountRead != blockSize)
 				{
-					if (blockIndex != blockhashes.size()-1)
+					if (blockIndex != (long)blockhashes.size()-1)
 					{
 						printf("The file cannot be fully read. errorFix() is confused and cannot continue.\r\n");
 						return EFR_FAILED_TO_FIX;
@@ -682,72 +1013,60 @@ checkFixed:
 						std::string fs = bytes_to_hex(hashFromFile);
 						std::string ts = bytes_to_hex(blockhashes[blockIndex]);
 						
-						printf("Mischief found in blockIndex=%i hashFromFile=%s hash from tree=%s amountRead=%i!\r\n", blockIndex, fs.c_str(), ts.c_str(), amountRead);
+						printf("Mischief found in blockIndex=%li hashFromFile=%s hash from tree=%s amountRead=%i!\r\n", blockIndex, fs.c_str(), ts.c_str(), amountRead);
 					}
 					
-					if (tryFixBlockUsingHash(&buff[0], amountRead, blockhashes[blockIndex]) == true)
-					{
-						// YAY :)
-						// Write the correct block to the file
-						
-						if (DEBUGGING) printf("Mischief fixed using hash :D\r\n");
-						
-						//long pos = fileIfs.tellg();
-						//if (pos <= 0) exitWithError("askdjfjkasdfjkdsf");
-						long pos = blockIndex * 1024 + amountRead;
-						
-						fileIfs.close();
-						
-						{
-							std::fstream fileIOfs(filePath, std::ios::in | std::ios::out | std::ios::binary);
-							fileIOfs.seekg(pos-amountRead, std::ios_base::beg);
-							fileIOfs.write(&buff[0], amountRead);
-							if (fileIOfs.tellg() != pos) { printf("pos=%i fileIOfs.tellg()=%i\r\n", (int)pos, (int)fileIOfs.tellg()); exitWithError("askaskdjdsjkaf"); }
-							fileIOfs.close();
-						}
-						
-						fileIfs = std::ifstream(filePath, std::ios::in | std::ios::binary);
-						fileIfs.seekg(pos);
-						if (fileIfs.tellg() != pos) exitWithError("askaskdjdsjkaf fileIfs.tellg() != pos");
-						
-						/*
-						fileIfs.seekg(-amountRead, std::ios_base::cur);
-						fileIfs.write(&buff[0], amountRead);
-						*/
-					}
-					else if (tryFixBlockUsingParityAndHash(filePath, fileIfs, parityIfs, blockIndex, &buff[0], amountRead, blockhashes[blockIndex]))
-					{
-						if (DEBUGGING) printf("Mischief fixed using parity :D\r\n");
-						
-						
-						//long pos = fileIfs.tellg();
-						//if (pos <= 0) exitWithError("askdjfjkasdfjkdsf");
-						long pos = blockIndex * 1024 + amountRead;
-						
-						fileIfs.close();
-						
-						{
-							std::fstream fileIOfs(filePath, std::ios::in | std::ios::out | std::ios::binary);
-							fileIOfs.seekg(pos-amountRead, std::ios_base::beg);
-							fileIOfs.write(&buff[0], amountRead);
-							if (fileIOfs.tellg() != pos) { printf("pos=%i fileIOfs.tellg()=%i\r\n", (int)pos, (int)fileIOfs.tellg()); exitWithError("askaskdjdsjkaf"); }
-							fileIOfs.close();
-						}
-						
-						fileIfs = std::ifstream(filePath, std::ios::in | std::ios::binary);
-						fileIfs.seekg(pos);
-						if (fileIfs.tellg() != pos) exitWithError("askaskdjdsjkaf fileIfs.tellg() != pos");
-						
-						/*fileIfs.seekg(-amountRead, std::ios_base::cur);
-						fileIfs.write(&buff[0], amountRead);*/
-					}
-					else
-					{
-						return EFR_FAILED_TO_FIX;
-					}
+					badBlocks.push_back(blockIndex);
+				}
+			}
+			
+			// First rebuild what the parity can rebuild, all damaged blocks in one pass over the file
+			std::map<long, std::vector<char>> fixedBlocks = reconstructLeavesFromParity(fileIfs, currentFileLength, parityIfs, badBlocks, blockhashes, blockSize, storedTree.getHashAlgorithm());
+			if (DEBUGGING) printf("Mischief fixed using parity in %lu of %lu blocks\r\n", fixedBlocks.size(), badBlocks.size());
+			
+			// Then try to repair the rest by brute force
+			bool fixedUsingHash = false;
+			for (long blockIndex : badBlocks)
+			{
+				if (fixedBlocks.count(blockIndex) != 0) continue;
+				if (blockSize > ERRFIX_BRUTE_FORCE_MAX_LEAF_BYTES) continue;
+				
+				int blockBytes = (int)std::min(blockSize, currentFileLength - blockIndex * blockSize);
+				fileIfs.clear();
+				fileIfs.seekg(blockIndex * blockSize, fileIfs.beg);
+				readExactly(fileIfs, &buff[0], blockBytes);
+				
+				LeafHasher hasher(storedTree.getHashAlgorithm(), blockSize, blockIndex);
+				if (tryFixBlockUsingHash(&buff[0], blockBytes, hasher, blockhashes[blockIndex], this->errfixThreads) == true)
+				{
+					// YAY :)
+					if (DEBUGGING) printf("Mischief fixed using hash :D\r\n");
+					fixedBlocks[blockIndex] = std::vector<char>(&buff[0], &buff[blockBytes]);
+					fixedUsingHash = true;
 				}
 			}
 			
+			fileIfs.close();
+			
+			// Write the correct blocks to the file
+			if (!fixedBlocks.empty())
+			{
+				std::fstream fileIOfs(_filePath, std::ios::in | std::ios::out | std::ios::binary);
+				for (const auto& [blockIndex, block] : fixedBlocks)
+				{
+					fileIOfs.seekp(blockIndex * blockSize, std::ios_base::beg);
+					fileIOfs.write(block.data(), block.size());
+				}
+				fileIOfs.close();
+				if (fileIOfs.fail()) exitWithError("Failed to write fixed blocks to " + _filePath);
+			}
+			
+			// Blocks fixed by brute force may make more blocks rebuildable from parity in the next attempt
+			if (fixedBlocks.size() != badBlocks.size() && !fixedUsingHash)
+			{
+				return EFR_FAILED_TO_FIX;
+			}
+			
 			fileIfs.close();
 			treeIfs.close();
 			goto checkFixed;
@@ -766,3 +1085,134 @@ checkFixed:
 	treeIfs.close();
 	goto checkFixed;
 }
+
+ErrorFixResult Repository::errorFixPacked(const std::array<char, 32>& _file, const PackEntry& _entry)
+{
+	if (this->errorCheckPacked(_file, _entry, nullptr) == ECR_ALL_OK) return EFR_WAS_NOT_BROKEN;
+	
+	// The entry is taken out of the pack as temporary files, fixed the same way as any other file, and written back
+	PackedBlob blob;
+	this->packStore.read(_file, _entry, blob);
+	if ((long)blob.data.size() != _entry.dataBytes) return EFR_FAILED_TO_FIX;
+	
+	std::string tempPath = this->path + "/.fmtmp-" + generate_uuid_v4();
+	std::string tempFiles[3] = {tempPath, tempPath + ".fmtree", tempPath + ".fmparity"};
+	auto removeTempFiles = [&](){
+		for (const std::string& tempFile : tempFiles) std::filesystem::remove(tempFile);
+	};
+	
+	const char* parts[3] = {blob.data.data(), blob.tree.data(), blob.parity.data()};
+	size_t partBytes[3] = {blob.data.size(), blob.tree.size(), blob.parity.size()};
+	for (int i=0; i<3; i++)
+	{
+		std::ofstream ofs(tempFiles[i], std::ios::binary);
+		ofs.write(parts[i], partBytes[i]);
+		ofs.close();
+		if (ofs.fail())
+		{
+			removeTempFiles();
+			exitWithError("Failed to write to temporary file " + tempFiles[i]);
+		}
+	}
+	
+	ErrorFixResult result = this->errorFixAt(_file, tempFiles[0], tempFiles[1], tempFiles[2]);
+	
+	// If only the entry's header was damaged, the files taken out of it are fine
+	if (result == EFR_FIXED || result == EFR_WAS_NOT_BROKEN)
+	{
+		PackedBlob fixed;
+		std::string* fixedParts[3] = {nullptr, &fixed.tree, &fixed.parity};
+		for (int i=0; i<3; i++)
+		{
+			std::ifstream ifs(tempFiles[i], std::ios::binary);
+			std::string contents((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+			if (fixedParts[i] != nullptr) *fixedParts[i] = std::move(contents);
+			else fixed.data.assign(contents.begin(), contents.end());
+		}
+		this->packStore.replace(_file, _entry, fixed);
+		
+		std::optional<PackEntry> entry = this->packStore.lookup(_file);
+		result = (entry.has_value() && this->errorCheckPacked(_file, *entry, nullptr) == ECR_ALL_OK) ? EFR_FIXED : EFR_FAILED_TO_FIX;
+	}
+	
+	removeTempFiles();
+	return result;
+}
+
+TreeMigrationResult Repository::migrateTree(std::array<char, 32> _file)
+{
+	std::string treePath = this->hashToTreePath(_file, false);
+	
+	std::ifstream treeIfs(treePath, std::ios::binary);
+	if (!treeIfs.is_open())
+	{
+		// Packed trees are always written in the current format
+		return this->packStore.lookup(_file).has_value() ? TMR_ALREADY_CURRENT : TMR_NOT_FOUND;
+	}
+	if (merkelTreeFileVersion(treeIfs) == 2) return TMR_ALREADY_CURRENT;
+	
+	MerkelTree tree;
+	try
+	{
+		tree = MerkelTree(treeIfs);
+	}
+	catch (Error_MerkelTreeFileCorrupted)
+	{
+		return TMR_FAILED;
+	}
+	treeIfs.close();
+	
+	// Damaged trees are left alone, so that --errfix can still rebuild them from the file
+	if (!tree.errorCheck() || *tree.hash != _file) return TMR_FAILED;
+	
+	std::string tempTreePath = this->path + "/.fmtmp-" + generate_uuid_v4();
+	{
+		std::ofstream tempOfs(tempTreePath, std::ios::binary);
+		if (!tempOfs.is_open()) exitWithError("Failed to create temporary file " + tempTreePath);
+		tree.serialize(tempOfs);
+		tempOfs.close();
+		if (tempOfs.fail())
+		{
+			std::filesystem::remove(tempTreePath);
+			exitWithError("Failed to write to temporary file " + tempTreePath);
+		}
+	}
+	
+	std::error_code ec;
+	std::filesystem::rename(tempTreePath, treePath, ec);
+	if (ec)
+	{
+		std::filesystem::remove(tempTreePath);
+		exitWithError("Failed to replace " + treePath + ": " + ec.message());
+	}
+	
+	return TMR_MIGRATED;
+}
+
+std::vector<std::array<char, 32>> Repository::listFiles()
+{
+	std::vector<std::array<char, 32>> ret;
+	
+	// Files live at aa/bb/cc/HASHHEX, next to their .fmtree and .fmparity
+	for (const auto& entry : std::filesystem::recursive_directory_iterator(this->path))
+	{
+		if (!entry.is_regular_file()) continue;
+		
+		std::string fileName = entry.path().filename().string();
+		if (fileName.length() != 64) continue;
+		if (!std::all_of(fileName.begin(), fileName.end(), [](char c){ return std::isxdigit((unsigned char)c); })) continue;
+		
+		std::array<char, 32> hash;
+		if (hex_to_bytes(fileName.c_str(), hash) != 32) continue;
+		if (entry.path().parent_path().filename().string() != fileName.substr(4, 2)) continue;
+		
+		ret.push_back(hash);
+	}
+	
+	// A file that was packed, and later added again loose, is listed once
+	std::vector<std::array<char, 32>> packed = this->packStore.list();
+	ret.insert(ret.end(), packed.begin(), packed.end());
+	std::sort(ret.begin(), ret.end());
+	ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+	return ret;
+}
@@ -2,6 +2,28 @@
 
 #include <string>
 #include <map>
+#include <array>
+#include <mutex>
+#include <vector>
+#include <optional>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+#include "placement.h"
+#include "stat_cache.h"
+#include "parity.h"
+#include "reed_solomon.h"
+#include "pack_store.h"
+#include "merkel_tree.h"
+
+class IoSlots;
+
+// Files live in a three-level fanout aa/bb/cc/ by the first three bytes of their hash. Every directory of it gets a bit,
+// in this order: 256 aa, 65536 aa/bb, then 16777216 aa/bb/cc.
+#define FANOUT_LEVEL2_BITS_OFFSET 256L
+#define FANOUT_LEVEL3_BITS_OFFSET (256L + 65536L)
+#define FANOUT_TOTAL_BITS (256L + 65536L + 16777216L)
 
 enum ErrorCheckResult
 {
@@ -18,6 +40,14 @@ enum ErrorFixResult
 	EFR_FILE_NOT_FOUND
 };
 
+enum TreeMigrationResult
+{
+	TMR_MIGRATED,
+	TMR_ALREADY_CURRENT,
+	TMR_FAILED,
+	TMR_NOT_FOUND
+};
+
 class Repository
 {
 private:
@@ -26,13 +56,80 @@ private:
 	
 	std::string config_file;
 	
-	std::string hashToTreePath(const std::array<char, 32>& _hash);
-	std::string hashToParityPath(const std::array<char, 32>& _hash);
+	std::mutex placementMutex;
+	
+	// From placement= in fmrepo.conf, defaults to copy
+	PlacementStrategy placementStrategy = PS_COPY;
+	
+	// Remembers the hash of every added source file, so unchanged files aren't hashed again. Disabled with stat_cache=false.
+	bool useStatCache = true;
+	StatCache statCache;
+	
+	// From parity_overhead= (percent of the file size) and parity_max_divisor= in fmrepo.conf
+	std::optional<double> parityOverheadPercent;
+	int parityMaxDivisor = PARITY_DEFAULT_MAX_DIVISOR;
+	
+	// parity=reed_solomon in fmrepo.conf, with reed_solomon_data_blocks= and reed_solomon_parity_blocks= per stripe
+	bool useReedSolomonParity = false;
+	int reedSolomonDataBlocks = REED_SOLOMON_DEFAULT_DATA_BLOCKS;
+	int reedSolomonParityBlocks = REED_SOLOMON_DEFAULT_PARITY_BLOCKS;
+	
+	// From leaf_size= in fmrepo.conf. The hash of a file depends on it, so changing it only affects files added afterwards.
+	int leafSize = MERKEL_DEFAULT_LEAF_SIZE;
+	
+	// From hash= in fmrepo.conf, sha256 or blake3. Just like the leaf size, it only affects files added afterwards.
+	HashAlgorithm hashAlgorithm = DEFAULT_HASH_ALGORITHM;
+	
+	// Files smaller than pack_threshold= bytes in fmrepo.conf are added to pack files instead of getting their own three files.
+	// 0 disables packing, but blobs that were packed before stay where they are.
+	long packThreshold = 0;
+	PackStore packStore;
+	
+	// The repository directory, opened once. Fanout directories are created relative to it.
+	int rootFd = -1;
+	
+	// One bit per fanout directory that is known to exist, so each one is only checked or created once
+	std::unique_ptr<std::atomic<uint64_t>[]> knownDirectories;
+	bool isKnownDirectory(long _bit) const;
+	void ensureFanoutDirectories(const std::array<char, 32>& _hash);
+	
+	// Path of the file with hash _hash plus _suffix, built in a single allocation.
+	// Its fanout directories are created, unless the path is only used to look for an existing file.
+	std::string hashToPath(const std::array<char, 32>& _hash, const char* _suffix, bool _createDirectories = true);
+	
+	std::string hashToTreePath(const std::array<char, 32>& _hash, bool _createDirectories = true);
+	std::string hashToParityPath(const std::array<char, 32>& _hash, bool _createDirectories = true);
+	
+	// Returns whether the blob was new to the repo
+	bool addPacked(const std::array<char, 32>& _hash, const std::string& _destFilePath, std::vector<char>&& _data, const MerkelTree& _tree, const ParityEncoder& _parity);
+	void rememberSourceFile(const std::string& _path, const FileStat& _sourceStat, const std::array<char, 32>& _hash);
+	
+	ErrorCheckResult errorCheckAt(const std::array<char, 32>& _file, const std::string& _filePath, const std::string& _treePath, IoSlots* _ioSlots);
+	ErrorCheckResult errorCheckPacked(const std::array<char, 32>& _file, const PackEntry& _entry, IoSlots* _ioSlots);
+	ErrorFixResult errorFixAt(const std::array<char, 32>& _file, const std::string& _filePath, const std::string& _treePath, const std::string& _parityPath);
+	ErrorFixResult errorFixPacked(const std::array<char, 32>& _file, const PackEntry& _entry);
 
 public:
+	// Amount of threads used to hash the merkel tree of a single large file
+	int treeThreads = 1;
+	
+	// Amount of threads used to search for the fix of a single damaged block
+	int errfixThreads = 1;
+	
 	Repository(std::string _path);
+	~Repository();
+	Repository(const Repository&) = delete;
+	Repository& operator=(const Repository&) = delete;
 	std::pair<std::array<char, 32>, bool> add(const std::string& _path);
-	ErrorCheckResult errorCheck(std::array<char, 32> _file);
+	
+	// If _ioSlots is given, a slot of it is held during every read from disk
+	ErrorCheckResult errorCheck(std::array<char, 32> _file, IoSlots* _ioSlots = nullptr);
 	ErrorFixResult errorFix(std::array<char, 32> _file);
-	std::string hashToFilePath(const std::array<char, 32>& _hash);
+	
+	// Rewrites the file's .fmtree in the current format, if it is an intact older version
+	TreeMigrationResult migrateTree(std::array<char, 32> _file);
+	
+	// Hashes of all files in the repository
+	std::vector<std::array<char, 32>> listFiles();
+	std::string hashToFilePath(const std::array<char, 32>& _hash, bool _createDirectories = true);
 };
@@ -0,0 +1,158 @@
+#include <memory>
+#include <string>
+#include <array>
+#include <vector>
+#include <tuple>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "util.h"
+#include "scrub.h"
+#include "repository.h"
+
+IoSlots::IoSlots(int _slots) :
+	freeSlots(_slots)
+{
+}
+
+void IoSlots::acquire()
+{
+	std::unique_lock<std::mutex> lock(this->mutex);
+	this->cv.wait(lock, [this]{ return this->freeSlots > 0; });
+	this->freeSlots--;
+}
+
+void IoSlots::release()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->freeSlots++;
+	}
+	this->cv.notify_one();
+}
+
+IoSlotGuard::IoSlotGuard(IoSlots* _slots) :
+	slots(_slots)
+{
+	if (this->slots != nullptr) this->slots->acquire();
+}
+
+IoSlotGuard::~IoSlotGuard()
+{
+	if (this->slots != nullptr) this->slots->release();
+}
+
+ScrubOrder parseScrubOrder(const std::string& _name)
+{
+	if (_name == "location") return SO_LOCATION;
+	if (_name == "size") return SO_SIZE;
+	if (_name == "none") return SO_NONE;
+	exitWithError("Unknown errcheck order: " + _name + " (expected location, size or none)");
+	return SO_NONE;
+}
+
+// Files that can't be opened sort first, they are reported as not found without reading anything
+struct ScrubSortKey
+{
+	long device = -1;
+	long physical = -1;
+	long inode = -1;
+	long size = -1;
+};
+
+static ScrubSortKey scrubSortKey(const std::string& _path, ScrubOrder _order)
+{
+	ScrubSortKey key;
+	
+	int fd = open(_path.c_str(), O_RDONLY);
+	if (fd < 0) return key;
+	
+	struct stat st;
+	if (fstat(fd, &st) == 0)
+	{
+		key.device = st.st_dev;
+		key.inode = st.st_ino;
+		key.size = st.st_size;
+	}
+	
+	if (_order == SO_LOCATION)
+	{
+		// Only the first extent is needed, the rest of a file usually follows it
+		alignas(struct fiemap) char request[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+		struct fiemap* map = (struct fiemap*)request;
+		map->fm_start = 0;
+		map->fm_length = FIEMAP_MAX_OFFSET;
+		map->fm_extent_count = 1;
+		if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents == 1)
+		{
+			key.physical = map->fm_extents[0].fe_physical;
+		}
+	}
+	
+	close(fd);
+	return key;
+}
+
+std::vector<ErrorCheckResult> errorCheckFiles(
+	std::shared_ptr<Repository> _repository,
+	const std::vector<std::array<char, 32>>& _hashes,
+	int _threads,
+	int _ioSlots,
+	ScrubOrder _order
+)
+{
+	std::vector<ErrorCheckResult> results(_hashes.size());
+	
+	// Runs _work(i) for every index i on _threads threads, which take the next index from a shared counter
+	auto runOnThreads = [_threads](size_t _amount, auto _work){
+		std::atomic<size_t> nextIndex(0);
+		auto workNext = [&](){
+			for (size_t i = nextIndex++; i < _amount; i = nextIndex++) _work(i);
+		};
+		std::vector<std::thread> threads;
+		for (int t=1; t<_threads; t++) threads.emplace_back(workNext);
+		workNext();
+		for (auto& thread : threads) thread.join();
+	};
+	
+	std::vector<size_t> order(_hashes.size());
+	for (size_t i=0; i<order.size(); i++) order[i] = i;
+	
+	if (_order != SO_NONE)
+	{
+		std::vector<ScrubSortKey> keys(_hashes.size());
+		runOnThreads(_hashes.size(), [&](size_t i){
+			keys[i] = scrubSortKey(_repository->hashToFilePath(_hashes[i], false), _order);
+		});
+		
+		if (_order == SO_LOCATION)
+		{
+			std::stable_sort(order.begin(), order.end(), [&keys](size_t a, size_t b){
+				return std::tie(keys[a].device, keys[a].physical, keys[a].inode) < std::tie(keys[b].device, keys[b].physical, keys[b].inode);
+			});
+		}
+		else
+		{
+			std::stable_sort(order.begin(), order.end(), [&keys](size_t a, size_t b){
+				return keys[a].size > keys[b].size;
+			});
+		}
+	}
+	
+	IoSlots ioSlots(_ioSlots);
+	runOnThreads(order.size(), [&](size_t i){
+		results[order[i]] = _repository->errorCheck(_hashes[order[i]], &ioSlots);
+	});
+	
+	return results;
+}
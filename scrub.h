@@ -0,0 +1,67 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <array>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#include "repository.h"
+
+// Repository::errorCheck reads files in chunks of this many bytes, holding an I/O slot while waiting for each chunk.
+// Every chunk but the last must be whole leaves, so this is a multiple of every leaf size.
+#define ERRCHECK_READ_BUFFER_BYTES (4L << 20)
+static_assert(ERRCHECK_READ_BUFFER_BYTES % MERKEL_MAX_LEAF_SIZE == 0, "ERRCHECK_READ_BUFFER_BYTES must be a multiple of every leaf size");
+
+// Limits how many threads read from disk at the same time, independent of how many threads there are
+class IoSlots
+{
+private:
+	std::mutex mutex;
+	std::condition_variable cv;
+	int freeSlots;
+public:
+	IoSlots(int _slots);
+	
+	// Blocks until a slot is free
+	void acquire();
+	void release();
+};
+
+// Holds a slot of _slots for as long as it exists. Does nothing if _slots is nullptr.
+class IoSlotGuard
+{
+private:
+	IoSlots* slots;
+public:
+	IoSlotGuard(IoSlots* _slots);
+	~IoSlotGuard();
+	IoSlotGuard(const IoSlotGuard&) = delete;
+	IoSlotGuard& operator=(const IoSlotGuard&) = delete;
+};
+
+// The order in which errorCheckFiles reads the files, set with --errcheck-order=
+//   location - by device, then by the physical offset of the first extent (or by inode if the filesystem can't tell),
+//              so a spinning disk reads mostly forward
+//   size     - largest first, so the last big file doesn't run on its own at the end
+//   none     - in the order the files were selected
+enum ScrubOrder
+{
+	SO_LOCATION,
+	SO_SIZE,
+	SO_NONE
+};
+
+// Exits with an error if _name is not a known order
+ScrubOrder parseScrubOrder(const std::string& _name);
+
+// Runs Repository::errorCheck on every file in _hashes using _threads threads, of which at most _ioSlots read
+// from disk at the same time. Returns the result of every file in the same order as _hashes.
+std::vector<ErrorCheckResult> errorCheckFiles(
+	std::shared_ptr<Repository> _repository,
+	const std::vector<std::array<char, 32>>& _hashes,
+	int _threads,
+	int _ioSlots,
+	ScrubOrder _order
+);
@@ -1,9 +1,23 @@
 #include <cstring>
+#include <vector>
 
 #include "sha256.h"
 #include "util.h" 
 
-const unsigned int SHA256::sha256_k[64] = //UL = uint32
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA256_X86 1
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+#define SHA256_ARM 1
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+alignas(16) static constexpr unsigned int sha256_k[64] = //UL = uint32
 { 0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
@@ -21,12 +35,42 @@ const unsigned int SHA256::sha256_k[64] = //UL = uint32
  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
 
-SHA256::SHA256()
+typedef unsigned char uint8;
+typedef unsigned int uint32;
+
+#define SHA256_H0 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+
+////////////////////////////////////////////
+//// 64-byte messages
+//// A merkel tree node hashes exactly two 32-byte child hashes. The second block of every 64-byte message is the same
+//// padding block (0x80, zeroes, and the bit length 512), so its message schedule is known at compile time and
+//// compressing it is just the rounds, with the round constants already added in.
+
+alignas(16) static const unsigned char sha256_padding64[64] = { 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0x00 };
+
+struct SHA256Padding64Schedule
 {
-	this->init();
-}
+	uint32 kw[64];
+	
+	constexpr SHA256Padding64Schedule():
+		kw()
+	{
+		uint32 w[64] = { 0x80000000 };
+		w[15] = 512;
+		for (int j = 16; j < 64; j++) w[j] = SHA256_F4(w[j - 2]) + w[j - 7] + SHA256_F3(w[j - 15]) + w[j - 16];
+		for (int j = 0; j < 64; j++) kw[j] = sha256_k[j] + w[j];
+	}
+};
 
-void SHA256::transform(const unsigned char* message, unsigned int block_nb)
+alignas(64) static constexpr SHA256Padding64Schedule sha256_padding64Schedule;
+
+////////////////////////////////////////////
+//// Portable backend
+
+static void transform_scalar(uint32* m_h, const unsigned char* message, unsigned int block_nb)
 {
 	uint32 w[64];
 	uint32 wv[8];
@@ -64,6 +108,778 @@ void SHA256::transform(const unsigned char* message, unsigned int block_nb)
 	}
 }
 
+static void compressPadding64_scalar(uint32* m_h)
+{
+	uint32 wv[8];
+	for (int j = 0; j < 8; j++) wv[j] = m_h[j];
+	for (int j = 0; j < 64; j++)
+	{
+		uint32 t1 = wv[7] + SHA256_F2(wv[4]) + SHA2_CH(wv[4], wv[5], wv[6]) + sha256_padding64Schedule.kw[j];
+		uint32 t2 = SHA256_F1(wv[0]) + SHA2_MAJ(wv[0], wv[1], wv[2]);
+		wv[7] = wv[6];
+		wv[6] = wv[5];
+		wv[5] = wv[4];
+		wv[4] = wv[3] + t1;
+		wv[3] = wv[2];
+		wv[2] = wv[1];
+		wv[1] = wv[0];
+		wv[0] = t1 + t2;
+	}
+	for (int j = 0; j < 8; j++) m_h[j] += wv[j];
+}
+
+#ifdef SHA256_X86
+
+////////////////////////////////////////////
+//// x86 AVX2 backend
+//// Computes the message schedule 4 words at a time, and uses BMI2 rorx in the rounds.
+
+#define SHA256_AVX2_ROTR(x, n) _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n))
+#define SHA256_AVX2_F3(x) _mm_xor_si128(_mm_xor_si128(SHA256_AVX2_ROTR(x, 7), SHA256_AVX2_ROTR(x, 18)), _mm_srli_epi32(x, 3))
+#define SHA256_AVX2_F4(x) _mm_xor_si128(_mm_xor_si128(SHA256_AVX2_ROTR(x, 17), SHA256_AVX2_ROTR(x, 19)), _mm_srli_epi32(x, 10))
+
+__attribute__((target("avx2,bmi2")))
+static void transform_avx2(uint32* m_h, const unsigned char* message, unsigned int block_nb)
+{
+	alignas(16) uint32 w[64];
+	alignas(16) uint32 wk[64];
+	uint32 wv[8];
+	const __m128i byteSwap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	
+	for (unsigned int i = 0; i < block_nb; i++)
+	{
+		const unsigned char* sub_block = message + (i << 6);
+		
+		for (int j = 0; j < 16; j += 4)
+		{
+			__m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&sub_block[j << 2]), byteSwap);
+			_mm_store_si128((__m128i*)&w[j], x);
+			_mm_store_si128((__m128i*)&wk[j], _mm_add_epi32(x, _mm_load_si128((const __m128i*)&sha256_k[j])));
+		}
+		
+		for (int j = 16; j < 64; j += 4)
+		{
+			// w[j..j+3] = F4(w[j-2..j+1]) + w[j-7..j-4] + F3(w[j-15..j-12]) + w[j-16..j-13]
+			// w[j] and w[j+1] are needed for F4 of the upper two words, so that part is done in two halves.
+			// F4(0) == 0, so the lanes that are not computed yet are left untouched.
+			__m128i x = _mm_add_epi32(
+				_mm_add_epi32(_mm_load_si128((const __m128i*)&w[j - 16]), SHA256_AVX2_F3(_mm_loadu_si128((const __m128i*)&w[j - 15]))),
+				_mm_loadu_si128((const __m128i*)&w[j - 7])
+			);
+			x = _mm_add_epi32(x, SHA256_AVX2_F4(_mm_loadl_epi64((const __m128i*)&w[j - 2])));
+			x = _mm_add_epi32(x, SHA256_AVX2_F4(_mm_slli_si128(x, 8)));
+			_mm_store_si128((__m128i*)&w[j], x);
+			_mm_store_si128((__m128i*)&wk[j], _mm_add_epi32(x, _mm_load_si128((const __m128i*)&sha256_k[j])));
+		}
+		
+		for (int j = 0; j < 8; j++) wv[j] = m_h[j];
+		
+		for (int j = 0; j < 64; j++)
+		{
+			uint32 t1 = wv[7] + SHA256_F2(wv[4]) + SHA2_CH(wv[4], wv[5], wv[6]) + wk[j];
+			uint32 t2 = SHA256_F1(wv[0]) + SHA2_MAJ(wv[0], wv[1], wv[2]);
+			wv[7] = wv[6];
+			wv[6] = wv[5];
+			wv[5] = wv[4];
+			wv[4] = wv[3] + t1;
+			wv[3] = wv[2];
+			wv[2] = wv[1];
+			wv[1] = wv[0];
+			wv[0] = t1 + t2;
+		}
+		
+		for (int j = 0; j < 8; j++) m_h[j] += wv[j];
+	}
+}
+
+////////////////////////////////////////////
+//// x86 SHA-NI backend
+
+__attribute__((target("sha,sse4.1")))
+static void transform_shani(uint32* m_h, const unsigned char* message, unsigned int block_nb)
+{
+	const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	
+	// The sha256rnds2 instruction wants the state as ABEF and CDGH
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&m_h[0]), 0xB1); // CDAB
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&m_h[4]), 0x1B); // EFGH
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0); // CDGH
+	
+	for (unsigned int i = 0; i < block_nb; i++)
+	{
+		const unsigned char* sub_block = message + (i << 6);
+		__m128i abefSave = state0;
+		__m128i cdghSave = state1;
+		
+		// Ring buffer of the last 4 groups of 4 message words
+		__m128i w[4];
+		for (int g = 0; g < 4; g++)
+		{
+			w[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&sub_block[g << 4]), byteSwap);
+		}
+		
+		for (int g = 0; g < 16; g++)
+		{
+			if (g >= 4)
+			{
+				w[g & 3] = _mm_sha256msg2_epu32(
+					_mm_add_epi32(_mm_sha256msg1_epu32(w[g & 3], w[(g + 1) & 3]), _mm_alignr_epi8(w[(g + 3) & 3], w[(g + 2) & 3], 4)),
+					w[(g + 3) & 3]
+				);
+			}
+			__m128i msg = _mm_add_epi32(w[g & 3], _mm_load_si128((const __m128i*)&sha256_k[g << 2]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+		}
+		
+		state0 = _mm_add_epi32(state0, abefSave);
+		state1 = _mm_add_epi32(state1, cdghSave);
+	}
+	
+	tmp = _mm_shuffle_epi32(state0, 0x1B); // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1); // DCHG
+	_mm_storeu_si128((__m128i*)&m_h[0], _mm_blend_epi16(tmp, state1, 0xF0)); // DCBA
+	_mm_storeu_si128((__m128i*)&m_h[4], _mm_alignr_epi8(state1, tmp, 8)); // HGFE
+}
+
+static bool cpuHasAvx2()
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+	if (!(ecx & bit_OSXSAVE)) return false;
+	unsigned int xcr0Low, xcr0High;
+	__asm__("xgetbv" : "=a"(xcr0Low), "=d"(xcr0High) : "c"(0));
+	if ((xcr0Low & 0x6) != 0x6) return false; // OS saves XMM and YMM registers
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+	return (ebx & bit_AVX2) && (ebx & bit_BMI2);
+}
+
+static bool cpuHasShaNi()
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+	if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) return false;
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+	return ebx & bit_SHA;
+}
+
+////////////////////////////////////////////
+//// x86 multi-buffer kernels
+//// Hash 8 (AVX2) or 16 (AVX-512) equal-length messages at once, one message per 32-bit SIMD lane.
+//// Message i of a batch starts at data + i*stride.
+
+#define SHA256_X8_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define SHA256_X8_XOR3(a, b, c) _mm256_xor_si256(_mm256_xor_si256(a, b), c)
+
+__attribute__((target("avx2")))
+static inline void transpose8x8(__m256i r[8])
+{
+	__m256i t[8], u[8];
+	for (int i = 0; i < 4; i++)
+	{
+		t[2 * i] = _mm256_unpacklo_epi32(r[2 * i], r[2 * i + 1]);
+		t[2 * i + 1] = _mm256_unpackhi_epi32(r[2 * i], r[2 * i + 1]);
+	}
+	for (int j = 0; j < 2; j++)
+	{
+		u[4 * j + 0] = _mm256_unpacklo_epi64(t[4 * j], t[4 * j + 2]);
+		u[4 * j + 1] = _mm256_unpackhi_epi64(t[4 * j], t[4 * j + 2]);
+		u[4 * j + 2] = _mm256_unpacklo_epi64(t[4 * j + 1], t[4 * j + 3]);
+		u[4 * j + 3] = _mm256_unpackhi_epi64(t[4 * j + 1], t[4 * j + 3]);
+	}
+	for (int m = 0; m < 4; m++)
+	{
+		r[m] = _mm256_permute2x128_si256(u[m], u[4 + m], 0x20);
+		r[4 + m] = _mm256_permute2x128_si256(u[m], u[4 + m], 0x31);
+	}
+}
+
+__attribute__((target("avx2")))
+static void compress_x8(__m256i state[8], const unsigned char* _data, unsigned int _stride, unsigned int _blocks)
+{
+	const __m256i byteSwap = _mm256_set_epi8(
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3
+	);
+	
+	for (unsigned int b = 0; b < _blocks; b++)
+	{
+		__m256i w[16];
+		for (int half = 0; half < 2; half++)
+		{
+			for (int lane = 0; lane < 8; lane++)
+			{
+				w[half * 8 + lane] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(_data + lane * (size_t)_stride + b * 64 + half * 32)), byteSwap);
+			}
+			transpose8x8(&w[half * 8]);
+		}
+		
+		__m256i a = state[0], bb = state[1], c = state[2], d = state[3];
+		__m256i e = state[4], f = state[5], g = state[6], h = state[7];
+		
+		for (int t = 0; t < 64; t++)
+		{
+			if (t >= 16)
+			{
+				__m256i w2 = w[(t - 2) & 15];
+				__m256i w15 = w[(t - 15) & 15];
+				__m256i s1 = SHA256_X8_XOR3(SHA256_X8_ROTR(w2, 17), SHA256_X8_ROTR(w2, 19), _mm256_srli_epi32(w2, 10));
+				__m256i s0 = SHA256_X8_XOR3(SHA256_X8_ROTR(w15, 7), SHA256_X8_ROTR(w15, 18), _mm256_srli_epi32(w15, 3));
+				w[t & 15] = _mm256_add_epi32(_mm256_add_epi32(w[t & 15], s0), _mm256_add_epi32(w[(t - 7) & 15], s1));
+			}
+			
+			__m256i S1 = SHA256_X8_XOR3(SHA256_X8_ROTR(e, 6), SHA256_X8_ROTR(e, 11), SHA256_X8_ROTR(e, 25));
+			__m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+			__m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, S1), _mm256_add_epi32(ch, _mm256_add_epi32(w[t & 15], _mm256_set1_epi32(sha256_k[t]))));
+			__m256i S0 = SHA256_X8_XOR3(SHA256_X8_ROTR(a, 2), SHA256_X8_ROTR(a, 13), SHA256_X8_ROTR(a, 22));
+			__m256i maj = _mm256_or_si256(_mm256_and_si256(a, bb), _mm256_and_si256(c, _mm256_or_si256(a, bb)));
+			__m256i t2 = _mm256_add_epi32(S0, maj);
+			h = g;
+			g = f;
+			f = e;
+			e = _mm256_add_epi32(d, t1);
+			d = c;
+			c = bb;
+			bb = a;
+			a = _mm256_add_epi32(t1, t2);
+		}
+		
+		state[0] = _mm256_add_epi32(state[0], a);
+		state[1] = _mm256_add_epi32(state[1], bb);
+		state[2] = _mm256_add_epi32(state[2], c);
+		state[3] = _mm256_add_epi32(state[3], d);
+		state[4] = _mm256_add_epi32(state[4], e);
+		state[5] = _mm256_add_epi32(state[5], f);
+		state[6] = _mm256_add_epi32(state[6], g);
+		state[7] = _mm256_add_epi32(state[7], h);
+	}
+}
+
+__attribute__((target("avx2")))
+static void compressPadding64_x8(__m256i state[8])
+{
+	__m256i a = state[0], bb = state[1], c = state[2], d = state[3];
+	__m256i e = state[4], f = state[5], g = state[6], h = state[7];
+	
+	for (int t = 0; t < 64; t++)
+	{
+		__m256i S1 = SHA256_X8_XOR3(SHA256_X8_ROTR(e, 6), SHA256_X8_ROTR(e, 11), SHA256_X8_ROTR(e, 25));
+		__m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+		__m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, S1), _mm256_add_epi32(ch, _mm256_set1_epi32(sha256_padding64Schedule.kw[t])));
+		__m256i S0 = SHA256_X8_XOR3(SHA256_X8_ROTR(a, 2), SHA256_X8_ROTR(a, 13), SHA256_X8_ROTR(a, 22));
+		__m256i maj = _mm256_or_si256(_mm256_and_si256(a, bb), _mm256_and_si256(c, _mm256_or_si256(a, bb)));
+		__m256i t2 = _mm256_add_epi32(S0, maj);
+		h = g;
+		g = f;
+		f = e;
+		e = _mm256_add_epi32(d, t1);
+		d = c;
+		c = bb;
+		bb = a;
+		a = _mm256_add_epi32(t1, t2);
+	}
+	
+	state[0] = _mm256_add_epi32(state[0], a);
+	state[1] = _mm256_add_epi32(state[1], bb);
+	state[2] = _mm256_add_epi32(state[2], c);
+	state[3] = _mm256_add_epi32(state[3], d);
+	state[4] = _mm256_add_epi32(state[4], e);
+	state[5] = _mm256_add_epi32(state[5], f);
+	state[6] = _mm256_add_epi32(state[6], g);
+	state[7] = _mm256_add_epi32(state[7], h);
+}
+
+// GCC 12 warns about the deliberately undefined source operands inside its own AVX-512 intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+#define SHA256_X16_XOR3(a, b, c) _mm512_ternarylogic_epi32(a, b, c, 0x96)
+
+__attribute__((target("avx512f,avx512bw")))
+static inline void transpose16x16(__m512i r[16])
+{
+	__m512i t[16], u[16];
+	for (int i = 0; i < 8; i++)
+	{
+		t[2 * i] = _mm512_unpacklo_epi32(r[2 * i], r[2 * i + 1]);
+		t[2 * i + 1] = _mm512_unpackhi_epi32(r[2 * i], r[2 * i + 1]);
+	}
+	for (int j = 0; j < 4; j++)
+	{
+		u[4 * j + 0] = _mm512_unpacklo_epi64(t[4 * j], t[4 * j + 2]);
+		u[4 * j + 1] = _mm512_unpackhi_epi64(t[4 * j], t[4 * j + 2]);
+		u[4 * j + 2] = _mm512_unpacklo_epi64(t[4 * j + 1], t[4 * j + 3]);
+		u[4 * j + 3] = _mm512_unpackhi_epi64(t[4 * j + 1], t[4 * j + 3]);
+	}
+	// u[4j+m] holds word 4k+m of messages 4j..4j+3 in its 128-bit lane k; transpose the 128-bit lanes
+	for (int m = 0; m < 4; m++)
+	{
+		__m512i x0 = _mm512_shuffle_i32x4(u[m], u[4 + m], 0x44);
+		__m512i x1 = _mm512_shuffle_i32x4(u[m], u[4 + m], 0xEE);
+		__m512i y0 = _mm512_shuffle_i32x4(u[8 + m], u[12 + m], 0x44);
+		__m512i y1 = _mm512_shuffle_i32x4(u[8 + m], u[12 + m], 0xEE);
+		r[m] = _mm512_shuffle_i32x4(x0, y0, 0x88);
+		r[4 + m] = _mm512_shuffle_i32x4(x0, y0, 0xDD);
+		r[8 + m] = _mm512_shuffle_i32x4(x1, y1, 0x88);
+		r[12 + m] = _mm512_shuffle_i32x4(x1, y1, 0xDD);
+	}
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void compress_x16(__m512i state[8], const unsigned char* _data, unsigned int _stride, unsigned int _blocks)
+{
+	const __m512i byteSwap = _mm512_set4_epi32(0x0c0d0e0f, 0x08090a0b, 0x04050607, 0x00010203);
+	
+	for (unsigned int b = 0; b < _blocks; b++)
+	{
+		__m512i w[16];
+		for (int lane = 0; lane < 16; lane++)
+		{
+			w[lane] = _mm512_shuffle_epi8(_mm512_loadu_si512((const void*)(_data + lane * (size_t)_stride + b * 64)), byteSwap);
+		}
+		transpose16x16(w);
+		
+		__m512i a = state[0], bb = state[1], c = state[2], d = state[3];
+		__m512i e = state[4], f = state[5], g = state[6], h = state[7];
+		
+		for (int t = 0; t < 64; t++)
+		{
+			if (t >= 16)
+			{
+				__m512i w2 = w[(t - 2) & 15];
+				__m512i w15 = w[(t - 15) & 15];
+				__m512i s1 = SHA256_X16_XOR3(_mm512_ror_epi32(w2, 17), _mm512_ror_epi32(w2, 19), _mm512_srli_epi32(w2, 10));
+				__m512i s0 = SHA256_X16_XOR3(_mm512_ror_epi32(w15, 7), _mm512_ror_epi32(w15, 18), _mm512_srli_epi32(w15, 3));
+				w[t & 15] = _mm512_add_epi32(_mm512_add_epi32(w[t & 15], s0), _mm512_add_epi32(w[(t - 7) & 15], s1));
+			}
+			
+			__m512i S1 = SHA256_X16_XOR3(_mm512_ror_epi32(e, 6), _mm512_ror_epi32(e, 11), _mm512_ror_epi32(e, 25));
+			__m512i ch = _mm512_ternarylogic_epi32(e, f, g, 0xCA);
+			__m512i t1 = _mm512_add_epi32(_mm512_add_epi32(h, S1), _mm512_add_epi32(ch, _mm512_add_epi32(w[t & 15], _mm512_set1_epi32(sha256_k[t]))));
+			__m512i S0 = SHA256_X16_XOR3(_mm512_ror_epi32(a, 2), _mm512_ror_epi32(a, 13), _mm512_ror_epi32(a, 22));
+			__m512i maj = _mm512_ternarylogic_epi32(a, bb, c, 0xE8);
+			__m512i t2 = _mm512_add_epi32(S0, maj);
+			h = g;
+			g = f;
+			f = e;
+			e = _mm512_add_epi32(d, t1);
+			d = c;
+			c = bb;
+			bb = a;
+			a = _mm512_add_epi32(t1, t2);
+		}
+		
+		state[0] = _mm512_add_epi32(state[0], a);
+		state[1] = _mm512_add_epi32(state[1], bb);
+		state[2] = _mm512_add_epi32(state[2], c);
+		state[3] = _mm512_add_epi32(state[3], d);
+		state[4] = _mm512_add_epi32(state[4], e);
+		state[5] = _mm512_add_epi32(state[5], f);
+		state[6] = _mm512_add_epi32(state[6], g);
+		state[7] = _mm512_add_epi32(state[7], h);
+	}
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void compressPadding64_x16(__m512i state[8])
+{
+	__m512i a = state[0], bb = state[1], c = state[2], d = state[3];
+	__m512i e = state[4], f = state[5], g = state[6], h = state[7];
+	
+	for (int t = 0; t < 64; t++)
+	{
+		__m512i S1 = SHA256_X16_XOR3(_mm512_ror_epi32(e, 6), _mm512_ror_epi32(e, 11), _mm512_ror_epi32(e, 25));
+		__m512i ch = _mm512_ternarylogic_epi32(e, f, g, 0xCA);
+		__m512i t1 = _mm512_add_epi32(_mm512_add_epi32(h, S1), _mm512_add_epi32(ch, _mm512_set1_epi32(sha256_padding64Schedule.kw[t])));
+		__m512i S0 = SHA256_X16_XOR3(_mm512_ror_epi32(a, 2), _mm512_ror_epi32(a, 13), _mm512_ror_epi32(a, 22));
+		__m512i maj = _mm512_ternarylogic_epi32(a, bb, c, 0xE8);
+		__m512i t2 = _mm512_add_epi32(S0, maj);
+		h = g;
+		g = f;
+		f = e;
+		e = _mm512_add_epi32(d, t1);
+		d = c;
+		c = bb;
+		bb = a;
+		a = _mm512_add_epi32(t1, t2);
+	}
+	
+	state[0] = _mm512_add_epi32(state[0], a);
+	state[1] = _mm512_add_epi32(state[1], bb);
+	state[2] = _mm512_add_epi32(state[2], c);
+	state[3] = _mm512_add_epi32(state[3], d);
+	state[4] = _mm512_add_epi32(state[4], e);
+	state[5] = _mm512_add_epi32(state[5], f);
+	state[6] = _mm512_add_epi32(state[6], g);
+	state[7] = _mm512_add_epi32(state[7], h);
+}
+
+// Builds the padded final block(s) of _lanes messages of _length bytes each into _tail (128 bytes per message).
+// Returns the amount of final blocks per message.
+static unsigned int buildTailBlocks(const unsigned char* _data, unsigned int _length, unsigned int _lanes, unsigned char* _tail)
+{
+	unsigned int fullBlocks = _length / 64;
+	unsigned int tailLength = _length % 64;
+	unsigned int tailBlocks = (tailLength <= 55) ? 1 : 2;
+	unsigned long long bitLength = (unsigned long long)_length << 3;
+	
+	for (unsigned int lane = 0; lane < _lanes; lane++)
+	{
+		unsigned char* tail = &_tail[lane * 128];
+		memcpy(tail, _data + lane * (size_t)_length + fullBlocks * 64, tailLength);
+		memset(tail + tailLength, 0, tailBlocks * 64 - tailLength);
+		tail[tailLength] = 0x80;
+		for (int i = 0; i < 8; i++) tail[tailBlocks * 64 - 1 - i] = (unsigned char)(bitLength >> (8 * i));
+	}
+	return tailBlocks;
+}
+
+__attribute__((target("avx2")))
+static void hashMany_x8(const unsigned char* _data, unsigned int _length, unsigned char* _digests)
+{
+	__m256i state[8];
+	const uint32 h0[8] = { SHA256_H0 };
+	for (int i = 0; i < 8; i++) state[i] = _mm256_set1_epi32(h0[i]);
+	
+	compress_x8(state, _data, _length, _length / 64);
+	
+	if (_length == 64)
+	{
+		compressPadding64_x8(state);
+	}
+	else
+	{
+		alignas(32) unsigned char tail[8 * 128];
+		unsigned int tailBlocks = buildTailBlocks(_data, _length, 8, tail);
+		compress_x8(state, tail, 128, tailBlocks);
+	}
+	
+	alignas(32) uint32 words[8][8];
+	for (int i = 0; i < 8; i++) _mm256_store_si256((__m256i*)words[i], state[i]);
+	for (int lane = 0; lane < 8; lane++)
+	{
+		for (int i = 0; i < 8; i++) SHA2_UNPACK32(words[i][lane], &_digests[lane * 32 + i * 4]);
+	}
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void hashMany_x16(const unsigned char* _data, unsigned int _length, unsigned char* _digests)
+{
+	__m512i state[8];
+	const uint32 h0[8] = { SHA256_H0 };
+	for (int i = 0; i < 8; i++) state[i] = _mm512_set1_epi32(h0[i]);
+	
+	compress_x16(state, _data, _length, _length / 64);
+	
+	if (_length == 64)
+	{
+		compressPadding64_x16(state);
+	}
+	else
+	{
+		alignas(64) unsigned char tail[16 * 128];
+		unsigned int tailBlocks = buildTailBlocks(_data, _length, 16, tail);
+		compress_x16(state, tail, 128, tailBlocks);
+	}
+	
+	alignas(64) uint32 words[8][16];
+	for (int i = 0; i < 8; i++) _mm512_store_si512((void*)words[i], state[i]);
+	for (int lane = 0; lane < 16; lane++)
+	{
+		for (int i = 0; i < 8; i++) SHA2_UNPACK32(words[i][lane], &_digests[lane * 32 + i * 4]);
+	}
+}
+
+#pragma GCC diagnostic pop
+
+static bool cpuHasAvx512()
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+	if (!(ecx & bit_OSXSAVE)) return false;
+	unsigned int xcr0Low, xcr0High;
+	__asm__("xgetbv" : "=a"(xcr0Low), "=d"(xcr0High) : "c"(0));
+	if ((xcr0Low & 0xE6) != 0xE6) return false; // OS saves XMM, YMM, ZMM and opmask registers
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+	return (ebx & bit_AVX512F) && (ebx & bit_AVX512BW);
+}
+
+#endif // SHA256_X86
+
+#ifdef SHA256_ARM
+
+////////////////////////////////////////////
+//// ARMv8 crypto extensions backend
+
+#ifdef __clang__
+__attribute__((target("crypto")))
+#else
+__attribute__((target("+crypto")))
+#endif
+static void transform_armv8(uint32* m_h, const unsigned char* message, unsigned int block_nb)
+{
+	uint32x4_t state0 = vld1q_u32(&m_h[0]); // ABCD
+	uint32x4_t state1 = vld1q_u32(&m_h[4]); // EFGH
+	
+	for (unsigned int i = 0; i < block_nb; i++)
+	{
+		const unsigned char* sub_block = message + (i << 6);
+		uint32x4_t abcdSave = state0;
+		uint32x4_t efghSave = state1;
+		
+		// Ring buffer of the last 4 groups of 4 message words
+		uint32x4_t w[4];
+		for (int g = 0; g < 4; g++)
+		{
+			w[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(&sub_block[g << 4])));
+		}
+		
+		for (int g = 0; g < 16; g++)
+		{
+			if (g >= 4)
+			{
+				w[g & 3] = vsha256su1q_u32(vsha256su0q_u32(w[g & 3], w[(g + 1) & 3]), w[(g + 2) & 3], w[(g + 3) & 3]);
+			}
+			uint32x4_t msg = vaddq_u32(w[g & 3], vld1q_u32(&sha256_k[g << 2]));
+			uint32x4_t abcd = state0;
+			state0 = vsha256hq_u32(state0, state1, msg);
+			state1 = vsha256h2q_u32(state1, abcd, msg);
+		}
+		
+		state0 = vaddq_u32(state0, abcdSave);
+		state1 = vaddq_u32(state1, efghSave);
+	}
+	
+	vst1q_u32(&m_h[0], state0);
+	vst1q_u32(&m_h[4], state1);
+}
+
+static bool cpuHasArmv8Sha2()
+{
+	return getauxval(AT_HWCAP) & HWCAP_SHA2;
+}
+
+#endif // SHA256_ARM
+
+////////////////////////////////////////////
+//// Backend selection
+
+std::vector<SHA256Backend> sha256_supportedBackends()
+{
+	std::vector<SHA256Backend> ret;
+	ret.push_back({"scalar", transform_scalar});
+#ifdef SHA256_X86
+	if (cpuHasAvx2()) ret.push_back({"avx2", transform_avx2});
+	if (cpuHasShaNi()) ret.push_back({"sha-ni", transform_shani});
+#endif
+#ifdef SHA256_ARM
+	if (cpuHasArmv8Sha2()) ret.push_back({"armv8-crypto", transform_armv8});
+#endif
+	return ret;
+}
+
+// SHA256 of the 64 bytes at _data, without the buffering and padding of the SHA256 class
+static void hash64(const SHA256Backend& _backend, const unsigned char* _data, unsigned char* _digest)
+{
+	uint32 state[8] = { SHA256_H0 };
+	_backend.transform(state, _data, 1);
+	
+	// Dedicated SHA instructions compute the schedule themselves, only the portable rounds gain from the precomputed one
+	if (_backend.transform == transform_scalar) compressPadding64_scalar(state);
+	else _backend.transform(state, sha256_padding64, 1);
+	
+	for (int i = 0; i < 8; i++) SHA2_UNPACK32(state[i], &_digest[i * 4]);
+}
+
+// Hashes a few messages of different lengths with _backend and with the portable backend,
+// and returns whether all digests are equal.
+static bool backendMatchesScalar(const SHA256Backend& _backend)
+{
+	const SHA256Backend scalar = {"scalar", transform_scalar};
+	
+	unsigned char message[1024 + 64];
+	for (unsigned int i=0; i<sizeof(message); i++) message[i] = (unsigned char)(i * 167 + (i >> 5) * 13 + 1);
+	
+	for (unsigned int len : {0u, 1u, 55u, 56u, 63u, 64u, 65u, 119u, 128u, 1000u, 1024u, 1024u + 64u})
+	{
+		unsigned char digestScalar[SHA256::DIGEST_SIZE];
+		unsigned char digestBackend[SHA256::DIGEST_SIZE];
+		
+		SHA256 a(scalar);
+		a.update(message, len);
+		a.final(digestScalar);
+		
+		SHA256 b(_backend);
+		b.update(message, len);
+		b.final(digestBackend);
+		
+		if (memcmp(digestScalar, digestBackend, SHA256::DIGEST_SIZE) != 0) return false;
+	}
+	
+	unsigned char digestScalar[SHA256::DIGEST_SIZE];
+	unsigned char digestBackend[SHA256::DIGEST_SIZE];
+	SHA256 a(scalar);
+	a.update(message, 64);
+	a.final(digestScalar);
+	hash64(_backend, message, digestBackend);
+	if (memcmp(digestScalar, digestBackend, SHA256::DIGEST_SIZE) != 0) return false;
+	
+	return true;
+}
+
+bool sha256_selfTest(const SHA256Backend& _backend)
+{
+	// SHA256("abc")
+	const unsigned char expected[SHA256::DIGEST_SIZE] = {
+		0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+		0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad,
+	};
+	unsigned char digest[SHA256::DIGEST_SIZE];
+	SHA256 sha256(_backend);
+	sha256.update((const unsigned char*)"abc", 3);
+	sha256.final(digest);
+	if (memcmp(digest, expected, SHA256::DIGEST_SIZE) != 0) return false;
+	
+	return backendMatchesScalar(_backend);
+}
+
+static SHA256Backend selectBackend()
+{
+	// The last supported backend is the fastest one.
+	// A backend that disagrees with the portable one is never used.
+	std::vector<SHA256Backend> backends = sha256_supportedBackends();
+	for (size_t i=backends.size()-1; i>0; i--)
+	{
+		if (backendMatchesScalar(backends[i])) return backends[i];
+	}
+	return backends[0];
+}
+
+const SHA256Backend& sha256_activeBackend()
+{
+	static const SHA256Backend backend = selectBackend();
+	return backend;
+}
+
+std::vector<SHA256MultiBackend> sha256_supportedMultiBackends()
+{
+	std::vector<SHA256MultiBackend> ret;
+#ifdef SHA256_X86
+	if (cpuHasAvx2()) ret.push_back({"avx2-x8", 8, hashMany_x8});
+	if (cpuHasAvx512()) ret.push_back({"avx512-x16", 16, hashMany_x16});
+#endif
+	return ret;
+}
+
+bool sha256_selfTest(const SHA256MultiBackend& _backend)
+{
+	const SHA256Backend scalar = {"scalar", transform_scalar};
+	
+	for (unsigned int length : {1u, 55u, 56u, 64u, 100u, 1024u})
+	{
+		std::vector<unsigned char> messages(_backend.lanes * length);
+		for (size_t i=0; i<messages.size(); i++) messages[i] = (unsigned char)(i * 167 + (i >> 5) * 13 + 1);
+		
+		std::vector<unsigned char> digests(_backend.lanes * SHA256::DIGEST_SIZE);
+		_backend.hashMany(messages.data(), length, digests.data());
+		
+		for (unsigned int lane=0; lane<_backend.lanes; lane++)
+		{
+			unsigned char digest[SHA256::DIGEST_SIZE];
+			SHA256 sha256(scalar);
+			sha256.update(&messages[lane * length], length);
+			sha256.final(digest);
+			if (memcmp(digest, &digests[lane * SHA256::DIGEST_SIZE], SHA256::DIGEST_SIZE) != 0) return false;
+		}
+	}
+	return true;
+}
+
+// Whether _backend uses dedicated SHA256 instructions
+static bool usesShaInstructions(const SHA256Backend& _backend)
+{
+#ifdef SHA256_X86
+	if (_backend.transform == transform_shani) return true;
+#endif
+#ifdef SHA256_ARM
+	if (_backend.transform == transform_armv8) return true;
+#endif
+	return false;
+}
+
+static const SHA256MultiBackend* selectMultiBackend()
+{
+	// Like the single-buffer backends, the last supported one is the fastest, and one that fails its self-test is never
+	// used. Dedicated SHA instructions beat AVX2 x8 but not AVX-512 x16, so with those only x16 is worth using.
+	static std::vector<SHA256MultiBackend> backends = sha256_supportedMultiBackends();
+	bool shaInstructions = usesShaInstructions(sha256_activeBackend());
+	
+	for (size_t i=backends.size(); i>0; i--)
+	{
+		const SHA256MultiBackend& backend = backends[i - 1];
+		if (shaInstructions && backend.lanes < 16) continue;
+		if (sha256_selfTest(backend)) return &backend;
+	}
+	return nullptr;
+}
+
+const SHA256MultiBackend* sha256_activeMultiBackend()
+{
+	static const SHA256MultiBackend* backend = selectMultiBackend();
+	return backend;
+}
+
+void sha256_hashMany(const unsigned char* _data, unsigned int _amount, unsigned int _length, unsigned char* _digests)
+{
+	unsigned int i = 0;
+	
+	const SHA256MultiBackend* multi = sha256_activeMultiBackend();
+	if (multi != nullptr)
+	{
+		for (; i + multi->lanes <= _amount; i += multi->lanes)
+		{
+			multi->hashMany(&_data[i * (size_t)_length], _length, &_digests[i * SHA256::DIGEST_SIZE]);
+		}
+	}
+	
+	if (_length == 64)
+	{
+		const SHA256Backend& backend = sha256_activeBackend();
+		for (; i < _amount; i++) hash64(backend, &_data[i * 64], &_digests[i * SHA256::DIGEST_SIZE]);
+		return;
+	}
+	
+	for (; i < _amount; i++)
+	{
+		SHA256 sha256;
+		sha256.update(&_data[i * (size_t)_length], _length);
+		sha256.final(&_digests[i * SHA256::DIGEST_SIZE]);
+	}
+}
+
+////////////////////////////////////////////
+//// SHA256
+
+SHA256::SHA256():
+	backend(sha256_activeBackend().transform)
+{
+	this->init();
+}
+
+SHA256::SHA256(const SHA256Backend& _backend):
+	backend(_backend.transform)
+{
+	this->init();
+}
+
+void SHA256::transform(const unsigned char* message, unsigned int block_nb)
+{
+	if (block_nb == 0) return;
+	backend(m_h, message, block_nb);
+}
+
 void SHA256::init()
 {
 	m_h[0] = 0x6a09e667;
@@ -1,6 +1,46 @@
 #ifndef SHA256_H
 #define SHA256_H
 #include <string>
+#include <vector>
+
+// A SHA256 compression function implementation: runs block_nb 64-byte blocks through the state.
+struct SHA256Backend
+{
+	const char* name;
+	void (*transform)(unsigned int* state, const unsigned char* message, unsigned int block_nb);
+};
+
+// All backends that are compiled in and supported by this CPU. The portable one is always first.
+std::vector<SHA256Backend> sha256_supportedBackends();
+
+// The fastest supported backend, chosen once on first use.
+const SHA256Backend& sha256_activeBackend();
+
+// Checks _backend against a known digest and against the portable backend.
+bool sha256_selfTest(const SHA256Backend& _backend);
+
+// A multi-buffer implementation: hashes `lanes` messages of `length` bytes each, stored back to back at data,
+// writing `lanes` digests back to back to digests.
+struct SHA256MultiBackend
+{
+	const char* name;
+	unsigned int lanes;
+	void (*hashMany)(const unsigned char* data, unsigned int length, unsigned char* digests);
+};
+
+// All multi-buffer backends that are compiled in and supported by this CPU.
+std::vector<SHA256MultiBackend> sha256_supportedMultiBackends();
+
+// The multi-buffer backend used by sha256_hashMany, or nullptr if hashing one message at a time is faster.
+const SHA256MultiBackend* sha256_activeMultiBackend();
+
+// Checks _backend against the portable single-buffer backend.
+bool sha256_selfTest(const SHA256MultiBackend& _backend);
+
+// Hashes _amount messages of _length bytes each, stored back to back at _data.
+// Writes _amount digests back to back to _digests.
+// 64-byte messages, such as the two child hashes of a merkel tree node, skip the runtime padding.
+void sha256_hashMany(const unsigned char* _data, unsigned int _amount, unsigned int _length, unsigned char* _digests);
 
 class SHA256
 {
@@ -9,16 +49,17 @@ protected:
 	typedef unsigned int uint32;
 	typedef unsigned long long uint64;
 
-	const static uint32 sha256_k[];
 	static const unsigned int SHA224_256_BLOCK_SIZE = (512 / 8);
 public:
 	SHA256();
+	SHA256(const SHA256Backend& _backend);
 	void init();
 	void update(const unsigned char* message, unsigned int len);
 	void final(unsigned char* digest);
 	static const unsigned int DIGEST_SIZE = (256 / 8);
 
 protected:
+	void (*backend)(unsigned int* state, const unsigned char* message, unsigned int block_nb);
 	void transform(const unsigned char* message, unsigned int block_nb);
 	unsigned int m_tot_len;
 	unsigned int m_len;
@@ -0,0 +1,147 @@
+#include <string>
+#include <array>
+#include <optional>
+#include <mutex>
+
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+
+#include "util.h"
+#include "sqlite3.h"
+#include "stat_cache.h"
+
+bool FileStat::operator==(const FileStat& _other) const
+{
+	return this->device == _other.device &&
+		this->inode == _other.inode &&
+		this->size == _other.size &&
+		this->mtimeNs == _other.mtimeNs &&
+		this->ctimeNs == _other.ctimeNs;
+}
+
+bool FileStat::operator!=(const FileStat& _other) const
+{
+	return !(*this == _other);
+}
+
+FileStat statFile(const std::string& _path)
+{
+	struct stat st;
+	if (stat(_path.c_str(), &st) != 0) exitWithError("Failed to stat file " + _path + ": " + strerror(errno));
+	
+	FileStat ret;
+	ret.device = st.st_dev;
+	ret.inode = st.st_ino;
+	ret.size = st.st_size;
+	ret.mtimeNs = st.st_mtim.tv_sec * 1000000000L + st.st_mtim.tv_nsec;
+	ret.ctimeNs = st.st_ctim.tv_sec * 1000000000L + st.st_ctim.tv_nsec;
+	return ret;
+}
+
+StatCache::StatCache(const std::string& _dbPath) :
+	dbPath(_dbPath)
+{
+}
+
+StatCache::~StatCache()
+{
+	if (this->db == nullptr) return;
+	sqlite3_finalize(this->lookupStmt);
+	sqlite3_finalize(this->storeStmt);
+	sqlite3_close(this->db);
+}
+
+void StatCache::open()
+{
+	if (this->db != nullptr) return;
+	
+	int sqlite_returncode = sqlite3_open(this->dbPath.c_str(), &this->db);
+	if (sqlite_returncode != SQLITE_OK)
+	{
+		exitWithError("Cannot open stat cache at " + this->dbPath + " because of sqlite error " + std::to_string(sqlite_returncode) + ": " + sqlite3_errmsg(this->db));
+	}
+	
+	// The cache can always be rebuilt by hashing again, so a lost transaction on power failure is fine
+	const char* setupQueries[] = {
+		"PRAGMA journal_mode = WAL",
+		"PRAGMA synchronous = NORMAL",
+		"PRAGMA busy_timeout = 10000",
+		"CREATE TABLE IF NOT EXISTS stat_cache"
+		"("
+		"	device INTEGER NOT NULL,"
+		"	inode INTEGER NOT NULL,"
+		"	size INTEGER NOT NULL,"
+		"	mtime_ns INTEGER NOT NULL,"
+		"	ctime_ns INTEGER NOT NULL,"
+		"	hash BLOB NOT NULL,"
+		"	PRIMARY KEY(device, inode)"
+		") WITHOUT ROWID"
+	};
+	for (const char* query : setupQueries)
+	{
+		char* errorMessage = nullptr;
+		if (sqlite3_exec(this->db, query, nullptr, nullptr, &errorMessage) != SQLITE_OK)
+		{
+			std::string error = errorMessage != nullptr ? errorMessage : "unknown error";
+			sqlite3_free(errorMessage);
+			exitWithError("Failed to set up stat cache at " + this->dbPath + ": " + error);
+		}
+	}
+	
+	const char* lookupQuery = "SELECT size, mtime_ns, ctime_ns, hash FROM stat_cache WHERE device = ? AND inode = ?";
+	const char* storeQuery = "INSERT OR REPLACE INTO stat_cache (device, inode, size, mtime_ns, ctime_ns, hash) VALUES (?, ?, ?, ?, ?, ?)";
+	if (sqlite3_prepare_v2(this->db, lookupQuery, -1, &this->lookupStmt, nullptr) != SQLITE_OK ||
+		sqlite3_prepare_v2(this->db, storeQuery, -1, &this->storeStmt, nullptr) != SQLITE_OK)
+	{
+		exitWithError("Failed to prepare stat cache queries: " + std::string(sqlite3_errmsg(this->db)));
+	}
+}
+
+std::optional<std::array<char, 32>> StatCache::lookup(const FileStat& _stat)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->open();
+	
+	sqlite3_reset(this->lookupStmt);
+	sqlite3_bind_int64(this->lookupStmt, 1, _stat.device);
+	sqlite3_bind_int64(this->lookupStmt, 2, _stat.inode);
+	
+	int stepResult = sqlite3_step(this->lookupStmt);
+	if (stepResult == SQLITE_DONE)
+	{
+		sqlite3_reset(this->lookupStmt);
+		return std::nullopt;
+	}
+	if (stepResult != SQLITE_ROW) exitWithError("Stat cache lookup failed: " + std::string(sqlite3_errmsg(this->db)));
+	
+	// A different size or time means the inode was modified or reused since it was cached
+	std::optional<std::array<char, 32>> ret;
+	if (sqlite3_column_int64(this->lookupStmt, 0) == _stat.size &&
+		sqlite3_column_int64(this->lookupStmt, 1) == _stat.mtimeNs &&
+		sqlite3_column_int64(this->lookupStmt, 2) == _stat.ctimeNs &&
+		sqlite3_column_bytes(this->lookupStmt, 3) == 32)
+	{
+		ret = sqlite3_column_32chars(this->lookupStmt, 3);
+	}
+	
+	// Don't leave the statement on its row, that keeps the read transaction open until the next lookup
+	sqlite3_reset(this->lookupStmt);
+	return ret;
+}
+
+void StatCache::store(const FileStat& _stat, const std::array<char, 32>& _hash)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->open();
+	
+	sqlite3_reset(this->storeStmt);
+	sqlite3_bind_int64(this->storeStmt, 1, _stat.device);
+	sqlite3_bind_int64(this->storeStmt, 2, _stat.inode);
+	sqlite3_bind_int64(this->storeStmt, 3, _stat.size);
+	sqlite3_bind_int64(this->storeStmt, 4, _stat.mtimeNs);
+	sqlite3_bind_int64(this->storeStmt, 5, _stat.ctimeNs);
+	sqlite3_bind_blob(this->storeStmt, 6, _hash.data(), 32, SQLITE_TRANSIENT);
+	
+	if (sqlite3_step(this->storeStmt) != SQLITE_DONE) exitWithError("Stat cache store failed: " + std::string(sqlite3_errmsg(this->db)));
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <array>
+#include <optional>
+#include <mutex>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+// What stat() says about a file. If none of it changed, the file's contents are assumed not to have changed either.
+struct FileStat
+{
+	long device;
+	long inode;
+	long size;
+	long mtimeNs;
+	long ctimeNs;
+	
+	bool operator==(const FileStat& _other) const;
+	bool operator!=(const FileStat& _other) const;
+};
+
+// Exits with an error if _path can't be stat'ed
+FileStat statFile(const std::string& _path);
+
+// Persistent map from FileStat to the merkel root hash of the file, stored in an sqlite database.
+// The database is only opened (and created if needed) on first use. All methods are thread-safe.
+class StatCache
+{
+private:
+	std::string dbPath;
+	sqlite3* db = nullptr;
+	sqlite3_stmt* lookupStmt = nullptr;
+	sqlite3_stmt* storeStmt = nullptr;
+	std::mutex mutex;
+	
+	void open();
+public:
+	StatCache(const std::string& _dbPath);
+	~StatCache();
+	StatCache(const StatCache&) = delete;
+	StatCache& operator=(const StatCache&) = delete;
+	
+	std::optional<std::array<char, 32>> lookup(const FileStat& _stat);
+	void store(const FileStat& _stat, const std::array<char, 32>& _hash);
+};
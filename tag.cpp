@@ -7,7 +7,7 @@
 #include <string>
 #include <optional>
 
-#include "sha256.h"
+#include "hash_algorithm.h"
 #include "util.h"
 #include "sqlite3.h"
 #include "tag.h"
@@ -81,10 +81,7 @@ Tag::Tag(const std::array<char, 32>& parentHashSum, const std::array<char, 32>&
 Tag::Tag(const std::string& _name):
 	name(_name)
 {
-	thisHash.emplace(ZERO_HASH);
-	SHA256 hasher;
-	hasher.update((const unsigned char*)_name.data(), _name.length());
-	hasher.final((unsigned char*)thisHash->data());
+	thisHash = hashBytes(TAG_HASH_ALGORITHM, _name.data(), _name.length());
 }
 
 Tag::Tag(const std::vector<std::string>& _nestedTags):
@@ -8,7 +8,7 @@
 #include "util.h"
 #include "sqlite3.h"
 #include "tag_query.h"
-#include "sha256.h"
+#include "hash_algorithm.h"
 
 bool TagQuery::matches(const std::array<char, 32>& hashSum, sqlite3* tagbase_db) const
 {
@@ -555,9 +555,7 @@ TagQuery_HasTag::TagQuery_HasTag(TagQueryType _type, const std::string& _tagName
 	TagQuery(_type),
 	tagName(_tagName)
 {
-	SHA256 ctx;
-	ctx.update((const unsigned char*)_tagName.data(), _tagName.length());
-	ctx.final((unsigned char*)this->hash.data());
+	this->hash = hashBytes(TAG_HASH_ALGORITHM, _tagName.data(), _tagName.length());
 }
 
 TagQuery_HasChildTag::TagQuery_HasChildTag(const std::string& _tagName):
@@ -1,13 +1,16 @@
 #include <random>
 #include <sstream>
+#include <mutex>
 
 static std::random_device rd;
 static std::mt19937 gen(rd());
 static std::uniform_int_distribution<> dis(0, 15);
 static std::uniform_int_distribution<> dis2(8, 11);
+static std::mutex genMutex;
 
 std::string generate_uuid_v4()
 {
+	std::lock_guard<std::mutex> lock(genMutex);
 	std::stringstream ss;
 	int i;
 	ss << std::hex;